@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vak_archive.h"
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-f from] [-t to] [-k key] [-x] archive\n", argv0);
+    fprintf(stderr, "  -f from      only responses received at or after this time, in seconds since the epoch\n");
+    fprintf(stderr, "  -t to        only responses received before this time\n");
+    fprintf(stderr, "  -k key       only responses from the server with a public key starting with these 8 hex digits\n");
+    fprintf(stderr, "  -x           dump the responses in hex\n");
+    exit(1);
+}
+
+static int parse_key(const char *s, uint8_t *key)
+{
+    unsigned i, v;
+
+    if (strlen(s) != 8)
+        return -1;
+
+    for (i = 0; i < 4; i++) {
+        if (sscanf(s + 2 * i, "%2x", &v) != 1)
+            return -1;
+        key[i] = v;
+    }
+
+    return 0;
+}
+
+static void dump(const uint8_t *p, unsigned length)
+{
+    unsigned i;
+
+    for (i = 0; i < length; i++)
+        printf("%02x%s", p[i], i % 32 == 31 || i == length - 1 ? "\n" : "");
+}
+
+/* Print the responses in an archive written by vakd */
+int main(int argc, char *argv[])
+{
+    struct vak_archive_map map;
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    uint8_t key[4];
+    uint32_t server_id = 0;
+    int by_server = 0, hex = 0;
+    uint64_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:k:x")) != -1) {
+        switch (opt) {
+        case 'f':
+            from = (int64_t)(atof(optarg) * 1000000);
+            break;
+        case 't':
+            to = (int64_t)(atof(optarg) * 1000000);
+            break;
+        case 'k':
+            if (parse_key(optarg, key) < 0)
+                usage(argv[0]);
+            server_id = vak_archive_server_id(key);
+            by_server = 1;
+            break;
+        case 'x':
+            hex = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (vak_archive_map(argv[optind], &map) < 0) {
+        fprintf(stderr, "%s: can not map archive and index\n", argv[optind]);
+        exit(1);
+    }
+
+    /* Only the index is read to find the records, the archive is
+     * only touched for the records that are printed */
+    for (i = vak_archive_find(&map, from); i < map.count; i++) {
+        const struct vak_archive_index *entry = vak_archive_entry(&map, i);
+        const struct vak_archive_record *record;
+        unsigned k;
+
+        if (entry->recv_time >= to)
+            break;
+        if (by_server && entry->server_id != server_id)
+            continue;
+
+        record = vak_archive_record(&map, i);
+        if (!record) {
+            fprintf(stderr, "entry %llu points outside the archive\n", (unsigned long long)i);
+            continue;
+        }
+
+        printf("%lld.%06lld ",
+               (long long)(record->recv_time / 1000000), (long long)(record->recv_time % 1000000));
+        for (k = 0; k < 8; k++)
+            printf("%02x", record->public_key[k]);
+        printf(" variant %u size %u rtt %.3f ms ",
+               (unsigned)record->variant, (unsigned)record->length,
+               (double)(record->recv_time - record->send_time) / 1000);
+        if (record->result)
+            printf("error %d\n", (int)record->result);
+        else
+            printf("ok\n");
+
+        if (hex)
+            dump(vak_archive_response(record), record->length);
+    }
+
+    vak_archive_unmap(&map);
+
+    return 0;
+}
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vak.h"
+#include "vrt.h"
+
+/* Default for how long to collect nonces before querying upstream,
+ * in microseconds */
+static const vak_time_t DEFAULT_WINDOW = 5000;
+
+/* How long to wait for the upstream server, in microseconds */
+static const vak_time_t QUERY_TIMEOUT = 1000000;
+
+/* Batches waiting for a response from upstream at the same time */
+#define MAX_IN_FLIGHT 8
+
+/* Datagrams to receive from upstream in one go */
+#define RECV_BATCH 8
+
+struct vakbatch_requester {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint8_t nonce[VAK_BATCH_NONCE_SIZE];
+};
+
+struct vakbatch {
+    struct vakbatch_requester requesters[VAK_BATCH_MAX_LEAVES];
+    unsigned count;
+
+    /* The tree over the nonces, only set once the batch has been sent */
+    struct vak_tree *tree;
+
+    const struct vak_server *server;
+    int channel;
+
+    /* Monotonic time when the batch is sent or given up on */
+    vak_time_t deadline;
+};
+
+struct vakbatch_upstream {
+    struct vak_server const **servers;
+    struct vak_addr *addrs;
+    unsigned nr_servers;
+    unsigned next;
+};
+
+static struct vakbatch collecting;
+static struct vakbatch in_flight[MAX_IN_FLIGHT];
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-p port] [-u path] [-w window]\n", argv0);
+    fprintf(stderr, "  -p port      UDP port to answer on, 0 to not use UDP, default %u\n", VAK_BATCH_PORT);
+    fprintf(stderr, "  -u path      also answer on a UNIX datagram socket\n");
+    fprintf(stderr, "  -w window    how long to collect requests in microseconds, default %u\n",
+            (unsigned)DEFAULT_WINDOW);
+    exit(1);
+}
+
+static int vakbatch_udp_socket(unsigned port)
+{
+    struct sockaddr_in6 sin6;
+    int off = 0;
+    int fd;
+
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Answer both IPv4 and IPv6 clients */
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(port);
+    sin6.sin6_addr = in6addr_any;
+    if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
+        fprintf(stderr, "bind port %u failed: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int vakbatch_unix_socket(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "bind %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Look up the addresses of all servers once */
+static int vakbatch_resolve(struct vakbatch_upstream *up)
+{
+    const char **hosts;
+    unsigned *ports;
+    unsigned i;
+    int r = -1;
+
+    for (up->nr_servers = 0; up->servers[up->nr_servers]; up->nr_servers++)
+        ;
+
+    hosts = malloc(up->nr_servers * sizeof(*hosts));
+    ports = malloc(up->nr_servers * sizeof(*ports));
+    up->addrs = malloc(up->nr_servers * VAK_MAX_ADDRS * sizeof(*up->addrs));
+
+    if (hosts && ports && up->addrs) {
+        for (i = 0; i < up->nr_servers; i++) {
+            hosts[i] = up->servers[i]->host;
+            ports[i] = up->servers[i]->port;
+        }
+        r = vak_udp_resolve_many(hosts, ports, up->addrs, up->nr_servers);
+    }
+
+    free(hosts);
+    free(ports);
+
+    return r > 0 ? 0 : -1;
+}
+
+static void vakbatch_done(struct vak_udp *udp, struct vakbatch *batch)
+{
+    if (batch->channel > 0)
+        vak_udp_close_channel(udp, batch->channel);
+    vak_tree_del(batch->tree);
+    batch->tree = NULL;
+    batch->count = 0;
+}
+
+/* Send the batch being collected upstream, with the root of the tree
+ * over all its nonces as the nonce */
+static void vakbatch_send(struct vak_udp *udp, struct vakbatch_upstream *up, vak_time_t now)
+{
+    uint8_t nonces[VAK_BATCH_MAX_LEAVES * VAK_BATCH_NONCE_SIZE];
+    uint8_t query[VRT_QUERY_PACKET_LEN];
+    struct vakbatch *batch = NULL;
+    const struct vak_addr *addr = NULL;
+    struct vak_udp_msg msg;
+    unsigned i;
+    int length;
+
+    for (i = 0; i < MAX_IN_FLIGHT; i++) {
+        if (!in_flight[i].count) {
+            batch = &in_flight[i];
+            break;
+        }
+    }
+
+    /* The requesters will time out and try again */
+    if (!batch) {
+        fprintf(stderr, "too many batches in flight, dropping %u requests\n", collecting.count);
+        collecting.count = 0;
+        return;
+    }
+
+    *batch = collecting;
+    batch->channel = 0;
+    collecting.count = 0;
+
+    /* Spread the batches over all servers */
+    for (i = 0; i < up->nr_servers && !addr; i++) {
+        unsigned s = up->next++ % up->nr_servers;
+        if (up->addrs[s * VAK_MAX_ADDRS].family) {
+            batch->server = up->servers[s];
+            addr = &up->addrs[s * VAK_MAX_ADDRS];
+        }
+    }
+    if (!addr) {
+        fprintf(stderr, "no servers\n");
+        batch->count = 0;
+        return;
+    }
+
+    for (i = 0; i < batch->count; i++)
+        memcpy(nonces + i * VAK_BATCH_NONCE_SIZE, batch->requesters[i].nonce, VAK_BATCH_NONCE_SIZE);
+    batch->tree = vak_tree_new(nonces, batch->count);
+    if (!batch->tree) {
+        fprintf(stderr, "vak_tree_new failed\n");
+        batch->count = 0;
+        return;
+    }
+
+    length = vrt_make_query(query, sizeof(query), (uint8_t *)vak_tree_root(batch->tree),
+                            VAK_TREE_NODE_SIZE, batch->server->variant);
+    if (length < 0) {
+        fprintf(stderr, "vrt_make_query failed\n");
+        vakbatch_done(udp, batch);
+        return;
+    }
+
+    /* Fall back to the shared socket if there is no channel */
+    batch->channel = vak_udp_open_channel(udp, addr);
+
+    msg.addr = *addr;
+    msg.buffer = query;
+    msg.length = length;
+    msg.channel = batch->channel > 0 ? batch->channel : 0;
+
+    if (vak_udp_send_batch(udp, &msg, 1) != 1) {
+        fprintf(stderr, "%s:%u: send failed\n", batch->server->host, batch->server->port);
+        vakbatch_done(udp, batch);
+        return;
+    }
+
+    batch->deadline = now + QUERY_TIMEOUT;
+}
+
+/* Give every requester in the batch the response and its own path */
+static void vakbatch_reply(struct vakbatch *batch, const void *response, unsigned length)
+{
+    uint8_t path[VAK_BATCH_MAX_DEPTH * VAK_TREE_NODE_SIZE];
+    uint8_t reply[VAK_BATCH_PACKET_SIZE];
+    unsigned depth = vak_tree_depth(batch->tree);
+    unsigned i;
+
+    for (i = 0; i < batch->count; i++) {
+        struct vakbatch_requester *r = &batch->requesters[i];
+        int len;
+
+        vak_tree_path(batch->tree, i, path);
+        len = vak_batch_make_reply(reply, r->nonce, batch->server, i, path, depth,
+                                   response, length);
+        if (len < 0) {
+            fprintf(stderr, "%s:%u: response too large to pass on\n",
+                    batch->server->host, batch->server->port);
+            return;
+        }
+
+        if (sendto(r->fd, reply, len, 0, (struct sockaddr *)&r->addr, r->addrlen) < 0)
+            fprintf(stderr, "sendto failed: %s\n", strerror(errno));
+    }
+}
+
+/* Match responses from upstream to the batches in flight.  Only the
+ * framing and the root are checked here, the requesters verify the
+ * signatures themselves. */
+static void vakbatch_upstream_input(struct vak_udp *udp)
+{
+    static uint32_t buffers[RECV_BATCH][VRT_QUERY_PACKET_LEN / 4];
+    struct vak_udp_msg msgs[RECV_BATCH];
+    int i, n;
+    unsigned b;
+
+    for (i = 0; i < RECV_BATCH; i++) {
+        msgs[i].buffer = buffers[i];
+        msgs[i].size = sizeof(buffers[i]);
+    }
+
+    n = vak_udp_recv_batch(udp, msgs, RECV_BATCH);
+
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < MAX_IN_FLIGHT; b++) {
+            struct vakbatch *batch = &in_flight[b];
+
+            if (!batch->count || (msgs[i].channel && (int)msgs[i].channel != batch->channel))
+                continue;
+
+            if (vrt_precheck_response((uint8_t *)vak_tree_root(batch->tree), VAK_TREE_NODE_SIZE,
+                                      msgs[i].buffer, msgs[i].length,
+                                      batch->server->variant) != VRT_SUCCESS)
+                continue;
+
+            vakbatch_reply(batch, msgs[i].buffer, msgs[i].length);
+            vakbatch_done(udp, batch);
+            break;
+        }
+    }
+}
+
+/* Collect all requests waiting on a socket */
+static void vakbatch_collect(int fd, struct vak_udp *udp, struct vakbatch_upstream *up,
+                             vak_time_t window)
+{
+    uint8_t request[VAK_BATCH_PACKET_SIZE + 1];
+
+    while (1) {
+        struct vakbatch_requester *r = &collecting.requesters[collecting.count];
+        vak_time_t now;
+        ssize_t n;
+
+        r->addrlen = sizeof(r->addr);
+        n = recvfrom(fd, request, sizeof(request), 0, (struct sockaddr *)&r->addr, &r->addrlen);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "recvfrom failed: %s\n", strerror(errno));
+            return;
+        }
+
+        if (!vak_batch_parse_request(request, n, r->nonce))
+            continue;
+
+        now = vak_get_monotonic();
+        r->fd = fd;
+        if (!collecting.count++)
+            collecting.deadline = now + window;
+
+        if (collecting.count == VAK_BATCH_MAX_LEAVES)
+            vakbatch_send(udp, up, now);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct vakbatch_upstream up;
+    struct vak_udp *udp;
+    const char *unix_path = NULL;
+    unsigned port = VAK_BATCH_PORT;
+    vak_time_t window = DEFAULT_WINDOW;
+    int udp_fd = -1, unix_fd = -1;
+    unsigned i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || window < 0 || (!port && !unix_path))
+        usage(argv[0]);
+
+    if (vak_seed_random() < 0) {
+        fprintf(stderr, "vak_seed_random failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    memset(&up, 0, sizeof(up));
+    up.servers = vak_get_randomized_servers();
+    udp = vak_udp_new();
+    if (!up.servers || !udp || vakbatch_resolve(&up) < 0) {
+        fprintf(stderr, "setting up failed\n");
+        exit(1);
+    }
+
+    if (port) {
+        udp_fd = vakbatch_udp_socket(port);
+        if (udp_fd < 0 || vak_udp_watch_fd(udp, udp_fd) < 0)
+            exit(1);
+    }
+    if (unix_path) {
+        unix_fd = vakbatch_unix_socket(unix_path);
+        if (unix_fd < 0 || vak_udp_watch_fd(udp, unix_fd) < 0)
+            exit(1);
+    }
+
+    while (1) {
+        vak_time_t now, deadline = VAK_TIME_MAX;
+
+        vakbatch_upstream_input(udp);
+
+        if (udp_fd >= 0)
+            vakbatch_collect(udp_fd, udp, &up, window);
+        if (unix_fd >= 0)
+            vakbatch_collect(unix_fd, udp, &up, window);
+
+        now = vak_get_monotonic();
+
+        if (collecting.count && now >= collecting.deadline)
+            vakbatch_send(udp, &up, now);
+        if (collecting.count)
+            deadline = collecting.deadline;
+
+        for (i = 0; i < MAX_IN_FLIGHT; i++) {
+            struct vakbatch *batch = &in_flight[i];
+
+            if (!batch->count)
+                continue;
+
+            if (now >= batch->deadline) {
+                fprintf(stderr, "%s:%u: timeout\n", batch->server->host, batch->server->port);
+                vakbatch_done(udp, batch);
+            } else if (batch->deadline < deadline) {
+                deadline = batch->deadline;
+            }
+        }
+
+        if (vak_udp_wait(udp, deadline == VAK_TIME_MAX ? QUERY_TIMEOUT : deadline - now) < 0) {
+            fprintf(stderr, "vak_udp_wait failed\n");
+            exit(1);
+        }
+    }
+}
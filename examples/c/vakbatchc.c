@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vak.h"
+
+/* How long to wait for the front end, in milliseconds, which
+ * includes the time it collects requests before querying upstream */
+static const int TIMEOUT = 2000;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s host [port]\n", argv0);
+    fprintf(stderr, "       %s -u path\n", argv0);
+    exit(1);
+}
+
+static int connect_udp(const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+    int r;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if (r) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(r));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "connect %s failed: %s\n", host, strerror(errno));
+
+    return fd;
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    sa_family_t family = AF_UNIX;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Bind to an autogenerated abstract address so that the relay has
+     * somewhere to send the reply */
+    if (bind(fd, (struct sockaddr *)&family, sizeof(family)) < 0) {
+        fprintf(stderr, "bind failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "connect %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct vak_server const **servers;
+    uint8_t nonce[VAK_BATCH_NONCE_SIZE];
+    uint8_t request[VAK_BATCH_PACKET_SIZE];
+    uint8_t reply[VAK_BATCH_PACKET_SIZE + 1];
+    char port[16];
+    vak_time_t send_time, recv_time, deadline;
+    overlap_value_t lo, hi;
+    int fd;
+
+    if (argc < 2 || argc > 3)
+        usage(argv[0]);
+
+    if (!strcmp(argv[1], "-u")) {
+        if (argc != 3)
+            usage(argv[0]);
+        fd = connect_unix(argv[2]);
+    } else {
+        if (argc == 3)
+            snprintf(port, sizeof(port), "%s", argv[2]);
+        else
+            snprintf(port, sizeof(port), "%u", VAK_BATCH_PORT);
+        fd = connect_udp(argv[1], port);
+    }
+    if (fd < 0)
+        exit(1);
+
+    /* The same servers we would query directly */
+    servers = vak_get_servers();
+    if (!servers) {
+        fprintf(stderr, "vak_get_servers failed\n");
+        exit(1);
+    }
+
+    if (vak_get_nonce(nonce, sizeof(nonce)) < 0) {
+        fprintf(stderr, "vak_get_nonce failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    vak_batch_make_request(request, nonce);
+
+    send_time = vak_get_time();
+    if (send(fd, request, sizeof(request), 0) < 0) {
+        fprintf(stderr, "send failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    deadline = vak_get_monotonic() + (vak_time_t)TIMEOUT * 1000;
+
+    /* Anybody can send us something, keep waiting for the real reply */
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        vak_time_t left = deadline - vak_get_monotonic();
+        ssize_t n;
+
+        if (left <= 0 || poll(&pfd, 1, (left + 999) / 1000) == 0) {
+            fprintf(stderr, "no reply from front end\n");
+            exit(1);
+        }
+
+        n = recv(fd, reply, sizeof(reply), MSG_DONTWAIT);
+        recv_time = vak_get_time();
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            fprintf(stderr, "recv failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (vak_batch_parse_reply(reply, n, nonce, servers,
+                                  send_time, recv_time, &lo, &hi))
+            break;
+
+        fprintf(stderr, "ignoring bad reply\n");
+    }
+
+    printf("adjustment %.6f .. %.6f, adjust by %.6f +/- %.6f seconds\n",
+           lo, hi, (lo + hi) / 2, (hi - lo) / 2);
+
+    vak_servers_del(servers);
+    close(fd);
+
+    return 0;
+}
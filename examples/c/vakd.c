@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include "vak.h"
+#include "vak_shm.h"
+
+/* Step the clock instead of slewing it if it is off by more than
+ * this many seconds.  Slewing 0.5 seconds takes about 17 minutes. */
+static const double STEP_THRESHOLD = 0.5;
+
+/* Largest frequency correction the kernel accepts, in ppm */
+static const double MAX_FREQ = 500;
+
+/* Longest time between syncs in seconds, and the time before trying
+ * again after a failure or when no interval keeps within the error */
+static const unsigned MAX_INTERVAL = 7 * 86400;
+static const unsigned RETRY_INTERVAL = 60;
+
+/* Frequency error of the monotonic clock assumed in the published
+ * time until the drift is known, in ppm */
+static const double UNKNOWN_DRIFT = 500;
+
+/* Default for the largest acceptable error of the clock in seconds */
+static const double DEFAULT_MAX_ERROR = 1.0;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-n] [-i interval] [-e max_error] [-s path] [-a archive]\n", argv0);
+    fprintf(stderr, "  -n           do not adjust the clock, only show what would be done\n");
+    fprintf(stderr, "  -i interval  longest time between syncs in seconds, default and at most %u,\n", MAX_INTERVAL);
+    fprintf(stderr, "               syncs happen sooner when needed to stay within max_error\n");
+    fprintf(stderr, "  -e max_error largest acceptable error in seconds, default %.1f\n", DEFAULT_MAX_ERROR);
+    fprintf(stderr, "  -s path      where to publish the trusted time page, default %s\n", VAK_SHM_PATH);
+    fprintf(stderr, "  -a archive   write every response to this archive\n");
+    exit(1);
+}
+
+/* Run one sync, returns 1 if we have good time, -1 if not */
+static int vakd_sync(struct vak_impl *impl, struct vak_udp *udp,
+                     overlap_value_t *plo, overlap_value_t *phi)
+{
+    int r;
+
+    while (1) {
+        r = vak_impl_process(impl, plo, phi);
+        if (r)
+            return r;
+
+        if (vak_udp_wait(udp, vak_impl_timeout(impl)) < 0) {
+            fprintf(stderr, "vak_udp_wait failed\n");
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct vak_server const **servers;
+    struct vak_udp *udp;
+    struct vak_impl *impl;
+    struct vak_drift *drift;
+    struct vak_shm *shm;
+    const char *shm_path = VAK_SHM_PATH;
+    const char *archive_path = NULL;
+    unsigned interval = MAX_INTERVAL;
+    double max_error = DEFAULT_MAX_ERROR;
+    int dry_run = 0;
+    double freq = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ni:e:s:a:")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'e':
+            max_error = atof(optarg);
+            break;
+        case 's':
+            shm_path = optarg;
+            break;
+        case 'a':
+            archive_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || !interval || interval > MAX_INTERVAL || max_error <= 0)
+        usage(argv[0]);
+
+    if (vak_seed_random() < 0) {
+        fprintf(stderr, "vak_seed_random failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    servers = vak_get_randomized_servers();
+    udp = vak_udp_new();
+    impl = servers && udp ? vak_impl_new(servers, 10, udp) : NULL;
+    drift = vak_drift_new();
+    if (!impl || !drift) {
+        fprintf(stderr, "setting up failed\n");
+        exit(1);
+    }
+
+    vak_impl_set_connected(impl, 1);
+
+#ifdef VAK_CACHE_FILE
+    {
+        struct vak_cache *cache = vak_cache_open(VAK_CACHE_FILE);
+        if (cache)
+            vak_impl_set_cache(impl, cache);
+    }
+#endif
+
+    if (archive_path) {
+        struct vak_archive *archive = vak_archive_open(archive_path);
+        if (!archive)
+            exit(1);
+        vak_impl_set_archive(impl, archive);
+    }
+
+    /* Other processes can still use vakd for time if this fails, but
+     * only when they run vak on their own */
+    shm = vak_shm_create(shm_path);
+
+    /* Continue from the frequency correction that is in effect */
+    if (vak_get_frequency(&freq) < 0)
+        freq = 0;
+
+    while (1) {
+        overlap_value_t lo, hi;
+        unsigned sleep_time = RETRY_INTERVAL;
+
+        if (vakd_sync(impl, udp, &lo, &hi) > 0) {
+            struct vak_clock_sample clock;
+            double adj = (lo + hi) / 2;
+            double flo = -UNKNOWN_DRIFT, fhi = UNKNOWN_DRIFT;
+            vak_time_t next;
+
+            /* Anchor the range to the monotonic clock before the wall
+             * clock is touched */
+            vak_get_clock_sample(&clock);
+            vak_drift_add(drift, &clock, lo, hi);
+
+            printf("sync: adjustment range %.6f .. %.6f\n", lo, hi);
+
+            if (fabs(adj) > STEP_THRESHOLD) {
+                /* Too far off to slew */
+                printf("step %.6f\n", adj);
+                if (!dry_run && vak_adjust_time(adj * 1000000) < 0)
+                    fprintf(stderr, "vak_adjust_time failed: %s\n", strerror(errno));
+            } else {
+                printf("slew %.6f\n", adj);
+                if (!dry_run)
+                    vak_slew_time(adj * 1000000);
+            }
+
+            /* Make the wall clock run at the rate the drift estimate
+             * says is right, the monotonic clock the estimate is
+             * based on is what the correction is applied to */
+            if (vak_drift_frequency(drift, &flo, &fhi)) {
+                double f = fmax(-MAX_FREQ, fmin(MAX_FREQ, (flo + fhi) / 2));
+
+                printf("frequency error %.3f .. %.3f ppm\n", flo, fhi);
+                if (!dry_run && vak_set_frequency(f) == 0)
+                    freq = f;
+
+                /* Lets the next sync use these responses too */
+                vak_impl_set_drift(impl, flo, fhi);
+            }
+
+            if (shm)
+                vak_shm_publish(shm, &clock, lo, hi, flo, fhi);
+
+            /* Sync again before the error can have grown too large */
+            next = vak_drift_interval(drift, freq, max_error) / 1000000;
+            if (next > interval)
+                next = interval;
+            if (next) {
+                sleep_time = next;
+                printf("next sync in %u seconds\n", sleep_time);
+            } else {
+                /* Even a sync right away is wider than max_error */
+                printf("can not stay within %.6f, next sync in %u seconds\n",
+                       max_error, sleep_time);
+            }
+        } else {
+            fprintf(stderr, "sync failed, trying again in %u seconds\n", sleep_time);
+        }
+
+        fflush(stdout);
+        sleep(sleep_time);
+
+        if (vak_impl_restart(impl) < 0)
+            exit(1);
+    }
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vak_shm.h"
+
+/* Print the trusted time published by vakd */
+int main(int argc, char *argv[])
+{
+    const struct vak_shm_page *page;
+    int64_t earliest, latest;
+    time_t t;
+
+    page = vak_shm_map(argc > 1 ? argv[1] : VAK_SHM_PATH);
+    if (!page) {
+        fprintf(stderr, "no trusted time page, is vakd running?\n");
+        exit(1);
+    }
+
+    if (!vak_shm_bounds(page, &earliest, &latest)) {
+        fprintf(stderr, "no verified time yet\n");
+        exit(1);
+    }
+
+    t = (earliest + latest) / 2 / 1000000;
+    printf("%lld.%06lld .. %lld.%06lld, +-%.6f s, %s",
+           (long long)(earliest / 1000000), (long long)(earliest % 1000000),
+           (long long)(latest / 1000000), (long long)(latest % 1000000),
+           (double)(latest - earliest) / 2000000, ctime(&t));
+
+    vak_shm_unmap(page);
+
+    return 0;
+}
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vak.h"
+
+/* Where the seed of the relay key is kept, the Makefile puts it in
+ * the state directory.  Anyone who can read it can sign times for
+ * the relay, so the directory must not be writable by anyone else. */
+#ifndef VAKRELAY_KEY_FILE
+#define VAKRELAY_KEY_FILE "/var/lib/vak/relay.key"
+#endif
+static const char *DEFAULT_KEY_FILE = VAKRELAY_KEY_FILE;
+
+/* Default for the widest time range the relay hands out, in seconds */
+static const double DEFAULT_MAX_WIDTH = 2.0;
+
+/* Frequency error of the monotonic clock assumed until the drift is
+ * known, in ppm */
+static const double UNKNOWN_DRIFT = 500;
+
+/* Shortest and longest time between upstream syncs, and the time
+ * before trying again after a failure, in seconds */
+static const unsigned MIN_REFRESH = 60;
+static const unsigned MAX_REFRESH = 86400;
+static const unsigned RETRY_INTERVAL = 60;
+
+/* The last upstream sync as a range of offsets in microseconds
+ * between the real time and the monotonic clock */
+struct vakrelay_time {
+    vak_time_t anchor;
+    vak_time_t lo, hi;
+    double drift_lo, drift_hi;
+    double max_width;
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-k keyfile] [-p port] [-u path] [-w max_width]\n", argv0);
+    fprintf(stderr, "  -k keyfile   seed of the relay key, created if missing, default %s\n", DEFAULT_KEY_FILE);
+    fprintf(stderr, "  -p port      UDP port to answer on, 0 to not use UDP, default %u\n", VAK_RELAY_PORT);
+    fprintf(stderr, "  -u path      also answer on a UNIX datagram socket\n");
+    fprintf(stderr, "  -w max_width widest time range to hand out in seconds, default %.1f\n", DEFAULT_MAX_WIDTH);
+    exit(1);
+}
+
+/* Read the seed of the key, or create a new one */
+static int vakrelay_load_key(const char *path, uint8_t *public_key, uint8_t *secret_key)
+{
+    uint8_t seed[32];
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n;
+
+        /* A key someone else has made, or could have read, is not
+         * our secret */
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & 07777) != 0600) {
+            fprintf(stderr, "%s must be a regular file owned by us with mode 0600\n", path);
+            close(fd);
+            return -1;
+        }
+
+        n = read(fd, seed, sizeof(seed));
+        close(fd);
+        if (n != sizeof(seed)) {
+            fprintf(stderr, "%s: short key file\n", path);
+            return -1;
+        }
+    } else {
+        if (errno != ENOENT) {
+            fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+        /* The umask could have taken away our own permissions */
+        if (fchmod(fd, 0600) < 0 ||
+            vak_get_nonce(seed, sizeof(seed)) < 0 ||
+            write(fd, seed, sizeof(seed)) != sizeof(seed)) {
+            fprintf(stderr, "creating key %s failed: %s\n", path, strerror(errno));
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        close(fd);
+    }
+
+    vak_relay_keypair(public_key, secret_key, seed);
+    memset(seed, 0, sizeof(seed));
+
+    return 0;
+}
+
+static int vakrelay_udp_socket(unsigned port)
+{
+    struct sockaddr_in6 sin6;
+    int off = 0;
+    int fd;
+
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Answer both IPv4 and IPv6 clients */
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(port);
+    sin6.sin6_addr = in6addr_any;
+    if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
+        fprintf(stderr, "bind port %u failed: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int vakrelay_unix_socket(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "bind %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Extrapolate the last upstream sync to now.  Returns 0 if there is
+ * none or if it has become too wide to hand out. */
+static int vakrelay_bounds(const struct vakrelay_time *t, vak_time_t *earliest, vak_time_t *latest)
+{
+    vak_time_t now, elapsed;
+
+    if (!t->anchor)
+        return 0;
+
+    now = vak_get_monotonic();
+    elapsed = now - t->anchor;
+
+    *earliest = now + t->lo + (vak_time_t)(t->drift_lo * elapsed / 1000000);
+    *latest = now + t->hi + (vak_time_t)(t->drift_hi * elapsed / 1000000);
+
+    return *latest - *earliest <= t->max_width * 1000000;
+}
+
+/* Answer all requests waiting on a socket */
+static void vakrelay_serve(int fd, const struct vakrelay_time *t, const uint8_t *secret_key)
+{
+    uint8_t request[VAK_RELAY_PACKET_SIZE + 1];
+    uint8_t reply[VAK_RELAY_PACKET_SIZE];
+
+    while (1) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        vak_time_t earliest, latest;
+        ssize_t n;
+        int len;
+
+        n = recvfrom(fd, request, sizeof(request), 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "recvfrom failed: %s\n", strerror(errno));
+            return;
+        }
+
+        /* Clients time out and try somewhere else if we have nothing
+         * good to say */
+        if (!vakrelay_bounds(t, &earliest, &latest))
+            continue;
+
+        len = vak_relay_make_reply(reply, request, n, (earliest + latest) / 2,
+                                   (latest - earliest + 1) / 2, secret_key);
+        if (len < 0)
+            continue;
+
+        if (sendto(fd, reply, len, 0, (struct sockaddr *)&from, fromlen) < 0)
+            fprintf(stderr, "sendto failed: %s\n", strerror(errno));
+    }
+}
+
+/* Seconds until the time handed out has used up half of the margin
+ * to the widest range, sync again then */
+static unsigned vakrelay_refresh(const struct vakrelay_time *t)
+{
+    double width = (double)(t->hi - t->lo) / 1000000;
+    double rate = (t->drift_hi - t->drift_lo) / 1000000;
+    double refresh = (t->max_width - width) / rate / 2;
+
+    if (refresh < MIN_REFRESH)
+        return MIN_REFRESH;
+    if (refresh > MAX_REFRESH)
+        return MAX_REFRESH;
+    return refresh;
+}
+
+int main(int argc, char *argv[])
+{
+    struct vak_server const **servers;
+    struct vak_udp *udp;
+    struct vak_impl *impl;
+    struct vak_drift *drift;
+    struct vakrelay_time t;
+    const char *key_file = DEFAULT_KEY_FILE;
+    const char *unix_path = NULL;
+    unsigned port = VAK_RELAY_PORT;
+    uint8_t public_key[32], secret_key[64];
+    int udp_fd = -1, unix_fd = -1;
+    vak_time_t next_sync = 0;
+    int syncing = 1;
+    unsigned i;
+    int opt;
+
+    memset(&t, 0, sizeof(t));
+    t.max_width = DEFAULT_MAX_WIDTH;
+    t.drift_lo = -UNKNOWN_DRIFT;
+    t.drift_hi = UNKNOWN_DRIFT;
+
+    while ((opt = getopt(argc, argv, "k:p:u:w:")) != -1) {
+        switch (opt) {
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'w':
+            t.max_width = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || t.max_width <= 0 || (!port && !unix_path))
+        usage(argv[0]);
+
+    if (vak_seed_random() < 0) {
+        fprintf(stderr, "vak_seed_random failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (vakrelay_load_key(key_file, public_key, secret_key) < 0)
+        exit(1);
+
+    printf("public key ");
+    for (i = 0; i < sizeof(public_key); i++)
+        printf("%02x", public_key[i]);
+    printf("\n");
+
+    servers = vak_get_randomized_servers();
+    udp = vak_udp_new();
+    impl = servers && udp ? vak_impl_new(servers, 10, udp) : NULL;
+    drift = vak_drift_new();
+    if (!impl || !drift) {
+        fprintf(stderr, "setting up failed\n");
+        exit(1);
+    }
+
+    vak_impl_set_connected(impl, 1);
+
+#ifdef VAK_CACHE_FILE
+    {
+        struct vak_cache *cache = vak_cache_open(VAK_CACHE_FILE);
+        if (cache)
+            vak_impl_set_cache(impl, cache);
+    }
+#endif
+
+    if (port) {
+        udp_fd = vakrelay_udp_socket(port);
+        if (udp_fd < 0 || vak_udp_watch_fd(udp, udp_fd) < 0)
+            exit(1);
+    }
+    if (unix_path) {
+        unix_fd = vakrelay_unix_socket(unix_path);
+        if (unix_fd < 0 || vak_udp_watch_fd(udp, unix_fd) < 0)
+            exit(1);
+    }
+
+    fflush(stdout);
+
+    while (1) {
+        vak_time_t now = vak_get_monotonic();
+        vak_time_t timeout;
+
+        if (syncing) {
+            overlap_value_t lo, hi;
+            int r = vak_impl_process(impl, &lo, &hi);
+
+            if (r > 0) {
+                struct vak_clock_sample clock;
+                vak_time_t offset;
+
+                vak_get_clock_sample(&clock);
+                offset = clock.realtime - clock.monotonic;
+                t.lo = offset + (vak_time_t)(lo * 1000000);
+                t.hi = offset + (vak_time_t)(hi * 1000000);
+                t.anchor = clock.monotonic;
+
+                vak_drift_add(drift, &clock, lo, hi);
+                if (vak_drift_frequency(drift, &t.drift_lo, &t.drift_hi))
+                    vak_impl_set_drift(impl, t.drift_lo, t.drift_hi);
+
+                next_sync = now + (vak_time_t)vakrelay_refresh(&t) * 1000000;
+                syncing = 0;
+
+                printf("upstream %.6f .. %.6f, next sync in %u seconds\n",
+                       lo, hi, vakrelay_refresh(&t));
+                fflush(stdout);
+            } else if (r < 0) {
+                fprintf(stderr, "upstream sync failed, trying again in %u seconds\n", RETRY_INTERVAL);
+                next_sync = now + (vak_time_t)RETRY_INTERVAL * 1000000;
+                syncing = 0;
+            }
+        } else if (now >= next_sync) {
+            if (vak_impl_restart(impl) < 0)
+                exit(1);
+            syncing = 1;
+            continue;
+        }
+
+        /* The old time is handed out while a new sync is running */
+        if (udp_fd >= 0)
+            vakrelay_serve(udp_fd, &t, secret_key);
+        if (unix_fd >= 0)
+            vakrelay_serve(unix_fd, &t, secret_key);
+
+        timeout = syncing ? vak_impl_timeout(impl) : next_sync - now;
+        if (vak_udp_wait(udp, timeout) < 0) {
+            fprintf(stderr, "vak_udp_wait failed\n");
+            exit(1);
+        }
+    }
+}
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "vak.h"
+#include "tweetnacl.h"
+
+/* Receipts are written next to the files with this suffix */
+static const char RECEIPT_SUFFIX[] = ".vakt";
+
+/* Responses that have to agree on the time for a receipt to be
+ * good, the same as for a sync */
+static const int WANTED_OVERLAPS = 3;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s file...\n", argv0);
+    fprintf(stderr, "       %s -v file...\n", argv0);
+    fprintf(stderr, "  -v           verify the receipts instead of stamping\n");
+    exit(1);
+}
+
+/* Read a whole file, the caller frees the buffer */
+static uint8_t *read_file(const char *path, size_t *plen)
+{
+    uint8_t *buf = NULL, *p;
+    size_t len = 0, size = 0;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    while (1) {
+        size_t n;
+
+        if (len == size) {
+            size = size ? 2 * size : 65536;
+            p = realloc(buf, size);
+            if (!p) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = p;
+        }
+
+        n = fread(buf + len, 1, size - len, f);
+        if (!n)
+            break;
+        len += n;
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "%s: read failed\n", path);
+        free(buf);
+        buf = NULL;
+    }
+
+    fclose(f);
+    *plen = len;
+
+    return buf;
+}
+
+static int hash_file(const char *path, uint8_t *hash)
+{
+    uint8_t *buf;
+    size_t len;
+
+    buf = read_file(path, &len);
+    if (!buf)
+        return -1;
+
+    crypto_hash_sha512256(hash, buf, len);
+    free(buf);
+
+    return 0;
+}
+
+static char *receipt_path(const char *path)
+{
+    char *s = malloc(strlen(path) + sizeof(RECEIPT_SUFFIX));
+
+    if (s) {
+        strcpy(s, path);
+        strcat(s, RECEIPT_SUFFIX);
+    }
+
+    return s;
+}
+
+static void print_time(const char *label, vak_time_t t)
+{
+    time_t secs = t / 1000000;
+    char buf[64];
+
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&secs));
+    printf(" %s %s.%06u UTC", label, buf, (unsigned)(t % 1000000));
+}
+
+static int stamp(char **files, unsigned count)
+{
+    uint8_t *hashes, **receipts;
+    unsigned *receipt_lens;
+    unsigned i;
+    int r = -1;
+
+    hashes = malloc(count * VAK_TIMESTAMP_HASH_SIZE);
+    receipts = malloc(count * sizeof(*receipts));
+    receipt_lens = malloc(count * sizeof(*receipt_lens));
+    if (!hashes || !receipts || !receipt_lens) {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (hash_file(files[i], hashes + i * VAK_TIMESTAMP_HASH_SIZE) < 0)
+            goto out;
+    }
+
+    if (vak_timestamp(hashes, count, receipts, receipt_lens) < 0) {
+        fprintf(stderr, "vak_timestamp failed\n");
+        goto out;
+    }
+
+    r = 0;
+    for (i = 0; i < count; i++) {
+        char *path = receipt_path(files[i]);
+        FILE *f = path ? fopen(path, "wb") : NULL;
+
+        if (!f || fwrite(receipts[i], 1, receipt_lens[i], f) != receipt_lens[i]) {
+            fprintf(stderr, "%s: write failed\n", path ? path : files[i]);
+            r = -1;
+        }
+        if (f && fclose(f) != 0)
+            r = -1;
+        free(path);
+    }
+
+    printf("stamped %u files, %u bytes per receipt\n", count, receipt_lens[0]);
+
+    vak_timestamp_free(receipts, count);
+
+out:
+    free(hashes);
+    free(receipts);
+    free(receipt_lens);
+
+    return r;
+}
+
+static int verify(char **files, unsigned count)
+{
+    struct vak_server const **servers;
+    unsigned i;
+    int r = 0;
+
+    servers = vak_get_servers();
+    if (!servers) {
+        fprintf(stderr, "vak_get_servers failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint8_t hash[VAK_TIMESTAMP_HASH_SIZE];
+        vak_time_t earliest, latest;
+        uint8_t *receipt;
+        size_t len;
+        char *path;
+        int n = 0;
+
+        path = receipt_path(files[i]);
+        receipt = path ? read_file(path, &len) : NULL;
+        free(path);
+
+        if (receipt && hash_file(files[i], hash) == 0)
+            n = vak_receipt_verify(receipt, len, hash, servers, &earliest, &latest);
+        free(receipt);
+
+        printf("%s:", files[i]);
+        if (n >= WANTED_OVERLAPS) {
+            print_time("stamped between", earliest);
+            print_time("and", latest);
+            printf(" by %d servers\n", n);
+        } else {
+            printf(" BAD receipt\n");
+            r = -1;
+        }
+    }
+
+    vak_servers_del(servers);
+
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    int verify_only = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verify_only = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc)
+        usage(argv[0]);
+
+    if (verify_only)
+        return verify(argv + optind, argc - optind) < 0;
+    else
+        return stamp(argv + optind, argc - optind) < 0;
+}
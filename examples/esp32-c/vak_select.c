@@ -0,0 +1 @@
+../../src/c/vak_select.c
\ No newline at end of file
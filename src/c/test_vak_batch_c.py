@@ -0,0 +1,207 @@
+#! /usr/bin/python3
+"""Test case for the C implementation of the batch requests and replies
+
+The trees and the responses are built by vrt_build.py, which does
+not use any of the C code.
+
+"""
+
+import os
+import sys
+import struct
+import unittest
+import cffi
+
+import vrt_build
+from vrt_build import Server
+
+def run(cmd):
+    print(cmd)
+    ec = os.system(cmd)
+    if ec:
+        sys.exit(ec)
+
+# Build a library with the C code we want to test
+run('gcc -Wall -g -fPIC -shared -o libvak_batch.so vak_batch.c vak_tree.c vrt.c tweetnacl.c')
+
+# Create a CFFI interface to the library
+ffi = cffi.FFI()
+ffi.cdef(os.popen('gcc -E vak.h').read())
+lib = ffi.dlopen('./libvak_batch.so')
+
+NOW = 1700000000 * 1000000
+
+PACKET_SIZE = 1200
+MAX_DEPTH = 6
+
+# Offsets of the fields in a reply
+DEPTH_OFFSET = 4 + 32 + 32 + 4 + 4
+PATH_OFFSET = DEPTH_OFFSET + 4 + 4
+
+def nonce(i):
+    return bytes([ i ]) * 32
+
+class Batch(object):
+    """A front end which has sent the root of a tree over the nonces to
+    a server, and the servers a client trusts"""
+
+    def __init__(self, count, variant = 7):
+        self.server = Server(1, variant)
+        self.nonces = [ nonce(i) for i in range(count) ]
+        root, self.paths = vrt_build.vak_tree(self.nonces)
+        self.response = self.server.respond([ root ], NOW)[0]
+        self.depth = len(self.paths[0]) // 64
+
+        self.servers = ffi.new('struct vak_server [2]')
+        self.servers[0].variant = variant
+        self.servers[0].public_key = self.server.public_key
+        self.servers[1].variant = variant
+        self.servers[1].public_key = Server(2, variant).public_key
+        self.pservers = ffi.new('struct vak_server *[3]',
+                                [ self.servers, self.servers + 1, ffi.NULL ])
+
+    def reply(self, i):
+        buffer = ffi.new('uint8_t [%u]' % PACKET_SIZE)
+        n = lib.vak_batch_make_reply(buffer, self.nonces[i], self.servers,
+                                     i, self.paths[i], self.depth,
+                                     self.response, len(self.response))
+        return ffi.buffer(buffer, n)[:]
+
+    def parse(self, reply, nonce):
+        lo = ffi.new('overlap_value_t *')
+        hi = ffi.new('overlap_value_t *')
+        if not lib.vak_batch_parse_reply(reply, len(reply), nonce, self.pservers,
+                                         NOW - 1000, NOW + 1000, lo, hi):
+            return None
+        return lo[0], hi[0]
+
+def put32(reply, offset, value):
+    return reply[:offset] + struct.pack('<I', value) + reply[offset + 4:]
+
+class TestRequest(unittest.TestCase):
+    def test_round_trip(self):
+        request = ffi.new('uint8_t [%u]' % PACKET_SIZE)
+        self.assertEqual(lib.vak_batch_make_request(request, nonce(7)), PACKET_SIZE)
+        out = ffi.new('uint8_t [32]')
+        self.assertEqual(lib.vak_batch_parse_request(request, PACKET_SIZE, out), 1)
+        self.assertEqual(bytes(out), nonce(7))
+
+    def test_short(self):
+        # A short request would let the front end amplify traffic
+        request = ffi.new('uint8_t [%u]' % PACKET_SIZE)
+        lib.vak_batch_make_request(request, nonce(7))
+        out = ffi.new('uint8_t [32]')
+        for length in [ 0, 4, 36, PACKET_SIZE - 1 ]:
+            self.assertEqual(lib.vak_batch_parse_request(request, length, out), 0)
+
+    def test_magic(self):
+        request = bytes(PACKET_SIZE)
+        out = ffi.new('uint8_t [32]')
+        self.assertEqual(lib.vak_batch_parse_request(request, PACKET_SIZE, out), 0)
+        request = b'VAKA' + nonce(7) + bytes(PACKET_SIZE - 36)
+        self.assertEqual(lib.vak_batch_parse_request(request, PACKET_SIZE, out), 0)
+
+class TestReply(unittest.TestCase):
+    def test_round_trip(self):
+        for count in [ 1, 3, 5, 64 ]:
+            batch = Batch(count)
+            for i in set([ 0, count // 2, count - 1 ]):
+                lo, hi = batch.parse(batch.reply(i), batch.nonces[i])
+                self.assertAlmostEqual(lo, -0.101)
+                self.assertAlmostEqual(hi, 0.101)
+
+    def test_wrong_nonce(self):
+        batch = Batch(3)
+        self.assertEqual(batch.parse(batch.reply(1), batch.nonces[0]), None)
+        self.assertEqual(batch.parse(batch.reply(1), nonce(0xff)), None)
+
+        # The nonce in the reply matches but the path is for another
+        reply = batch.reply(1)
+        reply = reply[:4] + batch.nonces[0] + reply[36:]
+        self.assertEqual(batch.parse(reply, batch.nonces[0]), None)
+
+    def test_depth(self):
+        batch = Batch(5)
+        reply = batch.reply(4)
+        self.assertEqual(batch.depth, 3)
+        self.assertNotEqual(batch.parse(reply, batch.nonces[4]), None)
+
+        # Deeper than any batch, with the length adjusted to match
+        deep = put32(reply, DEPTH_OFFSET, MAX_DEPTH + 1)
+        deep = deep[:PATH_OFFSET] + bytes(64 * (MAX_DEPTH + 1 - 3)) + deep[PATH_OFFSET:]
+        self.assertEqual(batch.parse(deep, batch.nonces[4]), None)
+        self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET, 0xffffffff),
+                                     batch.nonces[4]), None)
+
+        # A shallower tree does not hash up to the same root
+        shallow = put32(reply, DEPTH_OFFSET, 2)
+        shallow = shallow[:PATH_OFFSET + 128] + shallow[PATH_OFFSET + 192:]
+        self.assertEqual(batch.parse(shallow, batch.nonces[4]), None)
+
+    def test_index(self):
+        batch = Batch(5)
+        reply = batch.reply(4)
+        self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET - 4, 8), batch.nonces[4]), None)
+        self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET - 4, 0xffffffff),
+                                     batch.nonces[4]), None)
+        # In range but the wrong position.  5 to 7 would pass since
+        # the tree is padded with copies of the last leaf.
+        for index in range(4):
+            self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET - 4, index),
+                                         batch.nonces[4]), None)
+
+    def test_length(self):
+        batch = Batch(3)
+        reply = batch.reply(1)
+        self.assertEqual(batch.parse(reply[:-4], batch.nonces[1]), None)
+        self.assertEqual(batch.parse(reply + bytes(4), batch.nonces[1]), None)
+        self.assertEqual(batch.parse(reply[:PATH_OFFSET - 1], batch.nonces[1]), None)
+
+        # The response length in the reply must agree
+        length = len(batch.response)
+        self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET + 4, length - 4),
+                                     batch.nonces[1]), None)
+        self.assertEqual(batch.parse(put32(reply, DEPTH_OFFSET + 4, 0xffffffff),
+                                     batch.nonces[1]), None)
+
+    def test_server(self):
+        batch = Batch(3)
+        reply = batch.reply(1)
+
+        # A server which is not trusted
+        other = reply[:36] + Server(3).public_key + reply[68:]
+        self.assertEqual(batch.parse(other, batch.nonces[1]), None)
+
+        # A trusted server, but not the one which signed the response
+        other = reply[:36] + Server(2).public_key + reply[68:]
+        self.assertEqual(batch.parse(other, batch.nonces[1]), None)
+
+        # The wrong variant
+        self.assertEqual(batch.parse(put32(reply, 68, 4), batch.nonces[1]), None)
+
+    def test_tampered(self):
+        batch = Batch(3)
+        reply = batch.reply(1)
+        start = len(reply) - len(batch.response)
+
+        # Any change to the path or the response, except for the
+        # framing length, which only has to fit, and INDX, which is
+        # not used since the server tree only has the one root
+        unused = set([ start + 9, start + 10, start + 11 ] +
+                     list(range(len(reply) - 4, len(reply))))
+        for offset in range(PATH_OFFSET, len(reply)):
+            if offset in unused:
+                continue
+            tampered = reply[:offset] + bytes([ reply[offset] ^ 1 ]) + reply[offset + 1:]
+            self.assertEqual(batch.parse(tampered, batch.nonces[1]), None)
+
+    def test_too_big(self):
+        batch = Batch(3)
+        buffer = ffi.new('uint8_t [%u]' % PACKET_SIZE)
+        self.assertEqual(lib.vak_batch_make_reply(buffer, batch.nonces[0], batch.servers,
+                                                  0, bytes(64 * MAX_DEPTH), MAX_DEPTH,
+                                                  bytes(PACKET_SIZE), PACKET_SIZE - 100),
+                         -1)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,143 @@
+#! /usr/bin/python3
+"""Test case for the C implementation of the drift estimator
+
+"""
+
+import os
+import sys
+import unittest
+import cffi
+
+def run(cmd):
+    print(cmd)
+    ec = os.system(cmd)
+    if ec:
+        sys.exit(ec)
+
+# Build a library with the C code we want to test
+run('gcc -Wall -g -fPIC -shared -o libvak_drift.so vak_drift.c')
+
+# Create a CFFI interface to the library
+ffi = cffi.FFI()
+ffi.cdef(os.popen('gcc -E vak.h').read())
+lib = ffi.dlopen('./libvak_drift.so')
+
+# Seconds in microseconds
+S = 1000000
+
+class Drift(object):
+    def __init__(self):
+        self.drift = ffi.gc(lib.vak_drift_new(), lib.vak_drift_del)
+
+    def add(self, monotonic, offset, radius):
+        """Add a sync at a monotonic time in microseconds which found
+        the clock off by offset microseconds, +- radius"""
+
+        # The wall clock is the monotonic clock, so the ranges are
+        # the offsets between the real time and the monotonic clock
+        clock = ffi.new('struct vak_clock_sample *')
+        clock.realtime = monotonic
+        clock.monotonic = monotonic
+        lib.vak_drift_add(self.drift, clock,
+                          (offset - radius) / S, (offset + radius) / S)
+
+    def frequency(self):
+        lo = ffi.new('double *')
+        hi = ffi.new('double *')
+        if not lib.vak_drift_frequency(self.drift, lo, hi):
+            return None
+        return lo[0], hi[0]
+
+    def interval(self, freq, max_error):
+        return lib.vak_drift_interval(self.drift, freq, max_error)
+
+class TestDrift(unittest.TestCase):
+    def test_empty(self):
+        drift = Drift()
+        self.assertEqual(drift.frequency(), None)
+        self.assertEqual(drift.interval(0, 1), 0)
+
+    def test_one(self):
+        # A single sync says nothing about the frequency, +-500 ppm
+        # plus the wander of 1 ppm is assumed
+        drift = Drift()
+        drift.add(1000 * S, 0, 10000)
+        self.assertEqual(drift.frequency(), None)
+        self.assertEqual(drift.interval(0, 1), int(990000 / 501 * S))
+        self.assertEqual(drift.interval(100, 1), int(990000 / 501 * S))
+
+        # The last sync alone is wider than what is acceptable
+        self.assertEqual(drift.interval(0, 0.01), 0)
+        self.assertEqual(drift.interval(0, 0.005), 0)
+
+    def test_two(self):
+        # 20 ppm, +-10 ms, 1000 s apart
+        drift = Drift()
+        drift.add(0, 0, 10000)
+        drift.add(1000 * S, 20000, 10000)
+        lo, hi = drift.frequency()
+        self.assertAlmostEqual(lo, -1)
+        self.assertAlmostEqual(hi, 41)
+
+        # The worst case is 21 ppm away from 20, plus the wander
+        self.assertEqual(drift.interval(20, 1), int(990000 / 22 * S))
+        self.assertEqual(drift.interval(0, 1), int(990000 / 42 * S))
+
+    def test_narrow(self):
+        # More syncs over a longer time narrow the range
+        drift = Drift()
+        width = None
+        for i in range(16):
+            t = i * 10000 * S
+            drift.add(t, t * 20 // S, 1000)
+            if i:
+                lo, hi = drift.frequency()
+                self.assertTrue(lo <= 20 <= hi)
+                if width is not None:
+                    self.assertTrue(hi - lo <= width)
+                width = hi - lo
+        self.assertTrue(width < 2.1)
+
+    def test_wander(self):
+        # A change within the wander keeps all syncs
+        drift = Drift()
+        for i in range(6):
+            drift.add(i * 1000 * S, i * 20000, 1000)
+        drift.add(6 * 1000 * S, 6 * 20000 + 1000, 1000)
+        lo, hi = drift.frequency()
+        # The first sync is still used for both limits
+        self.assertAlmostEqual(lo, (120000 - 1000) / 6000 - 1)
+        self.assertAlmostEqual(hi, (101000 + 1000) / 5000 + 1)
+
+    def test_change(self):
+        # The frequency changes from 20 ppm to 120 ppm, the old syncs
+        # are thrown away until the rest agree
+        drift = Drift()
+        for i in range(6):
+            drift.add(i * 1000 * S, i * 20000, 1000)
+        lo, hi = drift.frequency()
+        self.assertTrue(lo <= 20 <= hi)
+
+        drift.add(6000 * S, 220000, 1000)
+        lo, hi = drift.frequency()
+        self.assertAlmostEqual(lo, (219000 - 101000) / 1000 - 1)
+        self.assertAlmostEqual(hi, (221000 - 99000) / 1000 + 1)
+
+        # The next sync is compared with the two that are left
+        drift.add(7000 * S, 340000, 1000)
+        lo, hi = drift.frequency()
+        self.assertTrue(lo <= 120 <= hi)
+        self.assertTrue(hi - lo < 6)
+
+    def test_history(self):
+        # Only the last 16 syncs are kept, the range does not narrow
+        # below what they give
+        drift = Drift()
+        for i in range(32):
+            drift.add(i * 1000 * S, i * 20000, 1000)
+        lo, hi = drift.frequency()
+        self.assertAlmostEqual(lo, 20 - 2000 / 15000 - 1)
+        self.assertAlmostEqual(hi, 20 + 2000 / 15000 + 1)
+
+if __name__ == '__main__':
+    unittest.main()
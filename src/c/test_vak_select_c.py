@@ -0,0 +1,131 @@
+#! /usr/bin/python3
+"""Test case for the C implementation of the server selection
+
+"""
+
+import os
+import sys
+import unittest
+import cffi
+
+def run(cmd):
+    print(cmd)
+    ec = os.system(cmd)
+    if ec:
+        sys.exit(ec)
+
+# Build a library with the C code we want to test
+run('gcc -Wall -g -fPIC -shared -o libvak_select.so vak_select.c')
+
+# Create a CFFI interface to the library
+ffi = cffi.FFI()
+ffi.cdef(os.popen('gcc -E vak.h').read())
+ffi.cdef('void srandom(unsigned int seed);')
+lib = ffi.dlopen('./libvak_select.so')
+
+GOOD = (20000, 10000, 100, 0)
+NONE = (0, 0, 0, 0)
+BAD = (1000000, 1000000, 100, 50)
+
+class Servers(object):
+    """Servers with fixed statistics, each is (key, stats)"""
+
+    def __init__(self, servers):
+        self.count = len(servers)
+        self.servers = ffi.new('struct vak_server [%u]' % self.count)
+        self.stats = ffi.new('struct vak_server_stats [%u]' % self.count)
+        for i, (key, stats) in enumerate(servers):
+            self.servers[i].public_key = bytes([ key ]) * 32
+            self.stats[i].srtt, self.stats[i].radi, \
+                self.stats[i].queries, self.stats[i].failures = stats
+        self.pservers = ffi.new('struct vak_server *[%u]' % self.count,
+                                [ self.servers + i for i in range(self.count) ])
+        self.pstats = ffi.new('struct vak_server_stats *[%u]' % self.count,
+                              [ self.stats + i for i in range(self.count) ])
+        self.used = ffi.new('uint8_t [%u]' % self.count)
+
+    def select(self, max_uncertainty = 10):
+        return lib.vak_select_server(self.pservers, self.pstats, self.used,
+                                     self.count, max_uncertainty)
+
+    def order(self):
+        """The order in which all servers are chosen"""
+        order = []
+        while True:
+            i = self.select()
+            if i < 0:
+                return order
+            order.append(i)
+            self.used[i] = 1
+
+class TestSelect(unittest.TestCase):
+    def setUp(self):
+        lib.srandom(1)
+
+    def test_empty(self):
+        self.assertEqual(Servers([]).select(), -1)
+
+    def test_all_used(self):
+        servers = Servers([ (1, GOOD), (2, GOOD) ])
+        servers.used[0] = servers.used[1] = 1
+        self.assertEqual(servers.select(), -1)
+
+    def test_rank(self):
+        # The jitter must never be enough to change the order
+        for seed in range(100):
+            lib.srandom(seed)
+            self.assertEqual(Servers([ (1, BAD), (2, NONE), (3, GOOD) ]).order(),
+                             [ 2, 1, 0 ])
+            self.assertEqual(Servers([ (1, NONE), (2, GOOD), (3, BAD) ]).order(),
+                             [ 1, 0, 2 ])
+
+    def test_unseen_operator(self):
+        for seed in range(100):
+            lib.srandom(seed)
+
+            # The second server has the same key as the first one
+            # which has already been used, a worse server from
+            # another operator is chosen before it
+            servers = Servers([ (1, GOOD), (1, GOOD), (2, BAD) ])
+            servers.used[0] = 1
+            self.assertEqual(servers.select(), 2)
+
+            servers = Servers([ (1, GOOD), (1, GOOD), (2, NONE) ])
+            servers.used[0] = 1
+            self.assertEqual(servers.order(), [ 2, 1 ])
+
+            # Once all operators have been used the cost decides
+            servers = Servers([ (1, GOOD), (1, GOOD), (2, GOOD), (2, BAD) ])
+            servers.used[0] = servers.used[2] = 1
+            self.assertEqual(servers.order(), [ 1, 3 ])
+
+    def test_failures(self):
+        # A server which often does not answer is worse than one which
+        # does
+        for seed in range(100):
+            lib.srandom(seed)
+            self.assertEqual(Servers([ (1, (20000, 10000, 100, 90)), (2, GOOD) ]).select(),
+                             1)
+
+    def test_wide(self):
+        # A server which can not meet the uncertainty on its own is
+        # penalized, otherwise the first server would be chosen
+        servers = Servers([ (1, (20000, 120000, 100, 0)), (2, (20000, 110000, 100, 60)) ])
+        for seed in range(100):
+            lib.srandom(seed)
+            self.assertEqual(servers.select(1), 0)
+        for seed in range(100):
+            lib.srandom(seed)
+            self.assertEqual(servers.select(0.25), 1)
+
+    def test_jitter(self):
+        # Equally good servers all get used
+        servers = Servers([ (i, GOOD) for i in range(4) ])
+        chosen = set()
+        for seed in range(100):
+            lib.srandom(seed)
+            chosen.add(servers.select())
+        self.assertEqual(chosen, set(range(4)))
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,230 @@
+#! /usr/bin/python3
+"""Test case for the C implementation of the Merkle tree and receipts
+
+The trees, the responses and the receipts are built by vrt_build.py
+and here, without any of the C code.
+
+"""
+
+import os
+import sys
+import struct
+import unittest
+import cffi
+
+import vrt_build
+from vrt_build import Server
+
+def run(cmd):
+    print(cmd)
+    ec = os.system(cmd)
+    if ec:
+        sys.exit(ec)
+
+# Build a library with the C code we want to test, vak_timestamp.c
+# needs all of vak for vak_timestamp
+SOURCES = [
+    'vak_tree.c', 'vak_timestamp.c', 'vak_impl_single.c', 'vak_select.c',
+    'vak_cache_linux.c', 'vak_archive_linux.c', 'vak_udp_linux.c',
+    'vak_time_linux.c', 'vak_random_linux.c', 'vak_servers.c',
+    'overlap_algo.c', 'vrt.c', 'tweetnacl.c',
+]
+run('gcc -Wall -g -fPIC -shared -o libvak_tree.so %s -lanl' % ' '.join(SOURCES))
+
+# Create a CFFI interface to the library
+ffi = cffi.FFI()
+ffi.cdef(os.popen('gcc -E vak.h').read())
+lib = ffi.dlopen('./libvak_tree.so')
+
+NOW = 1700000000 * 1000000
+
+NODE_SIZE = 64
+
+def leaf(i):
+    return bytes([ i ]) * 32
+
+def leaves(count):
+    return [ leaf(i) for i in range(count) ]
+
+class Tree(object):
+    def __init__(self, leaves):
+        self.tree = lib.vak_tree_new(b''.join(leaves), len(leaves))
+        self.depth = lib.vak_tree_depth(self.tree)
+
+    def __del__(self):
+        lib.vak_tree_del(self.tree)
+
+    def root(self):
+        return ffi.buffer(lib.vak_tree_root(self.tree), NODE_SIZE)[:]
+
+    def path(self, index):
+        path = ffi.new('uint8_t [%u]' % max(1, self.depth * NODE_SIZE))
+        lib.vak_tree_path(self.tree, index, path)
+        return ffi.buffer(path, self.depth * NODE_SIZE)[:]
+
+def hash_path(leaf, index, path):
+    root = ffi.new('uint8_t [%u]' % NODE_SIZE)
+    lib.vak_tree_hash_path(root, leaf, index, path, len(path) // NODE_SIZE)
+    return bytes(root)
+
+def flip(data, offset):
+    return data[:offset] + bytes([ data[offset] ^ 1 ]) + data[offset + 1:]
+
+class TestTree(unittest.TestCase):
+    def test_empty(self):
+        self.assertEqual(lib.vak_tree_new(ffi.NULL, 0), ffi.NULL)
+
+    def test_tree(self):
+        for count, depth in [ (1, 0), (3, 2), (5, 3) ]:
+            tree = Tree(leaves(count))
+            root, paths = vrt_build.vak_tree(leaves(count))
+            self.assertEqual(tree.depth, depth)
+            self.assertEqual(tree.root(), root)
+            for i in range(count):
+                self.assertEqual(tree.path(i), paths[i])
+                self.assertEqual(hash_path(leaf(i), i, paths[i]), root)
+
+    def test_tampered(self):
+        for count in [ 1, 3, 5 ]:
+            tree = Tree(leaves(count))
+            root = tree.root()
+            for i in range(count):
+                path = tree.path(i)
+
+                # Another leaf
+                self.assertNotEqual(hash_path(leaf(0xff), i, path), root)
+
+                # Any change to the path
+                for offset in range(len(path)):
+                    self.assertNotEqual(hash_path(leaf(i), i, flip(path, offset)), root)
+
+                # Another position, except for the copies of the last
+                # leaf which the tree is padded with
+                for index in range(1 << tree.depth):
+                    if index != i and not (i == count - 1 and index >= count):
+                        self.assertNotEqual(hash_path(leaf(i), index, path), root)
+
+                # A shorter path
+                if path:
+                    self.assertNotEqual(hash_path(leaf(i), i, path[:-NODE_SIZE]), root)
+
+class Receipt(object):
+    """Responses from servers to the root of a tree, and the servers a
+    client trusts"""
+
+    def __init__(self, count, servers):
+        self.leaves = leaves(count)
+        self.root, self.paths = vrt_build.vak_tree(self.leaves)
+
+        self.servers = ffi.new('struct vak_server [%u]' % len(servers))
+        for i, server in enumerate(servers):
+            self.servers[i].variant = server.variant
+            self.servers[i].public_key = server.public_key
+        self.pservers = ffi.new('struct vak_server *[%u]' % (len(servers) + 1),
+                                [ self.servers + i for i in range(len(servers)) ] +
+                                [ ffi.NULL ])
+
+    def receipt(self, index, responses, depth = None):
+        if depth is None:
+            depth = len(self.paths[index]) // NODE_SIZE
+        receipt = b'VAKT' + struct.pack('<III', index, depth, len(responses))
+        receipt += self.paths[index]
+        for server, response in responses:
+            receipt += (server.public_key + struct.pack('<II', server.variant, len(response)) +
+                        response)
+        return receipt
+
+    def verify(self, receipt, leaf):
+        earliest = ffi.new('vak_time_t *')
+        latest = ffi.new('vak_time_t *')
+        n = lib.vak_receipt_verify(receipt, len(receipt), leaf, self.pservers,
+                                   earliest, latest)
+        if not n:
+            return 0, None, None
+        return n, earliest[0], latest[0]
+
+class TestReceipt(unittest.TestCase):
+    def setUp(self):
+        self.a = Server(1)
+        self.b = Server(2)
+        self.c = Server(3)
+
+    def responses(self, receipt):
+        return [
+            (self.a, self.a.respond([ receipt.root ], NOW, 100000)[0]),
+            (self.b, self.b.respond([ receipt.root ], NOW + 50000, 100000)[0]),
+            (self.c, self.c.respond([ receipt.root ], NOW - 20000, 200000)[0]),
+        ]
+
+    def test_verify(self):
+        for count in [ 1, 3, 5 ]:
+            receipt = Receipt(count, [ self.a, self.b, self.c ])
+            responses = self.responses(receipt)
+            for i in range(count):
+                self.assertEqual(receipt.verify(receipt.receipt(i, responses), leaves(count)[i]),
+                                 (3, NOW - 50000, NOW + 100000))
+
+    def test_tampered_path(self):
+        receipt = Receipt(5, [ self.a, self.b, self.c ])
+        responses = self.responses(receipt)
+        good = receipt.receipt(1, responses)
+        for offset in [ 16, 16 + NODE_SIZE, 16 + 3 * NODE_SIZE - 1 ]:
+            self.assertEqual(receipt.verify(flip(good, offset), leaf(1)), (0, None, None))
+        self.assertEqual(receipt.verify(good, leaf(2)), (0, None, None))
+
+    def test_tampered_index(self):
+        receipt = Receipt(5, [ self.a, self.b, self.c ])
+        responses = self.responses(receipt)
+        for index in [ 0, 2, 3, 8, 0xffffffff ]:
+            tampered = receipt.receipt(1, responses)
+            tampered = tampered[:4] + struct.pack('<I', index) + tampered[8:]
+            self.assertEqual(receipt.verify(tampered, leaf(1)), (0, None, None))
+
+        # A deeper tree than the path in the receipt
+        tampered = receipt.receipt(1, responses, depth = 4)
+        self.assertEqual(receipt.verify(tampered, leaf(1)), (0, None, None))
+        tampered = receipt.receipt(1, responses, depth = 32)
+        self.assertEqual(receipt.verify(tampered, leaf(1)), (0, None, None))
+
+    def test_tampered_response(self):
+        receipt = Receipt(3, [ self.a, self.b, self.c ])
+        responses = self.responses(receipt)
+
+        # A response which does not verify is not counted
+        server, response = responses[1]
+        responses[1] = (server, flip(response, 100))
+        self.assertEqual(receipt.verify(receipt.receipt(1, responses), leaf(1)),
+                         (2, NOW - 100000, NOW + 100000))
+
+        # A response with a length that does not fit
+        good = receipt.receipt(1, responses)
+        self.assertEqual(receipt.verify(good[:-1], leaf(1)), (0, None, None))
+
+    def test_untrusted(self):
+        receipt = Receipt(3, [ self.a, self.b ])
+        responses = self.responses(receipt)
+        self.assertEqual(receipt.verify(receipt.receipt(1, responses), leaf(1)),
+                         (2, NOW - 50000, NOW + 100000))
+
+    def test_duplicate_server(self):
+        # The same response many times is only one vote
+        receipt = Receipt(3, [ self.a, self.b, self.c ])
+        a, b, c = self.responses(receipt)
+        self.assertEqual(receipt.verify(receipt.receipt(1, [ a, a, a ]), leaf(1)),
+                         (1, NOW - 100000, NOW + 100000))
+        self.assertEqual(receipt.verify(receipt.receipt(1, [ a, b, a, b, a ]), leaf(1)),
+                         (2, NOW - 50000, NOW + 100000))
+
+        # So are different responses from the same server
+        other = self.a.respond([ receipt.root ], NOW + 1000000, 100000)[0]
+        self.assertEqual(receipt.verify(receipt.receipt(1, [ a, (self.a, other) ]), leaf(1)),
+                         (1, NOW - 100000, NOW + 100000))
+
+        # And a server listed twice, for example with two addresses
+        receipt = Receipt(3, [ self.a, self.a, self.b ])
+        a, b, c = self.responses(receipt)
+        self.assertEqual(receipt.verify(receipt.receipt(1, [ a, a, b ]), leaf(1)),
+                         (2, NOW - 50000, NOW + 100000))
+
+if __name__ == '__main__':
+    unittest.main()
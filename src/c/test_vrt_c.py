@@ -0,0 +1,160 @@
+#! /usr/bin/python3
+"""Test case for the C implementation of the roughtime client
+
+The responses are built by vrt_build.py, which does not use any of
+the C code.
+
+"""
+
+import os
+import sys
+import unittest
+import cffi
+
+import vrt_build
+from vrt_build import Server
+
+def run(cmd):
+    print(cmd)
+    ec = os.system(cmd)
+    if ec:
+        sys.exit(ec)
+
+# Build a library with the C code we want to test
+run('gcc -Wall -g -fPIC -shared -o libvrt.so vrt.c tweetnacl.c')
+
+# Create a CFFI interface to the library
+ffi = cffi.FFI()
+ffi.cdef(vrt_build.CDEF)
+lib = ffi.dlopen('./libvrt.so')
+
+NOW = 1700000000 * 1000000
+
+def nonce(i):
+    return bytes([ i ]) * 64
+
+class TestPrecheck(unittest.TestCase):
+    def precheck(self, sent, response, variant):
+        # The C code reads the response as 32 bit words
+        reply = ffi.new('uint32_t []', (len(response) + 3) // 4)
+        ffi.memmove(reply, response, len(response))
+        return lib.vrt_precheck_response(ffi.new('uint8_t []', sent), len(sent),
+                                         reply, len(response), variant)
+
+    def test_path(self):
+        for variant in [ 4, 7 ]:
+            for count in [ 1, 3, 5 ]:
+                nonces = [ nonce(i) for i in range(count) ]
+                responses = Server(1, variant).respond(nonces, NOW)
+                for i in range(count):
+                    self.assertEqual(self.precheck(nonces[i], responses[i], variant),
+                                     lib.VRT_SUCCESS)
+                    self.assertEqual(self.precheck(nonce(0xff), responses[i], variant),
+                                     lib.VRT_ERROR_TREE)
+                    if count > 1:
+                        # A response for another nonce in the same batch
+                        other = nonces[(i + 1) % count]
+                        self.assertEqual(self.precheck(other, responses[i], variant),
+                                         lib.VRT_ERROR_TREE)
+
+    def test_nonc(self):
+        for variant in [ 4, 7 ]:
+            nonces = [ nonce(i) for i in range(3) ]
+            responses = Server(1, variant).respond(nonces, NOW, nonc = True)
+            for i in range(3):
+                self.assertEqual(self.precheck(nonces[i], responses[i], variant),
+                                 lib.VRT_SUCCESS)
+                self.assertEqual(self.precheck(nonce(0xff), responses[i], variant),
+                                 lib.VRT_ERROR_TREE)
+
+    def test_nonc_first(self):
+        # The NONC tag is trusted over the path, the signatures are
+        # only checked by vrt_parse_response
+        response = Server(1).respond([ nonce(1) ], NOW, nonc = True)[0]
+        self.assertEqual(self.precheck(nonce(1), response, 7), lib.VRT_SUCCESS)
+
+        nonc = vrt_build.message({ b'NONC': nonce(2)[:32] })
+        self.assertEqual(self.precheck(nonce(2), vrt_build.packet(nonc, 7), 7),
+                         lib.VRT_SUCCESS)
+
+        nonc = vrt_build.message({ b'NONC': nonce(2)[:16] })
+        self.assertEqual(self.precheck(nonce(2), vrt_build.packet(nonc, 7), 7),
+                         lib.VRT_ERROR_WRONG_SIZE)
+
+    def test_short_nonce(self):
+        response = Server(1).respond([ nonce(1) ], NOW)[0]
+        self.assertEqual(self.precheck(nonce(1)[:32], response, 7),
+                         lib.VRT_ERROR_WRONG_SIZE)
+
+    def test_truncated(self):
+        for variant in [ 4, 7 ]:
+            for nonc in [ False, True ]:
+                # Without the length in the header of variant 5 and
+                # later, nothing after the NONC tag is looked at
+                if variant < 5 and nonc:
+                    continue
+                response = Server(1, variant).respond([ nonce(1) ], NOW, nonc = nonc)[0]
+                for length in range(0, len(response), 4):
+                    self.assertNotEqual(self.precheck(nonce(1), response[:length], variant),
+                                        lib.VRT_SUCCESS)
+
+    def test_garbage(self):
+        self.assertEqual(self.precheck(nonce(1), b'', 7), lib.VRT_ERROR_WRONG_SIZE)
+        self.assertEqual(self.precheck(nonce(1), b'ROUGHTIM', 7), lib.VRT_ERROR_WRONG_SIZE)
+        self.assertEqual(self.precheck(nonce(1), b'x' * 100, 7), lib.VRT_ERROR_MALFORMED)
+        self.assertEqual(self.precheck(nonce(1), b'ROUGHTIM\xff\xff\xff\xff' + bytes(100), 7),
+                         lib.VRT_ERROR_MALFORMED)
+        for variant in [ 4, 7 ]:
+            for fill in [ b'\0', b'\xff', b'\x01\0\0\0' ]:
+                garbage = vrt_build.packet(fill * (256 // len(fill)), variant)
+                self.assertNotEqual(self.precheck(nonce(1), garbage, variant),
+                                    lib.VRT_SUCCESS)
+
+    def test_parse(self):
+        # The responses are also good enough for the full check
+        for variant in [ 4, 7 ]:
+            server = Server(1, variant)
+            nonces = [ nonce(i) for i in range(3) ]
+            for i, response in enumerate(server.respond(nonces, NOW)):
+                reply = ffi.new('uint32_t []', len(response) // 4)
+                ffi.memmove(reply, response, len(response))
+                midp = ffi.new('uint64_t *')
+                radi = ffi.new('uint32_t *')
+                r = lib.vrt_parse_response(ffi.new('uint8_t []', nonces[i]), 64,
+                                           reply, len(response), server.public_key,
+                                           midp, radi, variant)
+                self.assertEqual(r, lib.VRT_SUCCESS)
+                self.assertEqual(midp[0], NOW)
+                self.assertEqual(radi[0], 100000)
+
+class TestCertCache(unittest.TestCase):
+    def test_verify(self):
+        for variant in [ 4, 7 ]:
+            server = Server(1, variant)
+            other = Server(2, variant)
+            response = server.respond([ nonce(1) ], NOW)[0]
+            reply = ffi.new('uint32_t []', len(response) // 4)
+            ffi.memmove(reply, response, len(response))
+            cert = ffi.new('uint8_t [136]')
+
+            # Nothing has been saved yet
+            self.assertEqual(lib.vrt_verify_cert_cache(cert, server.public_key, variant),
+                             lib.VRT_ERROR_DELE)
+
+            r = lib.vrt_parse_response_cached(ffi.new('uint8_t []', nonce(1)), 64,
+                                              reply, len(response), server.public_key,
+                                              ffi.new('uint64_t *'), ffi.new('uint32_t *'),
+                                              variant, cert)
+            self.assertEqual(r, lib.VRT_SUCCESS)
+            self.assertEqual(lib.vrt_verify_cert_cache(cert, server.public_key, variant),
+                             lib.VRT_SUCCESS)
+            self.assertEqual(lib.vrt_verify_cert_cache(cert, other.public_key, variant),
+                             lib.VRT_ERROR_DELE)
+
+            # A delegation with another key planted in the cache
+            cert[100] ^= 1
+            self.assertEqual(lib.vrt_verify_cert_cache(cert, server.public_key, variant),
+                             lib.VRT_ERROR_DELE)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -11,8 +11,16 @@ extern "C" {
 
 typedef int64_t vak_time_t;
 
+/** A time which is later than any real time */
+#define VAK_TIME_MAX INT64_MAX
+
 struct vak_impl;
 struct vak_udp;
+struct vak_cache;
+struct vak_drift;
+struct vak_shm;
+struct vak_tree;
+struct vak_archive;
 
 /** Structure describing a roughtime server */
 struct vak_server {
@@ -39,6 +47,36 @@ struct vak_server {
  */
 vak_time_t vak_get_time(void);
 
+/** Get the monotonic time.
+ *
+ * The monotonic time is not changed when the wall time is stepped,
+ * slewed or has its frequency corrected, so it is suitable for
+ * measuring intervals.
+ *
+ * \returns The number of microseconds since some unspecified point
+ * in time, usually when the system booted.
+ */
+vak_time_t vak_get_monotonic(void);
+
+/** The wall time and the monotonic time read at the same moment */
+struct vak_clock_sample {
+    /** Wall time in microseconds since the epoch */
+    vak_time_t realtime;
+
+    /** Monotonic time in microseconds */
+    vak_time_t monotonic;
+};
+
+/** Read the wall time and the monotonic time together.
+ *
+ * The difference between the two clocks only changes slowly unless
+ * the wall time is stepped, so two samples tell if that has happened
+ * in between, and a sample anchors a wall time to the monotonic time.
+ *
+ * \param sample pointer to where the times will be written
+ */
+void vak_get_clock_sample(struct vak_clock_sample *sample);
+
 /** Adjust the wall time.
  *
  * This functions uses the same representation of time as the vrt
@@ -49,25 +87,885 @@ vak_time_t vak_get_time(void);
  */
 int vak_adjust_time(vak_time_t adj);
 
+/** Slew the wall time.
+ *
+ * Instead of stepping the clock like vak_adjust_time, the clock is
+ * run slightly faster or slower until it has been adjusted, so that
+ * the time never jumps and never goes backwards.  A new call replaces
+ * any adjustment which is still in progress.
+ *
+ * \param adj the adjustment in microseconds
+ * \returns 0 on success, -1 on an error
+ */
+int vak_slew_time(vak_time_t adj);
+
+/** Correct the frequency of the wall clock.
+ *
+ * \param ppm how much faster the clock should run, in parts per
+ * million, negative to make it run slower
+ * \returns 0 on success, -1 on an error
+ */
+int vak_set_frequency(double ppm);
+
+/** Get the frequency correction of the wall clock.
+ *
+ * \param ppm pointer to where the correction in parts per million
+ * will be written
+ * \returns 0 on success, -1 on an error
+ */
+int vak_get_frequency(double *ppm);
+
 /* Seed the random function with some randomness.  This is used to
  * randomize the list of vak_servers. */
 int vak_seed_random(void);
 
+/** Get random bytes to use as a nonce.
+ *
+ * The bytes come from a cryptographically secure generator which is
+ * seeded with, and periodically reseeded from, system entropy.  Most
+ * calls are served from a pool of pregenerated bytes and do not make
+ * any system calls.
+ *
+ * This function is not thread safe.
+ *
+ * \param nonce pointer to a buffer where the nonce will be written
+ * \param size number of bytes to write
+ * \returns 0 on success, -1 on an error
+ */
+int vak_get_nonce(void *nonce, unsigned size);
+
+/** Network address of a peer */
+struct vak_addr {
+    /** Address family, 4 for IPv4 or 6 for IPv6 */
+    unsigned family;
+
+    /** Port number */
+    unsigned port;
+
+    /** IPv4 or IPv6 address in network byte order */
+    uint8_t addr[16];
+};
+
+/** Maximum number of addresses used for a server, at most one IPv6
+ * and one IPv4 address */
+#define VAK_MAX_ADDRS 2
+
+/** A query which the caller should send for vak_impl */
+struct vak_impl_send {
+    /** The server to send the query to */
+    const struct vak_server *server;
+
+    /** The address of the server or NULL if it is not known */
+    const struct vak_addr *addr;
+
+    /** The query, only valid until the next call to vak_impl_get_send */
+    const void *buffer;
+
+    /** Length of the query */
+    unsigned length;
+
+    /** Identifier of the query for vak_impl_sent and vak_impl_send_failed */
+    unsigned query;
+};
+
+/** Create a new vak_impl instance.
+ *
+ * If udp is NULL, the instance does not do any I/O on its own.  The
+ * caller then drives it from its own event loop using
+ * vak_impl_get_send, vak_impl_input and vak_impl_timer, and must not
+ * call vak_impl_process.
+ */
 struct vak_impl *vak_impl_new(struct vak_server const **servers, unsigned wanted, struct vak_udp *udp);
 void vak_impl_del(struct vak_impl *impl);
+
+/** Start a new sync with an existing vak_impl instance.
+ *
+ * The responses from the last sync are thrown away but everything
+ * learned about the servers, such as addresses, round trip times and
+ * verified delegations, is kept, and so are the sockets.  This is
+ * much cheaper than creating a new instance for each sync.
+ *
+ * \returns 0 on success, -1 on an error
+ */
+int vak_impl_restart(struct vak_impl *impl);
+
+/** Do all I/O that is possible without blocking.
+ *
+ * Receives and processes responses, handles timeouts and sends new
+ * queries using the vak_udp instance given to vak_impl_new.
+ *
+ * \returns 1 if we have good time, 0 if we need to be called again,
+ * -1 if there are no more servers to try
+ */
 int vak_impl_process(struct vak_impl *impl, overlap_value_t *plo, overlap_value_t *phi);
 
+/** Use a cache to remember what is known about servers between runs.
+ *
+ * The statistics about each server and its last verified delegation
+ * are loaded from the cache right away, and written back to it when
+ * the sync has finished.  The signature of each delegation is
+ * verified again when it is loaded.  The cache must stay open until
+ * the vak_impl instance has been deleted.
+ */
+void vak_impl_set_cache(struct vak_impl *impl, struct vak_cache *cache);
+
+/** Send each query on its own connected channel.
+ *
+ * Only used by vak_impl_process.  With channels, datagrams which do
+ * not come from the queried address are dropped by the platform, if
+ * it supports it, and a response is only checked against the query
+ * it belongs to.  If a channel can not be opened the shared socket
+ * is used.
+ *
+ * \param enable 1 to use channels, 0 to use the shared socket
+ */
+void vak_impl_set_connected(struct vak_impl *impl, int enable);
+
+/** Tell vak_impl how much the monotonic clock may drift.
+ *
+ * vak_impl_restart starts each new sync with the narrowest of the
+ * last verified responses from each server, moved and widened by how
+ * much the monotonic clock may have drifted since they were received.
+ * The servers they came from are not queried again in that sync, and
+ * at least one new response is always needed.  Until this is called
+ * a frequency error of up to 100 ppm either way is assumed.
+ *
+ * \param lo_ppm the lowest possible frequency error of the monotonic
+ * clock, as returned by vak_drift_frequency
+ * \param hi_ppm the highest possible frequency error
+ */
+void vak_impl_set_drift(struct vak_impl *impl, double lo_ppm, double hi_ppm);
+
+/** Use the same nonce for all queries.
+ *
+ * A signed response to a nonce which is the hash of some data proves
+ * that the data existed at the time in the response.  While a nonce
+ * is set, every verified response is kept until the next restart so
+ * that it can be fetched with vak_impl_get_response, and responses
+ * from earlier syncs are not reused.
+ *
+ * \param nonce VRT_NONCE_SIZE bytes, or NULL to use a random nonce
+ * for each query again
+ */
+void vak_impl_set_nonce(struct vak_impl *impl, const uint8_t *nonce);
+
+/** Get a verified response to the nonce set with vak_impl_set_nonce.
+ *
+ * \param index which response to get, from 0
+ * \param server pointer to where the server that sent it is written
+ * \param buffer pointer to where a pointer to the response is
+ * written, valid until the next restart
+ * \param length pointer to where the length is written
+ * \returns 1 if there is such a response, 0 if not
+ */
+int vak_impl_get_response(struct vak_impl *impl, unsigned index,
+                          const struct vak_server **server,
+                          const void **buffer, unsigned *length);
+
+/** Write every response to an archive.
+ *
+ * Each response that is for one of our queries is written with the
+ * server, the send and receive times and the result of verifying
+ * it, whether it was good or not.  The archive must stay open until
+ * the vak_impl instance has been deleted.
+ *
+ * \param archive the archive, or NULL to stop writing responses
+ */
+void vak_impl_set_archive(struct vak_impl *impl, struct vak_archive *archive);
+
+/** Get the next query to send.
+ *
+ * If a server has both an IPv6 and an IPv4 address, the same query
+ * is returned once for each address so that it is sent to both at
+ * the same time.  The first verified response wins and its round
+ * trip time is used.
+ *
+ * Keep calling this function until it returns 0.  After each query
+ * has been sent, tell vak_impl about it with vak_impl_sent, or with
+ * vak_impl_send_failed if it could not be sent.
+ *
+ * \param now the current time
+ * \param send pointer to where the query will be written
+ * \returns 1 if a query should be sent, otherwise 0
+ */
+int vak_impl_get_send(struct vak_impl *impl, vak_time_t now, struct vak_impl_send *send);
+
+/** Tell vak_impl the time a query was sent.
+ *
+ * This can be called again later with a more accurate time, for
+ * example when a transmit timestamp arrives from the kernel.
+ */
+void vak_impl_sent(struct vak_impl *impl, unsigned query, vak_time_t send_time);
+
+/** Tell vak_impl the addresses of a server.
+ *
+ * The addresses are used for all queries to servers with the same
+ * host and port.  vak_impl_process looks up all addresses by itself,
+ * a caller driving vak_impl from its own event loop can look them up
+ * in advance to keep name lookups out of the send path.
+ *
+ * \param addrs array of addresses, entries with family 0 are ignored
+ * \param count number of addresses, at most VAK_MAX_ADDRS are used
+ * \param now the current time, the addresses expire some time after this
+ */
+void vak_impl_set_addr(struct vak_impl *impl, const struct vak_server *server,
+                       const struct vak_addr *addrs, unsigned count, vak_time_t now);
+
+/** Tell vak_impl that a query could not be sent. */
+void vak_impl_send_failed(struct vak_impl *impl, unsigned query);
+
+/** Feed a received datagram to vak_impl.
+ *
+ * \param buffer pointer to the datagram, must be 32 bit aligned
+ * \param length length of the datagram
+ * \param addr the address the datagram came from
+ * \param recv_time the time the datagram was received
+ * \returns 1 if we have good time, otherwise 0
+ */
+int vak_impl_input(struct vak_impl *impl, const void *buffer, unsigned length,
+                   const struct vak_addr *addr, vak_time_t recv_time);
+
+/** Handle expired timers.
+ *
+ * Call this when the time returned by vak_impl_deadline has passed.
+ */
+void vak_impl_timer(struct vak_impl *impl, vak_time_t now);
+
+/** Get the time when vak_impl_timer has to be called.
+ *
+ * \returns the deadline, 0 if there are queries to send right away
+ * or VAK_TIME_MAX if there is nothing to wait for
+ */
+vak_time_t vak_impl_deadline(struct vak_impl *impl);
+
+/** Get the result.
+ *
+ * \returns 1 if we have good time and the adjustment range has
+ * been written to plo and phi, 0 if we are still working on it or
+ * -1 if there are no more servers to try
+ */
+int vak_impl_result(struct vak_impl *impl, overlap_value_t *plo, overlap_value_t *phi);
+
+/** Get the time until vak_impl_process has to be called again.
+ *
+ * vak_impl_process must be called when this time has passed or when
+ * a packet has arrived, whatever happens first.  Calling it earlier
+ * does no harm.
+ *
+ * \returns The number of microseconds until the next deadline.
+ */
+vak_time_t vak_impl_timeout(struct vak_impl *impl);
+
+/** A datagram for vak_udp_send_batch or vak_udp_recv_batch */
+struct vak_udp_msg {
+    /** Pointer to the data */
+    void *buffer;
+
+    /** Size of the buffer, only used when receiving */
+    unsigned size;
+
+    /** Length of the data */
+    unsigned length;
+
+    /** Destination address when sending, source address when receiving */
+    struct vak_addr addr;
+
+    /** The time the datagram was sent or received */
+    vak_time_t time;
+
+    /** Identifier for vak_udp_tx_time, filled in when sending */
+    unsigned id;
+
+    /** Channel to send the datagram on or that it was received on, 0
+     * for the shared socket */
+    unsigned channel;
+};
+
+/** Highest channel number vak_udp_open_channel can return */
+#define VAK_MAX_CHANNELS 16
+
 struct vak_udp *vak_udp_new(void);
 int vak_udp_send(struct vak_udp *udp, const char *host, unsigned port, const void *buffer, unsigned length);
+
+/** Look up the preferred address of a host.
+ *
+ * \param host hostname or IP address
+ * \param port port number
+ * \param addr pointer to where the address will be written
+ * \returns 0 on success, -1 on an error
+ */
+int vak_udp_resolve(const char *host, unsigned port, struct vak_addr *addr);
+
+/** Look up the addresses of many hosts in parallel.
+ *
+ * Up to VAK_MAX_ADDRS addresses are returned for each host, at most
+ * one of each address family, in order of preference.  Unused
+ * entries, and all entries for a host which could not be looked up,
+ * will have family set to 0.
+ *
+ * \param hosts array of hostnames or IP addresses
+ * \param ports array of port numbers
+ * \param addrs array of count * VAK_MAX_ADDRS entries where the
+ * addresses will be written, VAK_MAX_ADDRS entries for each host
+ * \param count number of entries in the arrays
+ * \returns the number of hosts that were found or -1 on an error
+ */
+int vak_udp_resolve_many(const char *const *hosts, const unsigned *ports,
+                         struct vak_addr *addrs, unsigned count);
+
+/** Open a channel connected to a peer.
+ *
+ * Datagrams sent on the channel go to the peer, and datagrams from
+ * any other address are dropped before they reach vak_udp_recv_batch.
+ * Where this is done by the kernel, stray and spoofed packets cost
+ * next to nothing.  The sockets behind closed channels are reused.
+ *
+ * \param addr the address of the peer
+ * \returns a channel number from 1 to VAK_MAX_CHANNELS or -1 if no
+ * channel could be opened, in which case the shared socket should be
+ * used instead
+ */
+int vak_udp_open_channel(struct vak_udp *udp, const struct vak_addr *addr);
+
+/** Close a channel opened with vak_udp_open_channel. */
+void vak_udp_close_channel(struct vak_udp *udp, int channel);
+
+/** Send multiple datagrams.
+ *
+ * \param msgs array of datagrams, buffer, length, addr and channel
+ * must be filled in, addr is not used for datagrams sent on a channel
+ * \param count number of datagrams in the array
+ * \returns the number of datagrams sent or -1 on an error
+ */
+int vak_udp_send_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count);
+
+/** Receive multiple datagrams without blocking.
+ *
+ * Datagrams are received both from the shared socket and from all
+ * open channels.
+ *
+ * \param msgs array of datagrams, buffer and size must be filled in
+ * \param count number of datagrams in the array
+ * \returns the number of datagrams received, 0 if none were
+ * available or -1 on an error.  length, addr, time and channel are
+ * filled in for each datagram received.
+ */
+int vak_udp_recv_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count);
+
+/** Receive a packet without blocking.
+ *
+ * \returns the length of the packet, 0 if no packet is available or
+ * -1 on an error
+ */
 int vak_udp_recv(struct vak_udp *udp, void *buffer, unsigned length);
+
+/** Wait for a packet to arrive.
+ *
+ * Block until a packet can be received with vak_udp_recv or until
+ * the timeout has passed.
+ *
+ * \param timeout the maximum time to wait in microseconds
+ * \returns 1 if a packet is available, 0 on a timeout, -1 on an error
+ */
+int vak_udp_wait(struct vak_udp *udp, vak_time_t timeout);
+
+/** Also wake up vak_udp_wait when a file descriptor is readable.
+ *
+ * This lets a program wait for its own sockets and for vak at the
+ * same time.  vak_udp_wait returns 1 as long as the file descriptor
+ * is readable, so the program has to read everything from it after
+ * each wait.  Not all platforms support this.
+ *
+ * \param fd the file descriptor to watch
+ * \returns 0 on success, -1 on an error
+ */
+int vak_udp_watch_fd(struct vak_udp *udp, int fd);
+
+/** Get the time a datagram actually left the host.
+ *
+ * Some platforms can report when the datagram was handed to the
+ * network device, which is later than the time filled in by
+ * vak_udp_send_batch.  The report may arrive a while after the
+ * datagram was sent.
+ *
+ * \param id the id filled in by vak_udp_send_batch
+ * \param time pointer to where the time will be written
+ * \returns 1 if the time is known, otherwise 0
+ */
+int vak_udp_tx_time(struct vak_udp *udp, unsigned id, vak_time_t *time);
+
 void vak_udp_del(struct vak_udp *udp);
 
 struct vak_server const **vak_get_servers(void);
 struct vak_server const **vak_get_randomized_servers(void);
 void vak_servers_del(struct vak_server const **servers);
 
+/** What is known about a server, used to choose servers to query */
+struct vak_server_stats {
+    /** Smoothed round trip time in microseconds, 0 if unknown */
+    vak_time_t srtt;
+
+    /** Radius of the last response in microseconds, 0 if unknown */
+    uint32_t radi;
+
+    /** Number of queries sent to the server */
+    unsigned queries;
+
+    /** Number of queries that did not get a good response */
+    unsigned failures;
+};
+
+/** Choose the next server to query.
+ *
+ * Servers are ranked by how narrow an adjustment range they are
+ * expected to give, from their round trip time and radius, and how
+ * likely they are to answer.  Servers from operators, identified by
+ * their public key, that have not been used yet are preferred.  Some
+ * randomness is added so that the choice can not be predicted and
+ * so that all good servers get used over time.
+ *
+ * \param servers array of servers
+ * \param stats array with the statistics for each server
+ * \param used array of flags, nonzero for servers that have already
+ * been used and must not be chosen again
+ * \param count number of servers
+ * \param max_uncertainty the wanted uncertainty in seconds
+ * \returns the index of the chosen server or -1 if all have been used
+ */
+int vak_select_server(struct vak_server const *const *servers,
+                      const struct vak_server_stats *const *stats,
+                      const uint8_t *used, unsigned count,
+                      double max_uncertainty);
+
+/** Size of a verified delegation, the same as VRT_CERT_CACHE_SIZE */
+#define VAK_CERT_SIZE 136
+
+/** Maximum length of a hostname in a vak_cache_entry */
+#define VAK_CACHE_HOST_SIZE 64
+
+/** What is remembered about a server between runs.
+ *
+ * The entries are stored in the cache file exactly like this, in the
+ * byte order of the host.
+ */
+struct vak_cache_entry {
+    /** Server host and port, host is empty for an unused entry */
+    char host[VAK_CACHE_HOST_SIZE];
+    uint32_t port;
+
+    /** Radius of the last response in microseconds */
+    uint32_t radi;
+
+    /** Number of queries and how many of them failed, both are
+     * halved now and then so that old history fades away */
+    uint32_t queries;
+    uint32_t failures;
+
+    /** Server public key */
+    uint8_t public_key[32];
+
+    /** Round trip time statistics in microseconds */
+    int64_t srtt;
+    int64_t rttvar;
+
+    /** When the entry was last updated */
+    int64_t updated;
+
+    /** Signature and delegation of the last verified response, and
+     * the protocol variant it was verified for */
+    uint8_t cert[VAK_CERT_SIZE];
+    uint32_t cert_variant;
+};
+
+/** Open a cache file, creating it if it does not exist.
+ *
+ * The file is mapped into memory and changes to entries are written
+ * back to it by the operating system.  Only one process should use a
+ * cache file at a time.
+ *
+ * The file should be in a directory only writable by the user
+ * running the program.  Symbolic links are not followed, and a file
+ * owned by another user or writable by anyone else is refused.
+ *
+ * \param path the name of the file
+ * \returns a new cache or NULL on an error
+ */
+struct vak_cache *vak_cache_open(const char *path);
+
+/** Close a cache, writing all changes to the file. */
+void vak_cache_close(struct vak_cache *cache);
+
+/** Find the entry for a server.
+ *
+ * \param add if nonzero and the server does not have an entry, a
+ * new empty one is created, replacing the least recently updated
+ * entry if the cache is full
+ * \returns a pointer to the entry, valid until the cache is closed,
+ * or NULL if there was none and add was 0
+ */
+struct vak_cache_entry *vak_cache_find(struct vak_cache *cache,
+                                       const struct vak_server *server,
+                                       int add);
+
+/** Create an estimator for the frequency error of the local clock.
+ *
+ * The estimator keeps the verified adjustment ranges of the last
+ * syncs, translated to the monotonic clock which nobody adjusts, and
+ * finds the range of frequency errors that all of them agree with.
+ *
+ * \returns a new estimator or NULL on an error
+ */
+struct vak_drift *vak_drift_new(void);
+
+/** Free an estimator */
+void vak_drift_del(struct vak_drift *drift);
+
+/** Add the result of a sync.
+ *
+ * If the new range does not agree with the older ones, the frequency
+ * has changed, for example with the temperature, and the oldest
+ * ranges are thrown away until the rest agree again.
+ *
+ * \param clock the wall and monotonic times when the adjustment
+ * range was valid, read before the clock was adjusted
+ * \param lo the low value of the adjustment range in seconds
+ * \param hi the high value of the adjustment range in seconds
+ */
+void vak_drift_add(struct vak_drift *drift, const struct vak_clock_sample *clock,
+                   overlap_value_t lo, overlap_value_t hi);
+
+/** Get the frequency error of the monotonic clock.
+ *
+ * The frequency error is how much faster, in parts per million, the
+ * clock would have to run to keep the right time.  Pass the middle
+ * of the range to vak_set_frequency to correct the wall clock.
+ *
+ * \param plo the lowest possible frequency error is written here
+ * \param phi the highest possible frequency error is written here
+ * \returns 1 if the frequency error is known, 0 if more syncs are
+ * needed
+ */
+int vak_drift_frequency(const struct vak_drift *drift, double *plo, double *phi);
+
+/** Get the time until the next sync is needed.
+ *
+ * The uncertainty of the wall clock is half of the adjustment range
+ * of the last sync, and it grows with the difference between the
+ * frequency correction and the frequency error.  This returns how
+ * long it takes until it reaches max_error.
+ *
+ * \param freq the frequency correction in effect, in ppm
+ * \param max_error the largest acceptable error in seconds
+ * \returns the time in microseconds, 0 if a sync is needed now
+ */
+vak_time_t vak_drift_interval(const struct vak_drift *drift, double freq, double max_error);
+
+/** Create the trusted time page that other processes read.
+ *
+ * The page is a small file which readers map with vak_shm_map from
+ * vak_shm.h and read the time from with vak_shm_bounds.  It does not
+ * hold any time until vak_shm_publish has been called.
+ *
+ * An existing file is reused so that readers which already have it
+ * mapped see the new time.  It is refused if it is a symbolic link,
+ * has more than one link, is owned by another user or is writable by
+ * anyone else.
+ *
+ * \param path the file to create, usually VAK_SHM_PATH
+ * \returns a new instance or NULL on an error
+ */
+struct vak_shm *vak_shm_create(const char *path);
+
+/** Unmap the page, readers keep seeing the last published time */
+void vak_shm_close(struct vak_shm *shm);
+
+/** Publish the result of a sync.
+ *
+ * \param clock the wall and monotonic times when the adjustment
+ * range was valid, or NULL to withdraw the time
+ * \param lo the low value of the adjustment range in seconds
+ * \param hi the high value of the adjustment range in seconds
+ * \param drift_lo the lowest possible frequency error of the
+ * monotonic clock in ppm
+ * \param drift_hi the highest possible frequency error in ppm
+ */
+void vak_shm_publish(struct vak_shm *shm, const struct vak_clock_sample *clock,
+                     overlap_value_t lo, overlap_value_t hi,
+                     double drift_lo, double drift_hi);
+
+/** Open an archive of responses, creating it if it does not exist.
+ *
+ * Records are appended to the archive, and an entry for each is
+ * appended to an index in a file with ".idx" added to the name.
+ * Offline tools map both with vak_archive_map from vak_archive.h.
+ * Only one process should write to an archive at a time.
+ *
+ * \param path the name of the archive
+ * \returns a new archive or NULL on an error
+ */
+struct vak_archive *vak_archive_open(const char *path);
+
+/** Close an archive */
+void vak_archive_close(struct vak_archive *archive);
+
+/** Append a response to an archive.
+ *
+ * \param server the server the response came from
+ * \param send_time when the query was sent
+ * \param recv_time when the response was received
+ * \param result the result of verifying the response, VRT_SUCCESS
+ * if it was good
+ * \param buffer the response as it was received
+ * \param length the length of the response
+ * \returns 0 on success, -1 on an error
+ */
+int vak_archive_add(struct vak_archive *archive, const struct vak_server *server,
+                    vak_time_t send_time, vak_time_t recv_time, int result,
+                    const void *buffer, unsigned length);
+
+/** Size of relay requests and replies */
+#define VAK_RELAY_PACKET_SIZE 128
+
+/** Size of the nonce in a relay request */
+#define VAK_RELAY_NONCE_SIZE 32
+
+/** Default UDP port of a relay */
+#define VAK_RELAY_PORT 2020
+
+/** Create the key pair of a relay.
+ *
+ * \param public_key 32 bytes, the key clients use to check replies
+ * \param secret_key 64 bytes, used by vak_relay_make_reply
+ * \param seed 32 random bytes which the key pair is made from, keep
+ * them to get the same key pair every time
+ */
+void vak_relay_keypair(uint8_t *public_key, uint8_t *secret_key, const uint8_t *seed);
+
+/** Build a request to a relay.
+ *
+ * \param buffer VAK_RELAY_PACKET_SIZE bytes where the request is built
+ * \param nonce VAK_RELAY_NONCE_SIZE random bytes
+ * \returns the length of the request
+ */
+int vak_relay_make_request(uint8_t *buffer, const uint8_t *nonce);
+
+/** Build a signed reply to a relay request.
+ *
+ * \param buffer VAK_RELAY_PACKET_SIZE bytes where the reply is built
+ * \param request the request
+ * \param request_len length of the request
+ * \param midp the time in microseconds since the epoch
+ * \param radi the uncertainty of midp in microseconds
+ * \param secret_key the secret key from vak_relay_keypair
+ * \returns the length of the reply or -1 if the request is not valid
+ */
+int vak_relay_make_reply(uint8_t *buffer, const uint8_t *request, unsigned request_len,
+                         vak_time_t midp, uint32_t radi, const uint8_t *secret_key);
+
+/** Check a relay reply and translate it to an adjustment range.
+ *
+ * \param nonce the nonce given to vak_relay_make_request
+ * \param public_key the public key of the relay
+ * \param send_time when the request was sent
+ * \param recv_time when the reply was received
+ * \param plo the low value of the adjustment range is written here
+ * \param phi the high value of the adjustment range is written here
+ * \returns 1 if the reply is good, otherwise 0
+ */
+int vak_relay_parse_reply(const uint8_t *reply, unsigned reply_len,
+                          const uint8_t *nonce, const uint8_t *public_key,
+                          vak_time_t send_time, vak_time_t recv_time,
+                          overlap_value_t *plo, overlap_value_t *phi);
+
+/** Size of a leaf of a Merkle tree, a nonce or the hash of some data */
+#define VAK_TREE_LEAF_SIZE 32
+
+/** Size of a node of a Merkle tree, the root is used as the nonce of
+ * a roughtime query */
+#define VAK_TREE_NODE_SIZE 64
+
+/** Build a Merkle tree.
+ *
+ * The tree is hashed the same way as the tree in a roughtime
+ * response.  The number of leaves is padded up to a power of two
+ * with copies of the last leaf.
+ *
+ * \param leaves count leaves of VAK_TREE_LEAF_SIZE bytes each
+ * \param count number of leaves, at least 1
+ * \returns the tree or NULL on an error
+ */
+struct vak_tree *vak_tree_new(const uint8_t *leaves, unsigned count);
+void vak_tree_del(struct vak_tree *tree);
+
+/** Get the root of a tree, VAK_TREE_NODE_SIZE bytes */
+const uint8_t *vak_tree_root(const struct vak_tree *tree);
+
+/** Get the depth of a tree, which is the number of nodes in a path */
+unsigned vak_tree_depth(const struct vak_tree *tree);
+
+/** Get the path from a leaf to the root.
+ *
+ * \param index the position of the leaf
+ * \param path where vak_tree_depth nodes of VAK_TREE_NODE_SIZE bytes
+ * are written
+ */
+void vak_tree_path(const struct vak_tree *tree, unsigned index, uint8_t *path);
+
+/** Hash a leaf up to the root of a tree.
+ *
+ * \param root VAK_TREE_NODE_SIZE bytes where the root is written
+ * \param leaf the leaf
+ * \param index the position of the leaf in the tree
+ * \param path the path of the leaf from vak_tree_path
+ * \param depth the number of nodes in the path
+ */
+void vak_tree_hash_path(uint8_t *root, const uint8_t *leaf, unsigned index,
+                        const uint8_t *path, unsigned depth);
+
+/** Size of batch requests, replies are never larger */
+#define VAK_BATCH_PACKET_SIZE 1200
+
+/** Size of the nonce in a batch request */
+#define VAK_BATCH_NONCE_SIZE 32
+
+/** Most nonces in one batch and the depth of a tree that big */
+#define VAK_BATCH_MAX_LEAVES 64
+#define VAK_BATCH_MAX_DEPTH 6
+
+/** Default UDP port of a batching front end */
+#define VAK_BATCH_PORT 2021
+
+/** Build a request to a batching front end.
+ *
+ * \param buffer VAK_BATCH_PACKET_SIZE bytes where the request is built
+ * \param nonce VAK_BATCH_NONCE_SIZE random bytes
+ * \returns the length of the request
+ */
+int vak_batch_make_request(uint8_t *buffer, const uint8_t *nonce);
+
+/** Get the nonce from a batch request.
+ *
+ * \param nonce VAK_BATCH_NONCE_SIZE bytes where the nonce is written
+ * \returns 1 if the request is good, otherwise 0
+ */
+int vak_batch_parse_request(const uint8_t *request, unsigned request_len, uint8_t *nonce);
+
+/** Build the reply to one request in a batch.
+ *
+ * \param buffer VAK_BATCH_PACKET_SIZE bytes where the reply is built
+ * \param nonce the nonce from the request
+ * \param server the server the root was sent to
+ * \param index the position of the nonce in the tree
+ * \param path the path of the nonce from vak_tree_path
+ * \param depth the depth of the tree
+ * \param response the response from the server
+ * \param response_len length of the response
+ * \returns the length of the reply or -1 if it does not fit
+ */
+int vak_batch_make_reply(uint8_t *buffer, const uint8_t *nonce,
+                         const struct vak_server *server,
+                         unsigned index, const uint8_t *path, unsigned depth,
+                         const void *response, unsigned response_len);
+
+/** Verify a batch reply and translate it to an adjustment range.
+ *
+ * The response in the reply is verified against the public key of
+ * the server, so the front end does not have to be trusted.
+ *
+ * \param nonce the nonce given to vak_batch_make_request
+ * \param servers NULL terminated array of trusted servers, the reply
+ * must come from one of them
+ * \param send_time when the request was sent
+ * \param recv_time when the reply was received
+ * \param plo the low value of the adjustment range is written here
+ * \param phi the high value of the adjustment range is written here
+ * \returns 1 if the reply is good, otherwise 0
+ */
+int vak_batch_parse_reply(const uint8_t *reply, unsigned reply_len,
+                          const uint8_t *nonce, struct vak_server const **servers,
+                          vak_time_t send_time, vak_time_t recv_time,
+                          overlap_value_t *plo, overlap_value_t *phi);
+
+/** Size of the hashes of data to timestamp */
+#define VAK_TIMESTAMP_HASH_SIZE VAK_TREE_LEAF_SIZE
+
+/** Get signed proof that data existed at the current time.
+ *
+ * A Merkle tree is built over the hashes and its root is used as the
+ * nonce of all queries of a sync, so one round trip to each server
+ * stamps all of the hashes.  Each receipt holds the path from one
+ * hash to the root and all verified responses, which is everything
+ * vak_receipt_verify needs later, without a network.
+ *
+ * \param hashes count hashes of VAK_TIMESTAMP_HASH_SIZE bytes each,
+ * for example SHA-256 hashes of the data
+ * \param count number of hashes, at least 1
+ * \param receipts array of count pointers where a receipt for each
+ * hash is written, free them with vak_timestamp_free
+ * \param receipt_lens array of count lengths of the receipts
+ * \returns the number of responses in each receipt or -1 on an error
+ */
+int vak_timestamp(const uint8_t *hashes, unsigned count,
+                  uint8_t **receipts, unsigned *receipt_lens);
+
+/** Free receipts from vak_timestamp */
+void vak_timestamp_free(uint8_t **receipts, unsigned count);
+
+/** Verify a receipt from vak_timestamp.
+ *
+ * \param hash the hash the receipt is for
+ * \param servers NULL terminated array of trusted servers, responses
+ * from other servers are ignored
+ * \param earliest pointer to where the earliest time most servers
+ * agree on is written, in microseconds since the epoch
+ * \param latest pointer to where the latest time is written, the
+ * data existed no later than this
+ * \returns the number of servers which agree on the time, 0 if no
+ * response could be verified.  Each public key is only counted
+ * once, however many responses from it the receipt holds.  Ask for
+ * as many as a sync would.
+ */
+int vak_receipt_verify(const uint8_t *receipt, unsigned receipt_len,
+                       const uint8_t *hash, struct vak_server const **servers,
+                       vak_time_t *earliest, vak_time_t *latest);
+
 int vak_main(overlap_value_t *plo, overlap_value_t *phi);
 
+/** Get the current time with verified bounds.
+ *
+ * The result of the last successful vak_main is kept relative to the
+ * monotonic clock and extrapolated to now, widened by how much the
+ * monotonic clock may have drifted since.  As long as the bounds are
+ * narrow enough this only reads the monotonic clock.  When they have
+ * become too wide, or if there has not been a sync yet, it calls
+ * vak_main, which blocks for as long as the sync takes.
+ *
+ * This function is not thread safe.
+ *
+ * \param earliest the earliest the time can be, in microseconds
+ * since the epoch, is written here
+ * \param latest the latest the time can be is written here
+ * \returns 1 on success, 0 if no verified time could be found
+ */
+int vak_now_bounds(vak_time_t *earliest, vak_time_t *latest);
+
+/** Set how wide the bounds from vak_now_bounds may become before a
+ * new sync is done, in seconds, 2 seconds by default */
+void vak_now_set_max_width(double max_width);
+
+/** Set the range of frequency errors of the monotonic clock in ppm
+ * used by vak_now_bounds, +-100 ppm by default */
+void vak_now_set_drift(double lo_ppm, double hi_ppm);
+
+/** Give vak_now_bounds the result of a sync done some other way.
+ *
+ * \param clock the wall and monotonic times when the adjustment
+ * range was valid
+ * \param lo the low value of the adjustment range in seconds
+ * \param hi the high value of the adjustment range in seconds
+ */
+void vak_now_set(const struct vak_clock_sample *clock, overlap_value_t lo, overlap_value_t hi);
+
 /* Query a roughtime server to find out how to adjust our local clock
  * to match the time from the server.
  *
@@ -0,0 +1,258 @@
+#ifndef VAK_ARCHIVE_H
+#define VAK_ARCHIVE_H
+
+/* Reader for the response archive written by vak_archive_open.
+ *
+ * This file does not depend on anything else in vak, copy it into a
+ * program to read archives without linking with vak.  The archive
+ * and its index are mapped into memory and the records are read
+ * where they are, nothing is copied or parsed until it is used.
+ *
+ * The archive is the header followed by records, each is a struct
+ * vak_archive_record followed by the response exactly as it was
+ * received, padded to a multiple of 8 bytes.  The index, in a file
+ * with ".idx" added to the name, is the header followed by one
+ * struct vak_archive_index entry for each record, in the order they
+ * were written.  Numbers are in the byte order of the host which
+ * wrote them, like in the cache file. */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Magic numbers of the archive, "VAKL", and of the index, "VAKI" */
+#define VAK_ARCHIVE_MAGIC 0x4c4b4156
+#define VAK_ARCHIVE_INDEX_MAGIC 0x494b4156
+#define VAK_ARCHIVE_VERSION 1
+
+/** What is added to the name of the archive to get the index */
+#define VAK_ARCHIVE_INDEX_SUFFIX ".idx"
+
+/** Records and index entries start at a multiple of this */
+#define VAK_ARCHIVE_ALIGN 8
+
+/** The header at the start of both files */
+struct vak_archive_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/** The fixed part of a record, the response follows it */
+struct vak_archive_record {
+    /** When the query was sent and the response received, in
+     * microseconds since the epoch by the local clock */
+    int64_t send_time;
+    int64_t recv_time;
+
+    /** Public key of the server */
+    uint8_t public_key[32];
+
+    /** Protocol variant of the server */
+    uint32_t variant;
+
+    /** Length of the response */
+    uint32_t length;
+
+    /** Result of verifying the response, a vrt_ret_t, 0 if it was
+     * good */
+    int32_t result;
+
+    uint32_t reserved;
+};
+
+/** An entry in the index */
+struct vak_archive_index {
+    /** recv_time of the record */
+    int64_t recv_time;
+
+    /** Offset of the record in the archive */
+    uint64_t offset;
+
+    /** The first bytes of the public key of the server, see
+     * vak_archive_server_id */
+    uint32_t server_id;
+
+    /** result of the record */
+    int32_t result;
+};
+
+/** A mapped archive and its index */
+struct vak_archive_map {
+    const uint8_t *data;
+    uint64_t size;
+    const struct vak_archive_index *index;
+    uint64_t index_size;
+
+    /** Number of entries in the index */
+    uint64_t count;
+};
+
+/** Get the id used for a server in the index.
+ *
+ * \param public_key the public key of the server
+ */
+static inline uint32_t vak_archive_server_id(const uint8_t *public_key)
+{
+    uint32_t id;
+
+    memcpy(&id, public_key, sizeof(id));
+
+    return id;
+}
+
+static inline const void *vak_archive_map_file(const char *path, uint32_t magic,
+                                               uint64_t *psize)
+{
+    const struct vak_archive_header *header;
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    header = (const struct vak_archive_header *)p;
+    if (header->magic != magic || header->version != VAK_ARCHIVE_VERSION) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+
+    *psize = st.st_size;
+
+    return p;
+}
+
+/** Unmap an archive */
+static inline void vak_archive_unmap(struct vak_archive_map *map)
+{
+    if (map->data)
+        munmap((void *)map->data, map->size);
+    if (map->index)
+        munmap((void *)map->index, map->index_size);
+    memset(map, 0, sizeof(*map));
+}
+
+/** Map an archive and its index read only.
+ *
+ * Only the records that were completely written when the archive was
+ * mapped can be read, map it again to see newer ones.
+ *
+ * \param path the name of the archive
+ * \param map where the mapping is stored
+ * \returns 0 on success, -1 on an error
+ */
+static inline int vak_archive_map(const char *path, struct vak_archive_map *map)
+{
+    char index_path[4096];
+
+    memset(map, 0, sizeof(*map));
+
+    if (strlen(path) + sizeof(VAK_ARCHIVE_INDEX_SUFFIX) > sizeof(index_path))
+        return -1;
+    strcpy(index_path, path);
+    strcat(index_path, VAK_ARCHIVE_INDEX_SUFFIX);
+
+    map->data = (const uint8_t *)vak_archive_map_file(path, VAK_ARCHIVE_MAGIC, &map->size);
+    map->index = (const struct vak_archive_index *)
+        vak_archive_map_file(index_path, VAK_ARCHIVE_INDEX_MAGIC, &map->index_size);
+    if (!map->data || !map->index) {
+        vak_archive_unmap(map);
+        return -1;
+    }
+
+    /* The entries follow the header, the last one may be half
+     * written */
+    map->count = (map->index_size - sizeof(struct vak_archive_header)) /
+        sizeof(struct vak_archive_index);
+
+    return 0;
+}
+
+/** Get an index entry.
+ *
+ * \param i the number of the entry, less than map->count
+ */
+static inline const struct vak_archive_index *
+vak_archive_entry(const struct vak_archive_map *map, uint64_t i)
+{
+    return (const struct vak_archive_index *)
+        ((const uint8_t *)map->index + sizeof(struct vak_archive_header)) + i;
+}
+
+/** Get the record an index entry points to.
+ *
+ * \param i the number of the entry, less than map->count
+ * \returns a pointer into the mapped archive, the response follows
+ * the record, or NULL if the record is not all in the archive
+ */
+static inline const struct vak_archive_record *
+vak_archive_record(const struct vak_archive_map *map, uint64_t i)
+{
+    const struct vak_archive_record *record;
+    uint64_t offset = vak_archive_entry(map, i)->offset;
+
+    if (offset % VAK_ARCHIVE_ALIGN || offset < sizeof(struct vak_archive_header) ||
+        offset > map->size || map->size - offset < sizeof(*record))
+        return NULL;
+
+    record = (const struct vak_archive_record *)(map->data + offset);
+    if (map->size - offset - sizeof(*record) < record->length)
+        return NULL;
+
+    return record;
+}
+
+/** Get the response in a record, record->length bytes */
+static inline const uint8_t *vak_archive_response(const struct vak_archive_record *record)
+{
+    return (const uint8_t *)(record + 1);
+}
+
+/** Find the first index entry received at or after a time.
+ *
+ * The entries are in the order the responses were received, so they
+ * are sorted by time unless the local clock was stepped back while
+ * the archive was written.
+ *
+ * \param time microseconds since the epoch
+ * \returns the number of the entry, map->count if all are earlier
+ */
+static inline uint64_t vak_archive_find(const struct vak_archive_map *map, int64_t time)
+{
+    uint64_t lo = 0, hi = map->count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (vak_archive_entry(map, mid)->recv_time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VAK_ARCHIVE_H */
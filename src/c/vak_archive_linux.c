@@ -0,0 +1,180 @@
+#include "vak.h"
+#include "vak_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+struct vak_archive {
+    int fd;
+    int index_fd;
+
+    /* Where the next record goes, only one process may write to an
+     * archive at a time */
+    uint64_t offset;
+};
+
+/* Open one of the files for appending and check or write the header,
+ * returns the size of the file or -1 on an error */
+static int64_t vak_archive_open_file(const char *path, uint32_t magic, int *pfd)
+{
+    struct vak_archive_header header;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    *pfd = fd;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "fstat %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!st.st_size) {
+        header.magic = magic;
+        header.version = VAK_ARCHIVE_VERSION;
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            fprintf(stderr, "write %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+        return sizeof(header);
+    }
+
+    /* Never write over something that is not an archive, and never
+     * mix layouts in one archive */
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != magic || header.version != VAK_ARCHIVE_VERSION) {
+        fprintf(stderr, "%s is not a version %u archive\n", path, VAK_ARCHIVE_VERSION);
+        return -1;
+    }
+
+    return st.st_size;
+}
+
+struct vak_archive *vak_archive_open(const char *path)
+{
+    static const uint8_t zeroes[VAK_ARCHIVE_ALIGN];
+    struct vak_archive *archive;
+    char *index_path;
+    int64_t size, index_size;
+    unsigned pad;
+
+    archive = malloc(sizeof(*archive));
+    index_path = malloc(strlen(path) + sizeof(VAK_ARCHIVE_INDEX_SUFFIX));
+    if (!archive || !index_path) {
+        fprintf(stderr, "malloc archive failed\n");
+        free(archive);
+        free(index_path);
+        return NULL;
+    }
+    strcpy(index_path, path);
+    strcat(index_path, VAK_ARCHIVE_INDEX_SUFFIX);
+
+    archive->fd = -1;
+    archive->index_fd = -1;
+    size = vak_archive_open_file(path, VAK_ARCHIVE_MAGIC, &archive->fd);
+    index_size = size < 0 ? -1 :
+        vak_archive_open_file(index_path, VAK_ARCHIVE_INDEX_MAGIC, &archive->index_fd);
+    free(index_path);
+    if (index_size < 0) {
+        vak_archive_close(archive);
+        return NULL;
+    }
+
+    /* A record or an index entry may have been cut short if the last
+     * writer died, the index never points to a record which was not
+     * complete, but later records have to be aligned again */
+    pad = (VAK_ARCHIVE_ALIGN - size % VAK_ARCHIVE_ALIGN) % VAK_ARCHIVE_ALIGN;
+    if (pad && write(archive->fd, zeroes, pad) != pad) {
+        fprintf(stderr, "write %s failed: %s\n", path, strerror(errno));
+        vak_archive_close(archive);
+        return NULL;
+    }
+    archive->offset = size + pad;
+
+    index_size -= sizeof(struct vak_archive_header);
+    if (index_size % sizeof(struct vak_archive_index) &&
+        ftruncate(archive->index_fd, sizeof(struct vak_archive_header) +
+                  index_size - index_size % sizeof(struct vak_archive_index)) < 0) {
+        fprintf(stderr, "ftruncate %s%s failed: %s\n",
+                path, VAK_ARCHIVE_INDEX_SUFFIX, strerror(errno));
+        vak_archive_close(archive);
+        return NULL;
+    }
+
+    return archive;
+}
+
+void vak_archive_close(struct vak_archive *archive)
+{
+    if (archive->fd >= 0)
+        close(archive->fd);
+    if (archive->index_fd >= 0)
+        close(archive->index_fd);
+    free(archive);
+}
+
+int vak_archive_add(struct vak_archive *archive, const struct vak_server *server,
+                    vak_time_t send_time, vak_time_t recv_time, int result,
+                    const void *buffer, unsigned length)
+{
+    static const uint8_t zeroes[VAK_ARCHIVE_ALIGN];
+    struct vak_archive_record record;
+    struct vak_archive_index entry;
+    struct iovec iov[3];
+    unsigned pad = (VAK_ARCHIVE_ALIGN - length % VAK_ARCHIVE_ALIGN) % VAK_ARCHIVE_ALIGN;
+    ssize_t len = sizeof(record) + length + pad;
+
+    /* The offsets are not known any more after a failed write */
+    if (archive->fd < 0)
+        return -1;
+
+    memset(&record, 0, sizeof(record));
+    record.send_time = send_time;
+    record.recv_time = recv_time;
+    memcpy(record.public_key, server->public_key, sizeof(record.public_key));
+    record.variant = server->variant;
+    record.length = length;
+    record.result = result;
+
+    entry.recv_time = recv_time;
+    entry.offset = archive->offset;
+    entry.server_id = vak_archive_server_id(server->public_key);
+    entry.result = result;
+
+    /* One write for the record and one for the index entry, which
+     * makes the record visible to readers when it is complete */
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)buffer;
+    iov[1].iov_len = length;
+    iov[2].iov_base = (void *)zeroes;
+    iov[2].iov_len = pad;
+
+    if (writev(archive->fd, iov, 3) != len) {
+        fprintf(stderr, "writev archive failed: %s\n", strerror(errno));
+        close(archive->fd);
+        archive->fd = -1;
+        return -1;
+    }
+    archive->offset += len;
+
+    if (write(archive->index_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+        fprintf(stderr, "write archive index failed: %s\n", strerror(errno));
+        close(archive->fd);
+        archive->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "vak.h"
+#include "vrt.h"
+
+/* A request is the magic and the nonce, padded with zeroes to
+ * VAK_BATCH_PACKET_SIZE so that a reply is never larger than the
+ * request.  A reply is the magic, the nonce, the server which was
+ * queried, where the nonce is in the tree, the path up to the root
+ * and finally the response from the server, as it was received. */
+#define VAK_BATCH_REQUEST_MAGIC "VAKB"
+#define VAK_BATCH_REPLY_MAGIC "VAKA"
+#define VAK_BATCH_MAGIC_SIZE 4
+
+#define VAK_BATCH_NONCE_OFFSET VAK_BATCH_MAGIC_SIZE
+#define VAK_BATCH_PUBK_OFFSET (VAK_BATCH_NONCE_OFFSET + VAK_BATCH_NONCE_SIZE)
+#define VAK_BATCH_VARIANT_OFFSET (VAK_BATCH_PUBK_OFFSET + 32)
+#define VAK_BATCH_INDEX_OFFSET (VAK_BATCH_VARIANT_OFFSET + 4)
+#define VAK_BATCH_DEPTH_OFFSET (VAK_BATCH_INDEX_OFFSET + 4)
+#define VAK_BATCH_RESPONSE_LEN_OFFSET (VAK_BATCH_DEPTH_OFFSET + 4)
+#define VAK_BATCH_PATH_OFFSET (VAK_BATCH_RESPONSE_LEN_OFFSET + 4)
+
+#if VAK_BATCH_NONCE_SIZE != VAK_TREE_LEAF_SIZE
+#error "VAK_BATCH_NONCE_SIZE must be the same as VAK_TREE_LEAF_SIZE"
+#endif
+
+/* Numbers are little endian like in roughtime */
+static void vak_batch_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t vak_batch_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int vak_batch_make_request(uint8_t *buffer, const uint8_t *nonce)
+{
+    memset(buffer, 0, VAK_BATCH_PACKET_SIZE);
+    memcpy(buffer, VAK_BATCH_REQUEST_MAGIC, VAK_BATCH_MAGIC_SIZE);
+    memcpy(buffer + VAK_BATCH_NONCE_OFFSET, nonce, VAK_BATCH_NONCE_SIZE);
+
+    return VAK_BATCH_PACKET_SIZE;
+}
+
+int vak_batch_parse_request(const uint8_t *request, unsigned request_len, uint8_t *nonce)
+{
+    /* Short requests would make the front end an amplifier */
+    if (request_len < VAK_BATCH_PACKET_SIZE ||
+        memcmp(request, VAK_BATCH_REQUEST_MAGIC, VAK_BATCH_MAGIC_SIZE))
+        return 0;
+
+    memcpy(nonce, request + VAK_BATCH_NONCE_OFFSET, VAK_BATCH_NONCE_SIZE);
+
+    return 1;
+}
+
+int vak_batch_make_reply(uint8_t *buffer, const uint8_t *nonce,
+                         const struct vak_server *server,
+                         unsigned index, const uint8_t *path, unsigned depth,
+                         const void *response, unsigned response_len)
+{
+    unsigned path_len = depth * VAK_TREE_NODE_SIZE;
+    unsigned len = VAK_BATCH_PATH_OFFSET + path_len + response_len;
+
+    if (len > VAK_BATCH_PACKET_SIZE)
+        return -1;
+
+    memcpy(buffer, VAK_BATCH_REPLY_MAGIC, VAK_BATCH_MAGIC_SIZE);
+    memcpy(buffer + VAK_BATCH_NONCE_OFFSET, nonce, VAK_BATCH_NONCE_SIZE);
+    memcpy(buffer + VAK_BATCH_PUBK_OFFSET, server->public_key, 32);
+    vak_batch_put32(buffer + VAK_BATCH_VARIANT_OFFSET, server->variant);
+    vak_batch_put32(buffer + VAK_BATCH_INDEX_OFFSET, index);
+    vak_batch_put32(buffer + VAK_BATCH_DEPTH_OFFSET, depth);
+    vak_batch_put32(buffer + VAK_BATCH_RESPONSE_LEN_OFFSET, response_len);
+    memcpy(buffer + VAK_BATCH_PATH_OFFSET, path, path_len);
+    memcpy(buffer + VAK_BATCH_PATH_OFFSET + path_len, response, response_len);
+
+    return len;
+}
+
+int vak_batch_parse_reply(const uint8_t *reply, unsigned reply_len,
+                          const uint8_t *nonce, struct vak_server const **servers,
+                          vak_time_t send_time, vak_time_t recv_time,
+                          overlap_value_t *plo, overlap_value_t *phi)
+{
+    uint32_t response[VAK_BATCH_PACKET_SIZE / 4];
+    uint8_t root[VAK_TREE_NODE_SIZE];
+    const struct vak_server *server = NULL;
+    unsigned variant, index, depth, response_len;
+    uint64_t midp;
+    uint32_t radi;
+    double adjustment, uncertainty;
+    unsigned i;
+
+    if (reply_len < VAK_BATCH_PATH_OFFSET ||
+        memcmp(reply, VAK_BATCH_REPLY_MAGIC, VAK_BATCH_MAGIC_SIZE) ||
+        memcmp(reply + VAK_BATCH_NONCE_OFFSET, nonce, VAK_BATCH_NONCE_SIZE))
+        return 0;
+
+    variant = vak_batch_get32(reply + VAK_BATCH_VARIANT_OFFSET);
+    index = vak_batch_get32(reply + VAK_BATCH_INDEX_OFFSET);
+    depth = vak_batch_get32(reply + VAK_BATCH_DEPTH_OFFSET);
+    response_len = vak_batch_get32(reply + VAK_BATCH_RESPONSE_LEN_OFFSET);
+
+    if (depth > VAK_BATCH_MAX_DEPTH || index >= (1u << depth) ||
+        response_len > sizeof(response) ||
+        reply_len != VAK_BATCH_PATH_OFFSET + depth * VAK_TREE_NODE_SIZE + response_len)
+        return 0;
+
+    /* Only trust servers we would have queried ourselves */
+    for (i = 0; servers[i]; i++) {
+        if (servers[i]->variant == variant &&
+            !memcmp(servers[i]->public_key, reply + VAK_BATCH_PUBK_OFFSET, 32)) {
+            server = servers[i];
+            break;
+        }
+    }
+    if (!server)
+        return 0;
+
+    /* The server signed the root that our nonce hashes up to */
+    vak_tree_hash_path(root, nonce, index, reply + VAK_BATCH_PATH_OFFSET, depth);
+
+    memcpy(response, reply + VAK_BATCH_PATH_OFFSET + depth * VAK_TREE_NODE_SIZE, response_len);
+    if (vrt_parse_response(root, sizeof(root), response, response_len,
+                           server->public_key, &midp, &radi,
+                           server->variant) != VRT_SUCCESS)
+        return 0;
+
+    /* The same translation as for a direct query, the time spent
+     * waiting for the rest of the batch counts as round trip time */
+    adjustment = ((double)midp - (double)(send_time + recv_time) / 2) / 1000000;
+    uncertainty = (double)radi / 1000000 + (double)(recv_time - send_time) / 2000000;
+
+    *plo = adjustment - uncertainty;
+    *phi = adjustment + uncertainty;
+
+    return 1;
+}
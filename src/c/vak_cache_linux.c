@@ -0,0 +1,141 @@
+#include "vak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Magic number and version at the start of a cache file, "VAKC" */
+#define VAK_CACHE_MAGIC 0x434b4156
+#define VAK_CACHE_VERSION 2
+
+/* Number of servers a cache file can hold */
+#define VAK_CACHE_ENTRIES 64
+
+struct vak_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t nr_entries;
+    struct vak_cache_entry entries[VAK_CACHE_ENTRIES];
+};
+
+struct vak_cache {
+    int fd;
+    struct vak_cache_file *file;
+};
+
+struct vak_cache *vak_cache_open(const char *path)
+{
+    struct vak_cache *cache;
+    struct stat st;
+
+    cache = malloc(sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->file = NULL;
+    cache->fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (cache->fd < 0) {
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+        vak_cache_close(cache);
+        return NULL;
+    }
+
+    if (fstat(cache->fd, &st) < 0) {
+        fprintf(stderr, "fstat %s failed: %s\n", path, strerror(errno));
+        vak_cache_close(cache);
+        return NULL;
+    }
+
+    /* Someone else must not be able to change what we remember about
+     * the servers, and we must not write to a file of someone else,
+     * or to another file of ours through a link to it */
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_nlink != 1 ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "%s is not a regular file owned by us and only writable by us\n", path);
+        vak_cache_close(cache);
+        return NULL;
+    }
+
+    /* A new file, or one with a different layout, is started over */
+    if (st.st_size != sizeof(*cache->file) &&
+        ftruncate(cache->fd, sizeof(*cache->file)) < 0) {
+        fprintf(stderr, "ftruncate %s failed: %s\n", path, strerror(errno));
+        vak_cache_close(cache);
+        return NULL;
+    }
+
+    cache->file = mmap(NULL, sizeof(*cache->file), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, cache->fd, 0);
+    if (cache->file == MAP_FAILED) {
+        fprintf(stderr, "mmap %s failed: %s\n", path, strerror(errno));
+        cache->file = NULL;
+        vak_cache_close(cache);
+        return NULL;
+    }
+
+    if (cache->file->magic != VAK_CACHE_MAGIC ||
+        cache->file->version != VAK_CACHE_VERSION ||
+        cache->file->entry_size != sizeof(struct vak_cache_entry) ||
+        cache->file->nr_entries != VAK_CACHE_ENTRIES) {
+        memset(cache->file, 0, sizeof(*cache->file));
+        cache->file->magic = VAK_CACHE_MAGIC;
+        cache->file->version = VAK_CACHE_VERSION;
+        cache->file->entry_size = sizeof(struct vak_cache_entry);
+        cache->file->nr_entries = VAK_CACHE_ENTRIES;
+    }
+
+    return cache;
+}
+
+void vak_cache_close(struct vak_cache *cache)
+{
+    if (cache->file) {
+        msync(cache->file, sizeof(*cache->file), MS_SYNC);
+        munmap(cache->file, sizeof(*cache->file));
+    }
+    if (cache->fd != -1)
+        close(cache->fd);
+    free(cache);
+}
+
+struct vak_cache_entry *vak_cache_find(struct vak_cache *cache,
+                                       const struct vak_server *server,
+                                       int add)
+{
+    struct vak_cache_entry *entry, *oldest = NULL;
+    unsigned i;
+
+    /* The host must fit with a terminating zero */
+    if (strlen(server->host) >= VAK_CACHE_HOST_SIZE)
+        return NULL;
+
+    for (i = 0; i < VAK_CACHE_ENTRIES; i++) {
+        entry = &cache->file->entries[i];
+
+        if (entry->port == server->port &&
+            !strcmp(entry->host, server->host) &&
+            !memcmp(entry->public_key, server->public_key, sizeof(entry->public_key)))
+            return entry;
+
+        if (!oldest || !entry->host[0] ||
+            (oldest->host[0] && entry->updated < oldest->updated))
+            oldest = entry;
+    }
+
+    if (!add)
+        return NULL;
+
+    memset(oldest, 0, sizeof(*oldest));
+    strcpy(oldest->host, server->host);
+    oldest->port = server->port;
+    memcpy(oldest->public_key, server->public_key, sizeof(oldest->public_key));
+
+    return oldest;
+}
@@ -0,0 +1,65 @@
+#include "vak.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/timex.h>
+
+/* The kernel does not accept frequency corrections larger than this */
+#define VAK_MAX_PPM 500.0
+
+int vak_slew_time(vak_time_t adj)
+{
+    struct timex tx;
+
+    /* The kernel slews at 500 ppm, so 0.5 ms per second.  Larger
+     * adjustments are better done with vak_adjust_time. */
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_OFFSET_SINGLESHOT;
+    tx.offset = adj;
+
+    if (adjtimex(&tx) < 0) {
+        fprintf(stderr, "adjtimex ADJ_OFFSET_SINGLESHOT failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int vak_set_frequency(double ppm)
+{
+    struct timex tx;
+
+    if (ppm > VAK_MAX_PPM)
+        ppm = VAK_MAX_PPM;
+    if (ppm < -VAK_MAX_PPM)
+        ppm = -VAK_MAX_PPM;
+
+    /* The frequency is in ppm with a 16 bit binary fraction */
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_FREQUENCY;
+    tx.freq = (long)(ppm * 65536);
+
+    if (adjtimex(&tx) < 0) {
+        fprintf(stderr, "adjtimex ADJ_FREQUENCY failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int vak_get_frequency(double *ppm)
+{
+    struct timex tx;
+
+    memset(&tx, 0, sizeof(tx));
+
+    if (adjtimex(&tx) < 0) {
+        fprintf(stderr, "adjtimex failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    *ppm = tx.freq / 65536.0;
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vak.h"
+
+/* Number of syncs to remember */
+#define VAK_DRIFT_HISTORY 16
+
+/* How much the frequency may wander between syncs, in ppm, for
+ * example with the temperature.  Ranges are allowed to disagree by
+ * this much before the oldest ones are thrown away. */
+static const double DRIFT_WANDER_PPM = 1.0;
+
+/* The frequency error of a cheap crystal oscillator is rarely more
+ * than this, it is assumed until there are two syncs to compare */
+static const double DRIFT_DEFAULT_PPM = 500.0;
+
+/* The result of a sync as a range of offsets between the real time
+ * and the monotonic clock, in microseconds, at a monotonic time */
+struct vak_drift_sample {
+    vak_time_t monotonic;
+    vak_time_t lo, hi;
+};
+
+struct vak_drift {
+    struct vak_drift_sample samples[VAK_DRIFT_HISTORY];
+    unsigned nr_samples;
+
+    /* The range of frequency errors in ppm, valid if known is set */
+    int known;
+    double lo_ppm, hi_ppm;
+};
+
+struct vak_drift *vak_drift_new(void)
+{
+    struct vak_drift *drift;
+
+    drift = malloc(sizeof(*drift));
+    if (!drift)
+        return NULL;
+
+    memset(drift, 0, sizeof(*drift));
+
+    return drift;
+}
+
+void vak_drift_del(struct vak_drift *drift)
+{
+    free(drift);
+}
+
+/* Find the frequency errors all pairs of samples agree with.  A pair
+ * of ranges limits the slope of a line through both of them.
+ * Returns 1 if there is a frequency error that fits all pairs. */
+static int vak_drift_fit(const struct vak_drift *drift, double *plo, double *phi)
+{
+    double lo = -DRIFT_DEFAULT_PPM * 2, hi = DRIFT_DEFAULT_PPM * 2;
+    unsigned i, j;
+
+    for (i = 0; i < drift->nr_samples; i++) {
+        const struct vak_drift_sample *a = &drift->samples[i];
+
+        for (j = i + 1; j < drift->nr_samples; j++) {
+            const struct vak_drift_sample *b = &drift->samples[j];
+            double elapsed = (double)(b->monotonic - a->monotonic);
+            double l, h;
+
+            if (elapsed <= 0)
+                continue;
+
+            /* Microseconds per microsecond is the same as ppm
+             * after scaling by a million */
+            l = (double)(b->lo - a->hi) / elapsed * 1000000 - DRIFT_WANDER_PPM;
+            h = (double)(b->hi - a->lo) / elapsed * 1000000 + DRIFT_WANDER_PPM;
+
+            if (l > lo)
+                lo = l;
+            if (h < hi)
+                hi = h;
+        }
+    }
+
+    if (lo > hi)
+        return 0;
+
+    *plo = lo;
+    *phi = hi;
+    return 1;
+}
+
+void vak_drift_add(struct vak_drift *drift, const struct vak_clock_sample *clock,
+                   overlap_value_t lo, overlap_value_t hi)
+{
+    struct vak_drift_sample *sample;
+    vak_time_t offset = clock->realtime - clock->monotonic;
+
+    if (drift->nr_samples == VAK_DRIFT_HISTORY) {
+        memmove(&drift->samples[0], &drift->samples[1],
+                (VAK_DRIFT_HISTORY - 1) * sizeof(drift->samples[0]));
+        drift->nr_samples--;
+    }
+
+    sample = &drift->samples[drift->nr_samples++];
+    sample->monotonic = clock->monotonic;
+    sample->lo = offset + (vak_time_t)(lo * 1000000);
+    sample->hi = offset + (vak_time_t)(hi * 1000000);
+
+    /* Throw away the oldest samples until the rest agree */
+    while (!vak_drift_fit(drift, &drift->lo_ppm, &drift->hi_ppm)) {
+        memmove(&drift->samples[0], &drift->samples[1],
+                (drift->nr_samples - 1) * sizeof(drift->samples[0]));
+        drift->nr_samples--;
+    }
+
+    drift->known = drift->nr_samples >= 2;
+}
+
+int vak_drift_frequency(const struct vak_drift *drift, double *plo, double *phi)
+{
+    if (!drift->known)
+        return 0;
+
+    *plo = drift->lo_ppm;
+    *phi = drift->hi_ppm;
+    return 1;
+}
+
+vak_time_t vak_drift_interval(const struct vak_drift *drift, double freq, double max_error)
+{
+    const struct vak_drift_sample *last;
+    double rate, error;
+
+    if (!drift->nr_samples)
+        return 0;
+
+    last = &drift->samples[drift->nr_samples - 1];
+
+    /* The worst case difference between the frequency correction and
+     * the frequency error, plus what it may wander */
+    if (drift->known) {
+        rate = drift->hi_ppm - freq;
+        if (freq - drift->lo_ppm > rate)
+            rate = freq - drift->lo_ppm;
+    } else {
+        rate = DRIFT_DEFAULT_PPM;
+    }
+    rate += DRIFT_WANDER_PPM;
+
+    error = max_error * 1000000 - (double)(last->hi - last->lo) / 2;
+    if (error <= 0)
+        return 0;
+
+    return (vak_time_t)(error / rate * 1000000);
+}
@@ -9,6 +9,10 @@
 #include "vak.h"
 #include "overlap_algo.h"
 
+#if VAK_CERT_SIZE != VRT_CERT_CACHE_SIZE
+#error "VAK_CERT_SIZE does not match VRT_CERT_CACHE_SIZE"
+#endif
+
 #if 0
 static void hd(const void *buf, unsigned length)
 {
@@ -27,9 +31,144 @@ static const int WANTED_OVERLAPS = 3;
 /* Maximum uncertainty (seconds) of overlap required to succeed */
 static const double WANTED_UNCERTAINTY = 2.0;
 
-/* How long to wait for a successful response to a roughtime query */
+/* How long to wait for a successful response to a roughtime query,
+ * used until we have measured the round trip time to a server and as
+ * an upper limit afterwards */
 static const uint64_t QUERY_TIMEOUT_USECS = 1000000;
 
+/* Lower limit on the timeout, to allow for scheduling delays and
+ * servers that are slower than usual */
+static const uint64_t QUERY_TIMEOUT_MIN_USECS = 50000;
+
+/* Maximum number of datagrams to receive at a time */
+#define VAK_RECV_BATCH 8
+
+/* Maximum number of queries in flight at the same time */
+#define VAK_MAX_QUERIES 4
+
+/* Number of queries to keep in flight */
+static const unsigned WANTED_QUERIES = 1;
+
+/* Maximum number of extra queries started during one sync because a
+ * response was late */
+static const unsigned MAX_HEDGES = 3;
+
+/* When a response is considered late for a server we have no round
+ * trip times for */
+static const uint64_t HEDGE_DEFAULT_USECS = 250000;
+
+/* How much the difference between the wall time and the monotonic
+ * time may change before we decide that the wall clock has been
+ * stepped.  The difference changes slowly when the wall clock is
+ * slewed, at most 500 ppm, or has its frequency corrected, at most
+ * another 500 ppm, and the clocks can not be read at exactly the
+ * same time. */
+static const uint64_t CLOCK_STEP_MIN_USECS = 1000;
+static const uint64_t CLOCK_STEP_PPM = 1000;
+
+/* Range of frequency errors of the monotonic clock assumed when
+ * aging old responses, in ppm, until the caller knows better */
+static const double AGE_DEFAULT_PPM = 100.0;
+
+/* Number of new responses needed even if old responses would be
+ * enough to reach WANTED_OVERLAPS */
+static const unsigned MIN_FRESH_RESPONSES = 1;
+
+/* How long to use a looked up address before looking it up again */
+static const uint64_t RESOLVE_TTL_USECS = 3600 * (uint64_t)1000000;
+
+/* Query counts in the cache are halved when they reach this, so
+ * that the failure rate follows what a server has done lately */
+static const unsigned CACHE_MAX_QUERIES = 32;
+
+/* How long to wait before trying a failed lookup again */
+static const uint64_t RESOLVE_RETRY_USECS = 60 * (uint64_t)1000000;
+
+enum vak_query_state {
+    VAK_QUERY_FREE,
+    VAK_QUERY_PENDING,          /* waiting to be handed out by vak_impl_get_send */
+    VAK_QUERY_SENT,             /* waiting for a response */
+};
+
+/* State kept for each unique server, the server list may contain
+ * the same server more than once */
+struct vak_server_state {
+    const struct vak_server *server;
+
+    /* Addresses of the server and when they have to be looked up again */
+    struct vak_addr addrs[VAK_MAX_ADDRS];
+    unsigned nr_addrs;
+    vak_time_t addr_expires;
+
+    /* Statistics used to choose servers.  The smoothed round trip
+     * time in stats and its variation in microseconds are computed
+     * like TCP does (RFC 6298), 0 until we have a sample */
+    struct vak_server_stats stats;
+    vak_time_t rttvar;
+
+    /* Number of timeouts since the last response, each one doubles
+     * the timeout */
+    unsigned backoff;
+
+    /* The last verified delegation, all zeroes if there is none, and
+     * the public key and variant it was verified for.  Servers with
+     * the same host and port share the state but can have different
+     * keys or variants. */
+    uint8_t cert[VRT_CERT_CACHE_SIZE];
+    uint8_t cert_public_key[32];
+    unsigned cert_variant;
+
+    /* Where the state is saved between runs, or NULL */
+    struct vak_cache_entry *cache_entry;
+
+    /* The last verified response as a range of offsets in
+     * microseconds between the real time and the monotonic clock,
+     * and the monotonic time it was received, valid if nonzero */
+    vak_time_t sample_monotonic;
+    vak_time_t sample_lo, sample_hi;
+
+    /* Set if the sample is used by the current sync */
+    int aged;
+};
+
+/* A query is sent to all addresses of a server at the same time with
+ * the same nonce, the first verified response wins.  The identifier
+ * handed out for each address is query * VAK_MAX_ADDRS + address. */
+struct vak_query {
+    enum vak_query_state state;
+    const struct vak_server *server;
+    struct vak_server_state *server_state;
+    uint8_t nonce[VRT_NONCE_SIZE];
+    vak_time_t deadline;
+
+    /* When the response is late and another query should be started
+     * in parallel, and if that has been done */
+    vak_time_t hedge_time;
+    int late;
+
+    /* The addresses the query is sent to, the number of them which
+     * have been handed out by vak_impl_get_send and a bit for each
+     * address the query could not be sent to */
+    struct vak_addr addrs[VAK_MAX_ADDRS];
+    unsigned nr_addrs;
+    unsigned next_addr;
+    unsigned failed;
+
+    vak_time_t send_times[VAK_MAX_ADDRS];
+
+    /* Ids from vak_udp_send_batch and the channels the query was
+     * sent on, only used by vak_impl_process */
+    unsigned udp_ids[VAK_MAX_ADDRS];
+    int channels[VAK_MAX_ADDRS];
+};
+
+/* A verified response kept for vak_impl_get_response */
+struct vak_kept_response {
+    const struct vak_server *server;
+    void *buffer;
+    unsigned length;
+};
+
 struct vak_impl {
     struct vak_server const **servers;
     unsigned wanted;
@@ -37,20 +176,106 @@ struct vak_impl {
 
     struct overlap_algo *algo;
     unsigned nr_servers;
-    unsigned current_server;
     unsigned nr_queries;
     unsigned nr_responses;
-    vak_time_t send_time;
+
+    /* Number of the responses that are old ones from earlier syncs */
+    unsigned nr_aged;
+
+    /* Range of frequency errors of the monotonic clock in ppm */
+    double drift_lo, drift_hi;
+
+    /* Number of queries that have been marked as late */
+    unsigned nr_hedges;
+
+    /* 1 if we have good time, -1 if we have run out of servers */
+    int result;
+    overlap_value_t lo, hi;
+
+    struct vak_query queries[VAK_MAX_QUERIES];
+
+    /* State for each unique server and a mapping from the index in
+     * the server list to the state */
+    struct vak_server_state *states;
+    unsigned nr_states;
+    struct vak_server_state **server_states;
+
+    /* The statistics for each entry in the server list and which of
+     * them have been queried */
+    const struct vak_server_stats **server_stats;
+    uint8_t *used;
+
+    /* When the next address has to be looked up */
+    vak_time_t resolve_deadline;
+
+    /* The wall and monotonic times when the clock was last checked
+     * for steps */
+    struct vak_clock_sample clock;
 
     unsigned buffer_size;
-    uint8_t *buffer;
-    unsigned nonce_size;
-    uint8_t *nonce;
+    struct vak_udp_msg msgs[VAK_RECV_BATCH];
+
+    /* Statistics are saved here when the sync has finished */
+    struct vak_cache *cache;
+
+    /* Responses are written here, through a pointer so that
+     * platforms without archives do not have to link with them */
+    struct vak_archive *archive;
+    int (*archive_add)(struct vak_archive *archive, const struct vak_server *server,
+                       vak_time_t send_time, vak_time_t recv_time, int result,
+                       const void *buffer, unsigned length);
+
+    /* Send each query on its own connected channel and the query
+     * using each channel */
+    int connected;
+    struct vak_query *channel_queries[VAK_MAX_CHANNELS + 1];
+
+    /* Prebuilt queries, index 0 is used for variants before 5 and
+     * index 1 for variant 5 or later.  Only the nonce is changed
+     * for each query. */
+    uint8_t *query[2];
+    int query_len[2];
+    unsigned query_nonce_offset[2];
+    unsigned query_nonce_len[2];
+
+    /* The nonce to use for all queries if fixed_nonce is set, and the
+     * verified responses to it */
+    int fixed_nonce;
+    uint8_t nonce[VRT_NONCE_SIZE];
+    struct vak_kept_response *kept;
+    unsigned nr_kept;
 };
 
+static int vak_same_host(const struct vak_server *a, const struct vak_server *b)
+{
+    return a->port == b->port && !strcmp(a->host, b->host);
+}
+
+/* Find the state for a server, optionally adding it if it is new */
+static struct vak_server_state *vak_find_state(struct vak_impl *impl,
+                                               const struct vak_server *server,
+                                               int add)
+{
+    unsigned i;
+
+    for (i = 0; i < impl->nr_states; i++) {
+        if (vak_same_host(impl->states[i].server, server))
+            return &impl->states[i];
+    }
+
+    if (!add)
+        return NULL;
+
+    impl->states[i].server = server;
+    impl->nr_states++;
+
+    return &impl->states[i];
+}
+
 struct vak_impl *vak_impl_new(struct vak_server const **servers, unsigned wanted, struct vak_udp *udp)
 {
     struct vak_impl *impl;
+    unsigned i;
 
     impl = malloc(sizeof(*impl));
     if (!impl)
@@ -62,20 +287,16 @@ struct vak_impl *vak_impl_new(struct vak_server const **servers, unsigned wanted
     impl->wanted = wanted;
     impl->udp = udp;
 
+    /* Receive buffers are only needed when we do the I/O ourselves */
     impl->buffer_size = VRT_QUERY_PACKET_LEN;
-    impl->buffer = malloc(impl->buffer_size);
-    if (!impl->buffer) {
-        fprintf(stderr, "malloc buffer failed\n");
-        vak_impl_del(impl);
-        return NULL;
-    }
-
-    impl->nonce_size = VRT_NONCE_SIZE;
-    impl->nonce = malloc(impl->nonce_size);
-    if (!impl->nonce) {
-        fprintf(stderr, "malloc nonce failed\n");
-        vak_impl_del(impl);
-        return NULL;
+    for (i = 0; udp && i < VAK_RECV_BATCH; i++) {
+        impl->msgs[i].size = impl->buffer_size;
+        impl->msgs[i].buffer = malloc(impl->buffer_size);
+        if (!impl->msgs[i].buffer) {
+            fprintf(stderr, "malloc buffer failed\n");
+            vak_impl_del(impl);
+            return NULL;
+        }
     }
 
     /* Create the overlap algorithm */
@@ -89,172 +310,1012 @@ struct vak_impl *vak_impl_new(struct vak_server const **servers, unsigned wanted
     /* count number of servers */
     for (impl->nr_servers = 0; impl->servers[impl->nr_servers]; impl->nr_servers++)
         ;
-    impl->current_server = 0;
+    impl->states = calloc(impl->nr_servers + 1, sizeof(*impl->states));
+    impl->server_states = calloc(impl->nr_servers + 1, sizeof(*impl->server_states));
+    impl->server_stats = calloc(impl->nr_servers + 1, sizeof(*impl->server_stats));
+    impl->used = calloc(impl->nr_servers + 1, sizeof(*impl->used));
+    if (!impl->states || !impl->server_states || !impl->server_stats || !impl->used) {
+        fprintf(stderr, "malloc server states failed\n");
+        vak_impl_del(impl);
+        return NULL;
+    }
+
+    for (i = 0; i < impl->nr_servers; i++) {
+        impl->server_states[i] = vak_find_state(impl, impl->servers[i], 1);
+        impl->server_stats[i] = &impl->server_states[i]->stats;
+    }
 
     impl->nr_queries = 0;
     impl->nr_responses = 0;
+    impl->drift_lo = -AGE_DEFAULT_PPM;
+    impl->drift_hi = AGE_DEFAULT_PPM;
+
+    vak_get_clock_sample(&impl->clock);
 
     return impl;
 }
 
+static void vak_free_kept(struct vak_impl *impl)
+{
+    unsigned i;
+
+    for (i = 0; i < impl->nr_kept; i++)
+        free(impl->kept[i].buffer);
+    free(impl->kept);
+    impl->kept = NULL;
+    impl->nr_kept = 0;
+}
+
 void vak_impl_del(struct vak_impl *impl)
 {
-    free(impl->buffer);
-    free(impl->nonce);
+    unsigned i;
+
+    vak_free_kept(impl);
+
+    for (i = 0; i < VAK_RECV_BATCH; i++)
+        free(impl->msgs[i].buffer);
+    free(impl->query[0]);
+    free(impl->query[1]);
+    free(impl->states);
+    free(impl->server_states);
+    free(impl->server_stats);
+    free(impl->used);
     if (impl->algo)
         overlap_del(impl->algo);
     free(impl);
 }
 
-static int vak_send_query(struct vak_impl *impl, const struct vak_server *server)
+/* Return a query template for the variant, building it the first time */
+static int vak_get_query(struct vak_impl *impl, unsigned variant)
 {
-    int length;
+    unsigned i = variant >= 5;
 
-    /* Create a random nonce.  This should be as good randomness as
-     * possible, preferably cryptographically secure randomness. */
-    if (getentropy(impl->nonce, impl->nonce_size) < 0) {
-        fprintf(stderr, "getentropy(%u) failed: %s\n", (unsigned)impl->nonce_size, strerror(errno));
-        return -1;
+    if (!impl->query[i]) {
+        impl->query[i] = malloc(VRT_QUERY_PACKET_LEN);
+        if (!impl->query[i]) {
+            fprintf(stderr, "malloc query failed\n");
+            return -1;
+        }
+
+        impl->query_len[i] = vrt_make_query_template(impl->query[i], VRT_QUERY_PACKET_LEN,
+                                                     variant,
+                                                     &impl->query_nonce_offset[i],
+                                                     &impl->query_nonce_len[i]);
+        if (impl->query_len[i] < 0) {
+            fprintf(stderr, "vrt_make_query_template failed\n");
+            free(impl->query[i]);
+            impl->query[i] = NULL;
+            return -1;
+        }
     }
 
-    /* Fill in the query. */
-    length = vrt_make_query(impl->buffer, impl->buffer_size,
-                            impl->nonce, impl->nonce_size,
-                            server->variant);
-    if (length < 0) {
-        fprintf(stderr, "vrt_make_query failed\n");
-        return -1;
+    return i;
+}
+
+static int vak_same_addr(const struct vak_addr *a, const struct vak_addr *b)
+{
+    return (a->family == b->family && a->port == b->port &&
+            !memcmp(a->addr, b->addr, a->family == 6 ? 16 : 4));
+}
+
+static void vak_set_addrs(struct vak_server_state *state,
+                          const struct vak_addr *addrs, unsigned count)
+{
+    unsigned i;
+
+    state->nr_addrs = 0;
+    for (i = 0; i < count && state->nr_addrs < VAK_MAX_ADDRS; i++) {
+        if (addrs[i].family)
+            state->addrs[state->nr_addrs++] = addrs[i];
     }
+}
 
-    printf("%s:%u: send variant %u size %u\n", server->host, server->port, server->variant, length);
-    fflush(stdout);
+/* Add a round trip time sample for a server */
+static void vak_update_rtt(struct vak_server_state *state, vak_time_t rtt)
+{
+    if (rtt < 0)
+        rtt = 0;
+
+    if (!state->stats.srtt) {
+        state->stats.srtt = rtt;
+        state->rttvar = rtt / 2;
+    } else {
+        vak_time_t err = state->stats.srtt > rtt ? state->stats.srtt - rtt : rtt - state->stats.srtt;
+
+        state->rttvar = (3 * state->rttvar + err) / 4;
+        state->stats.srtt = (7 * state->stats.srtt + rtt) / 8;
+    }
+
+    state->backoff = 0;
+}
+
+/* How long to wait for a response from a server */
+static vak_time_t vak_server_timeout(const struct vak_server_state *state)
+{
+    vak_time_t timeout;
+    unsigned i;
+
+    if (!state->stats.srtt)
+        return QUERY_TIMEOUT_USECS;
+
+    timeout = state->stats.srtt + 4 * state->rttvar;
+    for (i = 0; i < state->backoff && timeout < (vak_time_t)QUERY_TIMEOUT_USECS; i++)
+        timeout *= 2;
+
+    if (timeout < (vak_time_t)QUERY_TIMEOUT_MIN_USECS)
+        timeout = QUERY_TIMEOUT_MIN_USECS;
+    if (timeout > (vak_time_t)QUERY_TIMEOUT_USECS)
+        timeout = QUERY_TIMEOUT_USECS;
+
+    return timeout;
+}
+
+/* When to start another query if there has been no response from a
+ * server, at about the 90th percentile of its round trip times */
+static vak_time_t vak_server_hedge(const struct vak_server_state *state)
+{
+    if (!state->stats.srtt)
+        return HEDGE_DEFAULT_USECS;
+
+    return state->stats.srtt + 2 * state->rttvar;
+}
+
+/* Nonzero if a delegation verified for one variant is good for the
+ * other, vrt_verify_dele signs with CONTEXT_CERT from draft 7 on */
+static int vak_same_cert_context(unsigned a, unsigned b)
+{
+    return (a >= 7) == (b >= 7);
+}
+
+/* The delegation cache to use for a response from a server, it is
+ * cleared if it was for another key or context */
+static uint8_t *vak_state_cert(struct vak_server_state *state,
+                               const struct vak_server *server)
+{
+    if (memcmp(state->cert_public_key, server->public_key, sizeof(state->cert_public_key)) ||
+        !vak_same_cert_context(state->cert_variant, server->variant)) {
+        memset(state->cert, 0, sizeof(state->cert));
+        memcpy(state->cert_public_key, server->public_key, sizeof(state->cert_public_key));
+        state->cert_variant = server->variant;
+    }
+
+    return state->cert;
+}
+
+/* Save the server states to the cache */
+static void vak_store_cache(struct vak_impl *impl)
+{
+    vak_time_t now = vak_get_time();
+    unsigned i;
+
+    for (i = 0; i < impl->nr_states; i++) {
+        struct vak_server_state *state = &impl->states[i];
+        struct vak_cache_entry *entry = state->cache_entry;
+
+        if (!entry)
+            continue;
+
+        entry->srtt = state->stats.srtt;
+        entry->rttvar = state->rttvar;
+        entry->radi = state->stats.radi;
+        entry->queries = state->stats.queries;
+        entry->failures = state->stats.failures;
+        while (entry->queries >= CACHE_MAX_QUERIES) {
+            entry->queries /= 2;
+            entry->failures /= 2;
+        }
+        /* The entry only holds delegations for its own key */
+        if (!memcmp(state->cert_public_key, entry->public_key, sizeof(entry->public_key))) {
+            memcpy(entry->cert, state->cert, sizeof(entry->cert));
+            entry->cert_variant = state->cert_variant;
+        }
+        entry->updated = now;
+    }
+}
+
+/* The sync has finished, 1 if we have good time, -1 if not */
+static void vak_set_result(struct vak_impl *impl, int result)
+{
+    impl->result = result;
+
+    if (impl->cache)
+        vak_store_cache(impl);
+}
+
+static void vak_free_query(struct vak_impl *impl, struct vak_query *query)
+{
+    unsigned a;
 
-    impl->send_time = vak_get_time();
+    for (a = 0; a < VAK_MAX_ADDRS; a++) {
+        if (query->channels[a] > 0) {
+            vak_udp_close_channel(impl->udp, query->channels[a]);
+            impl->channel_queries[query->channels[a]] = NULL;
+            query->channels[a] = 0;
+        }
+    }
+
+    query->state = VAK_QUERY_FREE;
+    impl->nr_queries--;
+}
+
+/* Remember a verified response relative to the monotonic clock so
+ * that it can be used again by later syncs */
+static void vak_save_sample(struct vak_impl *impl, struct vak_server_state *state,
+                            overlap_value_t lo, overlap_value_t hi)
+{
+    vak_time_t offset = impl->clock.realtime - impl->clock.monotonic;
+
+    state->sample_monotonic = impl->clock.monotonic;
+    state->sample_lo = offset + (vak_time_t)(lo * 1000000);
+    state->sample_hi = offset + (vak_time_t)(hi * 1000000);
+}
+
+/* Move and widen the last response from a server by how much the
+ * monotonic clock may have drifted since, and translate it back to
+ * the wall time.  Returns 1 if it is still narrow enough to use. */
+static int vak_age_sample(struct vak_impl *impl, const struct vak_server_state *state,
+                          overlap_value_t *plo, overlap_value_t *phi)
+{
+    vak_time_t offset = impl->clock.realtime - impl->clock.monotonic;
+    double elapsed;
+
+    if (!state->sample_monotonic || state->aged)
+        return 0;
+
+    elapsed = (double)(impl->clock.monotonic - state->sample_monotonic);
+    *plo = ((double)(state->sample_lo - offset) + impl->drift_lo * elapsed / 1000000) / 1000000;
+    *phi = ((double)(state->sample_hi - offset) + impl->drift_hi * elapsed / 1000000) / 1000000;
+
+    return *phi - *plo <= WANTED_UNCERTAINTY;
+}
+
+/* Start a sync with the narrowest old responses.  There is room left
+ * for MIN_FRESH_RESPONSES new ones to make up WANTED_OVERLAPS.  The
+ * servers they came from are not queried again in this sync, their
+ * response would otherwise be counted twice. */
+static void vak_add_aged(struct vak_impl *impl)
+{
+    unsigned i, j;
+
+    for (i = 0; i < impl->nr_states; i++)
+        impl->states[i].aged = 0;
+
+    while (impl->nr_aged + MIN_FRESH_RESPONSES < (unsigned)WANTED_OVERLAPS) {
+        struct vak_server_state *best = NULL;
+        overlap_value_t lo, hi, best_lo = 0, best_hi = 0;
+
+        for (i = 0; i < impl->nr_states; i++) {
+            if (vak_age_sample(impl, &impl->states[i], &lo, &hi) &&
+                (!best || hi - lo < best_hi - best_lo)) {
+                best = &impl->states[i];
+                best_lo = lo;
+                best_hi = hi;
+            }
+        }
+        if (!best || !overlap_add(impl->algo, best_lo, best_hi))
+            return;
+
+        printf("%s:%u: aged adj %.6f .. %.6f\n", best->server->host, best->server->port, best_lo, best_hi);
+
+        best->aged = 1;
+        impl->nr_responses++;
+        impl->nr_aged++;
+
+        for (j = 0; j < impl->nr_servers; j++) {
+            if (impl->server_states[j] == best)
+                impl->used[j] = 1;
+        }
+    }
+}
+
+int vak_impl_restart(struct vak_impl *impl)
+{
+    unsigned q;
+
+    for (q = 0; q < VAK_MAX_QUERIES; q++) {
+        if (impl->queries[q].state != VAK_QUERY_FREE)
+            vak_free_query(impl, &impl->queries[q]);
+    }
 
-    if (vak_udp_send(impl->udp, server->host, server->port, impl->buffer, length) < 0) {
-        fprintf(stderr, "vrt_udp_send failed\n");
+    overlap_del(impl->algo);
+    impl->algo = overlap_new();
+    if (!impl->algo) {
+        fprintf(stderr, "overlap_new failed\n");
         return -1;
     }
 
+    memset(impl->used, 0, impl->nr_servers * sizeof(*impl->used));
+    impl->nr_responses = 0;
+    impl->nr_aged = 0;
+    impl->nr_hedges = 0;
+    impl->result = 0;
+
+    vak_free_kept(impl);
+
+    /* The caller has probably adjusted the clock since the last sync */
+    vak_get_clock_sample(&impl->clock);
+
+    /* Old responses are not for a fixed nonce */
+    if (!impl->fixed_nonce)
+        vak_add_aged(impl);
+
     return 0;
 }
 
-/* returns -1 on error (i.e. timeout), 1 if a good response was received, 0 if we need to try again */
-static int vak_process_response(struct vak_impl *impl, const struct vak_server *server,
-                                overlap_value_t *plo, overlap_value_t *phi)
+/* Check if the wall clock has been stepped since it was last checked.
+ * The responses so far are adjustments relative to the old wall time
+ * and round trip times of queries in flight are measured across the
+ * step, so throw them all away and start over.  Returns 1 if the
+ * clock was stepped. */
+static int vak_check_clock(struct vak_impl *impl)
 {
-    vak_time_t recv_time;
+    struct vak_clock_sample sample;
+    vak_time_t elapsed, step, allowed;
+    unsigned i;
 
-    int n;
+    vak_get_clock_sample(&sample);
 
-    n = vak_udp_recv(impl->udp, impl->buffer, impl->buffer_size);
+    elapsed = sample.monotonic - impl->clock.monotonic;
+    step = (sample.realtime - sample.monotonic) - (impl->clock.realtime - impl->clock.monotonic);
+    allowed = CLOCK_STEP_MIN_USECS + elapsed * CLOCK_STEP_PPM / 1000000;
 
-    recv_time = vak_get_time();
+    impl->clock = sample;
 
-    if (n <= 0) {
-        if (recv_time - impl->send_time > QUERY_TIMEOUT_USECS) {
-            printf("timeout\n");
-            return -1;
+    if (step >= -allowed && step <= allowed)
+        return 0;
+
+    printf("wall clock stepped %lld us, starting over\n", (long long)step);
+    fflush(stdout);
+
+    /* The times addresses expire are in wall time too */
+    for (i = 0; i < impl->nr_states; i++)
+        impl->states[i].addr_expires += step;
+    if (impl->resolve_deadline != VAK_TIME_MAX)
+        impl->resolve_deadline += step;
+
+    if (vak_impl_restart(impl) < 0)
+        vak_set_result(impl, -1);
+
+    return 1;
+}
+
+/* Queue up queries to new servers until enough are in flight */
+static void vak_start_queries(struct vak_impl *impl)
+{
+    unsigned i, wanted = WANTED_QUERIES;
+
+    /* Late queries are left running but do not count */
+    for (i = 0; i < VAK_MAX_QUERIES; i++) {
+        if (impl->queries[i].state == VAK_QUERY_SENT && impl->queries[i].late)
+            wanted++;
+    }
+
+    while (!impl->result && impl->nr_queries < wanted) {
+        int s;
+
+        for (i = 0; i < VAK_MAX_QUERIES; i++) {
+            if (impl->queries[i].state == VAK_QUERY_FREE)
+                break;
         }
-    } else {
-        uint64_t server_midp;
-        uint32_t server_radi;
+        if (i == VAK_MAX_QUERIES)
+            return;
+
+        s = vak_select_server(impl->servers, impl->server_stats, impl->used,
+                              impl->nr_servers, WANTED_UNCERTAINTY);
+        if (s < 0) {
+            if (!impl->nr_queries) {
+                fprintf(stderr, "no more servers\n");
+                vak_set_result(impl, -1);
+            }
+            return;
+        }
+
+        impl->used[s] = 1;
+        impl->queries[i].state = VAK_QUERY_PENDING;
+        impl->queries[i].server = impl->servers[s];
+        impl->queries[i].server_state = impl->server_states[s];
+        impl->nr_queries++;
+    }
+}
+
+int vak_impl_get_send(struct vak_impl *impl, vak_time_t now, struct vak_impl_send *send)
+{
+    while (1) {
+        struct vak_query *query;
+        const struct vak_server *server;
+        unsigned q, a;
+        int i;
+
+        vak_start_queries(impl);
+
+        /* Look for a new query or one which has not been handed out
+         * for all addresses yet */
+        for (q = 0; q < VAK_MAX_QUERIES; q++) {
+            query = &impl->queries[q];
+            if (query->state == VAK_QUERY_PENDING ||
+                (query->state == VAK_QUERY_SENT && query->next_addr < query->nr_addrs))
+                break;
+        }
+        if (q == VAK_MAX_QUERIES)
+            return 0;
+
+        server = query->server;
+
+        i = vak_get_query(impl, server->variant);
+        if (i < 0) {
+            vak_free_query(impl, query);
+            continue;
+        }
+
+        if (query->state == VAK_QUERY_PENDING) {
+            /* Create a random nonce.  This should be as good
+             * randomness as possible, preferably cryptographically
+             * secure randomness.  Only as many bytes as the variant
+             * uses are needed. */
+            if (impl->fixed_nonce) {
+                memcpy(query->nonce, impl->nonce, sizeof(query->nonce));
+            } else if (vak_get_nonce(query->nonce, impl->query_nonce_len[i]) < 0) {
+                fprintf(stderr, "vak_get_nonce(%u) failed: %s\n", impl->query_nonce_len[i], strerror(errno));
+                vak_free_query(impl, query);
+                continue;
+            }
+
+            /* Use the addresses known right now for the whole query */
+            memcpy(query->addrs, query->server_state->addrs, sizeof(query->addrs));
+            query->nr_addrs = query->server_state->nr_addrs;
+            query->next_addr = 0;
+            query->failed = 0;
+
+            query->state = VAK_QUERY_SENT;
+            query->deadline = now + vak_server_timeout(query->server_state);
+            query->hedge_time = now + vak_server_hedge(query->server_state);
+            query->late = 0;
+            query->server_state->stats.queries++;
+        }
+
+        /* Fill in the query, only the nonce differs from the
+         * template.  Do it every time since the template is shared
+         * with the other queries. */
+        memcpy(impl->query[i] + impl->query_nonce_offset[i], query->nonce, impl->query_nonce_len[i]);
+
+        a = query->next_addr++;
+        query->send_times[a] = now;
 
-        printf("%s:%u: recv variant %u size %u\n", server->host, server->port, server->variant, n);
+        printf("%s:%u: send variant %u size %u\n", server->host, server->port, server->variant, impl->query_len[i]);
         fflush(stdout);
 
-        /* TODO We might want to verify that servaddr and respaddr
-         * match before parsing the response.  This way we could
-         * discard faked packets without having to verify the
-         * signature.  */
+        send->server = server;
+        send->addr = a < query->nr_addrs ? &query->addrs[a] : NULL;
+        send->buffer = impl->query[i];
+        send->length = impl->query_len[i];
+        send->query = q * VAK_MAX_ADDRS + a;
+
+        return 1;
+    }
+}
+
+void vak_impl_sent(struct vak_impl *impl, unsigned query, vak_time_t send_time)
+{
+    unsigned q = query / VAK_MAX_ADDRS;
+
+    if (q < VAK_MAX_QUERIES && impl->queries[q].state == VAK_QUERY_SENT)
+        impl->queries[q].send_times[query % VAK_MAX_ADDRS] = send_time;
+}
+
+void vak_impl_set_addr(struct vak_impl *impl, const struct vak_server *server,
+                       const struct vak_addr *addrs, unsigned count, vak_time_t now)
+{
+    struct vak_server_state *state = vak_find_state(impl, server, 0);
+
+    if (state) {
+        vak_set_addrs(state, addrs, count);
+        state->addr_expires = now + RESOLVE_TTL_USECS;
+    }
+}
 
-        /* Verify the response, check the signature and that it
-         * matches the nonce we put in the query. */
-        if (vrt_parse_response(impl->nonce, VRT_NONCE_SIZE, (void *)impl->buffer,
-                                n, server->public_key,
-                                &server_midp, &server_radi,
-                                server->variant) == VRT_SUCCESS) {
-            printf("midp %llu, radi %llu\n",
-                   (unsigned long long)server_midp, (unsigned long long)server_radi);
-            fflush(stdout);
+void vak_impl_send_failed(struct vak_impl *impl, unsigned query)
+{
+    unsigned q = query / VAK_MAX_ADDRS;
+    struct vak_query *p;
+    unsigned a;
+
+    if (q >= VAK_MAX_QUERIES || impl->queries[q].state != VAK_QUERY_SENT)
+        return;
 
-            /* Translate roughtime response to lo..hi adjustment range.  */
-            vak_time_t local_midp = (impl->send_time + recv_time) / 2;
-            double local_rtt = (double)(recv_time - impl->send_time) / 1000000;
-            double adjustment = ((double)server_midp - (double)local_midp) / 1000000;
-            double uncertainty = (double)server_radi / 1000000 + local_rtt / 2;
+    p = &impl->queries[q];
+    p->failed |= 1u << (query % VAK_MAX_ADDRS);
 
-            printf("adjustment %.3f, uncertainty %.3f, rtt %lld\n",
-                   adjustment, uncertainty, (long long)local_rtt);
+    /* Give up when the query could not be sent to any address */
+    for (a = 0; a < p->nr_addrs; a++) {
+        if (!(p->failed & (1u << a)))
+            return;
+    }
 
-            *plo = adjustment - uncertainty;
-            *phi = adjustment + uncertainty;
+    fprintf(stderr, "%s:%u: send failed\n", p->server->host, p->server->port);
+    p->server_state->stats.failures++;
+    vak_free_query(impl, p);
+}
 
-            printf("adj %.6f .. %.6f\n", *plo, *phi);
+/* Find the time the query was sent to the address a response came
+ * from.  Returns VAK_TIME_MAX if the query was not sent to the
+ * address.  If the caller does not know the address, use the
+ * earliest send time, which can only make the uncertainty larger. */
+static vak_time_t vak_query_send_time(const struct vak_query *query, const struct vak_addr *addr)
+{
+    vak_time_t send_time = VAK_TIME_MAX;
+    unsigned a;
 
-            return 1;
+    for (a = 0; a < query->next_addr && a < query->nr_addrs; a++) {
+        if (query->failed & (1u << a))
+            continue;
+        if (addr) {
+            if (vak_same_addr(&query->addrs[a], addr))
+                return query->send_times[a];
+        } else if (query->send_times[a] < send_time) {
+            send_time = query->send_times[a];
         }
     }
 
-    return 0;
+    return send_time;
 }
 
-/* returns 1 if we have good time, 0 if we have not gotten time 1, -1 if we have no more servers to try */
-int vak_impl_process(struct vak_impl *impl, overlap_value_t *plo, overlap_value_t *phi)
+/* returns 1 if the response was good, 0 if it should be ignored */
+static int vak_verify_response(struct vak_impl *impl, struct vak_query *query,
+                               const void *buffer, unsigned length,
+                               const struct vak_addr *addr,
+                               vak_time_t recv_time,
+                               overlap_value_t *plo, overlap_value_t *phi)
+{
+    const struct vak_server *server = query->server;
+    vak_time_t send_time;
+    uint64_t server_midp;
+    uint32_t server_radi;
+    vrt_ret_t ret;
+
+    /* Throw away packets that do not come from an address the query
+     * was sent to, and use the round trip time of the one that did */
+    send_time = vak_query_send_time(query, addr);
+    if (send_time == VAK_TIME_MAX)
+        return 0;
+
+    /* Throw away packets that are not for our nonce before spending
+     * any time on checking signatures */
+    if (vrt_precheck_response(query->nonce, VRT_NONCE_SIZE, (uint32_t *)buffer,
+                              length, server->variant) != VRT_SUCCESS)
+        return 0;
+
+    printf("%s:%u: recv variant %u size %u\n", server->host, server->port, server->variant, length);
+    fflush(stdout);
+
+    /* Verify the response, check the signature and that it
+     * matches the nonce we put in the query. */
+    ret = vrt_parse_response_cached(query->nonce, VRT_NONCE_SIZE, (uint32_t *)buffer,
+                                    length, server->public_key,
+                                    &server_midp, &server_radi,
+                                    server->variant,
+                                    vak_state_cert(query->server_state, server));
+
+    if (impl->archive)
+        impl->archive_add(impl->archive, server, send_time, recv_time, ret, buffer, length);
+
+    if (ret != VRT_SUCCESS)
+        return 0;
+
+    printf("midp %llu, radi %llu\n",
+           (unsigned long long)server_midp, (unsigned long long)server_radi);
+    fflush(stdout);
+
+    vak_update_rtt(query->server_state, recv_time - send_time);
+    query->server_state->stats.radi = server_radi;
+
+    /* Translate roughtime response to lo..hi adjustment range.  */
+    vak_time_t local_midp = (send_time + recv_time) / 2;
+    double local_rtt = (double)(recv_time - send_time) / 1000000;
+    double adjustment = ((double)server_midp - (double)local_midp) / 1000000;
+    double uncertainty = (double)server_radi / 1000000 + local_rtt / 2;
+
+    printf("adjustment %.3f, uncertainty %.3f, rtt %lld\n",
+           adjustment, uncertainty, (long long)local_rtt);
+
+    *plo = adjustment - uncertainty;
+    *phi = adjustment + uncertainty;
+
+    printf("adj %.6f .. %.6f\n", *plo, *phi);
+
+    return 1;
+}
+
+static void vak_add_response(struct vak_impl *impl, overlap_value_t lo, overlap_value_t hi)
+{
+    int nr_overlaps;
+
+    impl->nr_responses++;
+
+    overlap_add(impl->algo, lo, hi);
+    nr_overlaps = overlap_find(impl->algo, &lo, &hi);
+
+    printf("responses %u, overlaps %u, %.3f .. %.3f\n",
+           impl->nr_responses, nr_overlaps, lo, hi);
+
+    if (nr_overlaps > impl->nr_responses / 2 &&
+        nr_overlaps >= WANTED_OVERLAPS &&
+        impl->nr_responses - impl->nr_aged >= MIN_FRESH_RESPONSES &&
+        (hi - lo) <= WANTED_UNCERTAINTY) {
+
+        impl->lo = lo;
+        impl->hi = hi;
+        vak_set_result(impl, 1);
+    }
+}
+
+/* Keep a copy of a verified response to the fixed nonce */
+static void vak_keep_response(struct vak_impl *impl, const struct vak_server *server,
+                              const void *buffer, unsigned length)
+{
+    struct vak_kept_response *kept;
+    void *copy;
+
+    kept = realloc(impl->kept, (impl->nr_kept + 1) * sizeof(*kept));
+    if (!kept) {
+        fprintf(stderr, "realloc kept failed\n");
+        return;
+    }
+    impl->kept = kept;
+
+    copy = malloc(length);
+    if (!copy) {
+        fprintf(stderr, "malloc response failed\n");
+        return;
+    }
+    memcpy(copy, buffer, length);
+
+    kept = &impl->kept[impl->nr_kept++];
+    kept->server = server;
+    kept->buffer = copy;
+    kept->length = length;
+}
+
+/* returns 1 if the datagram was a good response to the query */
+static int vak_input_query(struct vak_impl *impl, struct vak_query *query,
+                           const void *buffer, unsigned length,
+                           const struct vak_addr *addr, vak_time_t recv_time)
+{
+    overlap_value_t lo, hi;
+
+    if (query->state != VAK_QUERY_SENT)
+        return 0;
+
+    if (!vak_verify_response(impl, query, buffer, length, addr, recv_time, &lo, &hi))
+        return 0;
+
+    if (impl->fixed_nonce)
+        vak_keep_response(impl, query->server, buffer, length);
+
+    vak_save_sample(impl, query->server_state, lo, hi);
+    vak_free_query(impl, query);
+    vak_add_response(impl, lo, hi);
+
+    /* next server */
+    vak_start_queries(impl);
+
+    return 1;
+}
+
+int vak_impl_input(struct vak_impl *impl, const void *buffer, unsigned length,
+                   const struct vak_addr *addr, vak_time_t recv_time)
 {
-    /* if we have a query in flight, poll for a response */
-    if (impl->nr_queries) {
-        overlap_value_t lo, hi;
+    unsigned q;
 
-        struct vak_server const *server = impl->servers[impl->current_server];
-        int r;
+    if (impl->result)
+        return impl->result > 0;
 
-        r = vak_process_response(impl, server, &lo, &hi);
-        if (r) {
-            if (r > 0) {
-                int nr_overlaps;
+    /* Cheap compared to checking a signature */
+    if (vak_check_clock(impl))
+        return 0;
 
-                impl->nr_responses++;
+    for (q = 0; q < VAK_MAX_QUERIES; q++) {
+        if (vak_input_query(impl, &impl->queries[q], buffer, length, addr, recv_time))
+            break;
+    }
+
+    return impl->result > 0;
+}
+
+void vak_impl_set_cache(struct vak_impl *impl, struct vak_cache *cache)
+{
+    unsigned i;
+
+    impl->cache = cache;
+
+    for (i = 0; i < impl->nr_states; i++) {
+        struct vak_server_state *state = &impl->states[i];
+        struct vak_cache_entry *entry = vak_cache_find(cache, state->server, 1);
+
+        state->cache_entry = entry;
+        if (!entry || !entry->updated)
+            continue;
+
+        state->stats.srtt = entry->srtt;
+        state->rttvar = entry->rttvar;
+        state->stats.radi = entry->radi;
+        state->stats.queries = entry->queries;
+        state->stats.failures = entry->failures;
+
+        /* Anything in the file could have been put there by someone
+         * else, a delegation is only trusted if it is signed by the
+         * server, and for the variant it was saved for */
+        if (vrt_verify_cert_cache(entry->cert, entry->public_key,
+                                  entry->cert_variant) == VRT_SUCCESS) {
+            memcpy(state->cert, entry->cert, sizeof(state->cert));
+            memcpy(state->cert_public_key, entry->public_key, sizeof(state->cert_public_key));
+            state->cert_variant = entry->cert_variant;
+        }
+    }
+}
+
+void vak_impl_set_archive(struct vak_impl *impl, struct vak_archive *archive)
+{
+    impl->archive = archive;
+    impl->archive_add = vak_archive_add;
+}
+
+void vak_impl_set_connected(struct vak_impl *impl, int enable)
+{
+    impl->connected = enable;
+}
+
+void vak_impl_set_drift(struct vak_impl *impl, double lo_ppm, double hi_ppm)
+{
+    impl->drift_lo = lo_ppm;
+    impl->drift_hi = hi_ppm;
+}
+
+void vak_impl_set_nonce(struct vak_impl *impl, const uint8_t *nonce)
+{
+    impl->fixed_nonce = nonce != NULL;
+    if (nonce)
+        memcpy(impl->nonce, nonce, sizeof(impl->nonce));
+}
+
+int vak_impl_get_response(struct vak_impl *impl, unsigned index,
+                          const struct vak_server **server,
+                          const void **buffer, unsigned *length)
+{
+    if (index >= impl->nr_kept)
+        return 0;
+
+    *server = impl->kept[index].server;
+    *buffer = impl->kept[index].buffer;
+    *length = impl->kept[index].length;
+
+    return 1;
+}
+
+void vak_impl_timer(struct vak_impl *impl, vak_time_t now)
+{
+    unsigned q;
+
+    /* If the clock was stepped all queries are gone and new ones
+     * are started below */
+    if (!impl->result)
+        vak_check_clock(impl);
+
+    for (q = 0; q < VAK_MAX_QUERIES; q++) {
+        struct vak_query *query = &impl->queries[q];
+
+        if (query->state == VAK_QUERY_SENT && now >= query->deadline) {
+            printf("timeout\n");
+            query->server_state->backoff++;
+            query->server_state->stats.failures++;
+            vak_free_query(impl, query);
+        } else if (query->state == VAK_QUERY_SENT && !query->late &&
+                   impl->nr_hedges < MAX_HEDGES && now >= query->hedge_time) {
+            /* Start the next query without giving up on this one */
+            printf("%s:%u: late\n", query->server->host, query->server->port);
+            query->late = 1;
+            impl->nr_hedges++;
+        }
+    }
+
+    /* next server */
+    vak_start_queries(impl);
+}
+
+vak_time_t vak_impl_deadline(struct vak_impl *impl)
+{
+    vak_time_t deadline = VAK_TIME_MAX;
+    unsigned q;
+
+    if (impl->result)
+        return VAK_TIME_MAX;
+
+    for (q = 0; q < VAK_MAX_QUERIES; q++) {
+        struct vak_query *query = &impl->queries[q];
+
+        if (query->state == VAK_QUERY_PENDING ||
+            (query->state == VAK_QUERY_SENT && query->next_addr < query->nr_addrs))
+            return 0;
+        if (query->state != VAK_QUERY_SENT)
+            continue;
+        if (query->deadline < deadline)
+            deadline = query->deadline;
+        if (!query->late && impl->nr_hedges < MAX_HEDGES && query->hedge_time < deadline)
+            deadline = query->hedge_time;
+    }
+
+    return deadline;
+}
+
+int vak_impl_result(struct vak_impl *impl, overlap_value_t *plo, overlap_value_t *phi)
+{
+    if (impl->result > 0) {
+        *plo = impl->lo;
+        *phi = impl->hi;
+    }
+
+    return impl->result;
+}
+
+vak_time_t vak_impl_timeout(struct vak_impl *impl)
+{
+    vak_time_t deadline = vak_impl_deadline(impl);
+    vak_time_t now;
+
+    if (deadline == VAK_TIME_MAX)
+        return QUERY_TIMEOUT_USECS;
+
+    now = vak_get_time();
+    if (deadline <= now)
+        return 0;
 
-                overlap_add(impl->algo, lo, hi);
-                nr_overlaps = overlap_find(impl->algo, &lo, &hi);
+    return deadline - now;
+}
 
-                printf("responses %u, overlaps %u, %.3f .. %.3f\n",
-                       impl->nr_responses, nr_overlaps, lo, hi);
+/* Look up the addresses of all servers which do not have an address
+ * or where the address has expired */
+static void vak_resolve_servers(struct vak_impl *impl, vak_time_t now)
+{
+    const char **hosts;
+    unsigned *ports;
+    struct vak_addr *addrs;
+    struct vak_server_state **states;
+    unsigned i, n = 0;
 
-                if (nr_overlaps > impl->nr_responses / 2 &&
-                    nr_overlaps >= WANTED_OVERLAPS &&
-                    (hi - lo) <= WANTED_UNCERTAINTY) {
+    if (now < impl->resolve_deadline)
+        return;
 
-                    *plo = lo;
-                    *phi = hi;
+    hosts = malloc(impl->nr_states * sizeof(*hosts));
+    ports = malloc(impl->nr_states * sizeof(*ports));
+    addrs = calloc(impl->nr_states * VAK_MAX_ADDRS, sizeof(*addrs));
+    states = malloc(impl->nr_states * sizeof(*states));
 
-                    return 1;
-                }
+    if (hosts && ports && addrs && states) {
+        for (i = 0; i < impl->nr_states; i++) {
+            if (now >= impl->states[i].addr_expires) {
+                hosts[n] = impl->states[i].server->host;
+                ports[n] = impl->states[i].server->port;
+                states[n] = &impl->states[i];
+                n++;
             }
+        }
 
-            /* next server */
-            impl->nr_queries--;
-            impl->current_server++;
+        if (n && vak_udp_resolve_many(hosts, ports, addrs, n) < 0) {
+            /* The addresses may not have been written, keep the old
+             * ones and try again later */
+            fprintf(stderr, "vak_udp_resolve_many failed\n");
+            for (i = 0; i < n; i++)
+                states[i]->addr_expires = now + RESOLVE_RETRY_USECS;
+        } else {
+            for (i = 0; i < n; i++) {
+                vak_set_addrs(states[i], &addrs[i * VAK_MAX_ADDRS], VAK_MAX_ADDRS);
+                states[i]->addr_expires = now + (states[i]->nr_addrs ? RESOLVE_TTL_USECS : RESOLVE_RETRY_USECS);
+            }
         }
     }
 
-    /* if we have no query in flight, send out a new one */
-    while (!impl->nr_queries) {
-        struct vak_server const *server = impl->servers[impl->current_server];
+    free(hosts);
+    free(ports);
+    free(addrs);
+    free(states);
 
-        if (!server) {
-            fprintf(stderr, "no more servers\n");
-            return -1;
+    impl->resolve_deadline = VAK_TIME_MAX;
+    for (i = 0; i < impl->nr_states; i++) {
+        if (impl->states[i].addr_expires < impl->resolve_deadline)
+            impl->resolve_deadline = impl->states[i].addr_expires;
+    }
+}
+
+/* Use the time the queries actually left the host if the platform
+ * knows it. */
+static void vak_update_send_times(struct vak_impl *impl)
+{
+    unsigned q;
+
+    for (q = 0; q < VAK_MAX_QUERIES; q++) {
+        struct vak_query *query = &impl->queries[q];
+        vak_time_t send_time;
+        unsigned a;
+
+        if (query->state != VAK_QUERY_SENT)
+            continue;
+
+        for (a = 0; a < query->next_addr && a < query->nr_addrs; a++) {
+            if (!(query->failed & (1u << a)) &&
+                vak_udp_tx_time(impl->udp, query->udp_ids[a], &send_time))
+                vak_impl_sent(impl, q * VAK_MAX_ADDRS + a, send_time);
+        }
+    }
+}
+
+/* returns 1 if we have good time, 0 if we have not gotten time 1, -1 if we have no more servers to try */
+int vak_impl_process(struct vak_impl *impl, overlap_value_t *plo, overlap_value_t *phi)
+{
+    struct vak_impl_send send;
+    int i, n;
+
+    /* Receive everything that has arrived and process it in one go */
+    n = vak_udp_recv_batch(impl->udp, impl->msgs, VAK_RECV_BATCH);
+    if (n > 0 && !impl->result && vak_check_clock(impl))
+        n = 0;
+    if (n > 0)
+        vak_update_send_times(impl);
+
+    for (i = 0; i < n && !impl->result; i++) {
+        struct vak_udp_msg *msg = &impl->msgs[i];
+
+        if (!msg->channel) {
+            vak_impl_input(impl, msg->buffer, msg->length, &msg->addr, msg->time);
+        } else if (msg->channel <= VAK_MAX_CHANNELS && impl->channel_queries[msg->channel]) {
+            /* The channel tells which query the response is for */
+            vak_input_query(impl, impl->channel_queries[msg->channel],
+                            msg->buffer, msg->length, &msg->addr, msg->time);
+        }
+    }
+
+    vak_impl_timer(impl, vak_get_time());
+
+    /* Look up addresses before sending so that the time it takes is
+     * not counted as part of the round trip time. */
+    vak_resolve_servers(impl, vak_get_time());
+
+    /* Send out new queries */
+    while (vak_impl_get_send(impl, vak_get_time(), &send)) {
+        struct vak_query *query = &impl->queries[send.query / VAK_MAX_ADDRS];
+        unsigned a = send.query % VAK_MAX_ADDRS;
+        struct vak_udp_msg msg;
+        int channel = -1;
+
+        if (!send.addr) {
+            fprintf(stderr, "%s:%u: no address\n", send.server->host, send.server->port);
+            vak_impl_send_failed(impl, send.query);
+            continue;
         }
 
-        if (vak_send_query(impl, server) < 0) {
-            impl->current_server++;
+        /* Fall back to the shared socket if there is no channel */
+        if (impl->connected)
+            channel = vak_udp_open_channel(impl->udp, send.addr);
+
+        msg.addr = *send.addr;
+        msg.buffer = (void *)send.buffer;
+        msg.length = send.length;
+        msg.channel = channel > 0 ? channel : 0;
+
+        if (vak_udp_send_batch(impl->udp, &msg, 1) != 1) {
+            fprintf(stderr, "vrt_udp_send failed\n");
+            if (channel > 0)
+                vak_udp_close_channel(impl->udp, channel);
+            vak_impl_send_failed(impl, send.query);
             continue;
         }
 
-        impl->nr_queries++;
+        if (channel > 0) {
+            query->channels[a] = channel;
+            impl->channel_queries[channel] = query;
+        }
+
+        vak_impl_sent(impl, send.query, msg.time);
+        query->udp_ids[a] = msg.id;
     }
 
-    return 0;
+    return vak_impl_result(impl, plo, phi);
 }
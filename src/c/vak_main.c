@@ -8,11 +8,79 @@
 
 #include "overlap_algo.h"
 
+/* Defaults for vak_now_bounds, the range of frequency errors of the
+ * monotonic clock in ppm and the widest bounds in seconds */
+#define VAK_NOW_DEFAULT_DRIFT 100.0
+#define VAK_NOW_DEFAULT_MAX_WIDTH 2.0
+
+/* The last verified sync as a range of offsets in microseconds
+ * between the real time and the monotonic clock, and the monotonic
+ * time it was valid at, 0 if there has not been one */
+static vak_time_t now_anchor;
+static vak_time_t now_lo, now_hi;
+
+static double now_drift_lo = -VAK_NOW_DEFAULT_DRIFT;
+static double now_drift_hi = VAK_NOW_DEFAULT_DRIFT;
+static double now_max_width = VAK_NOW_DEFAULT_MAX_WIDTH;
+
+void vak_now_set(const struct vak_clock_sample *clock, overlap_value_t lo, overlap_value_t hi)
+{
+    vak_time_t offset = clock->realtime - clock->monotonic;
+
+    now_lo = offset + (vak_time_t)(lo * 1000000);
+    now_hi = offset + (vak_time_t)(hi * 1000000);
+    now_anchor = clock->monotonic;
+}
+
+void vak_now_set_drift(double lo_ppm, double hi_ppm)
+{
+    now_drift_lo = lo_ppm;
+    now_drift_hi = hi_ppm;
+}
+
+void vak_now_set_max_width(double max_width)
+{
+    now_max_width = max_width;
+}
+
+/* Extrapolate the last sync to now, 0 if there is none or if the
+ * bounds have become too wide */
+static int vak_now_extrapolate(vak_time_t *earliest, vak_time_t *latest)
+{
+    vak_time_t now, elapsed;
+
+    if (!now_anchor)
+        return 0;
+
+    now = vak_get_monotonic();
+    elapsed = now - now_anchor;
+
+    *earliest = now + now_lo + (vak_time_t)(now_drift_lo * elapsed / 1000000);
+    *latest = now + now_hi + (vak_time_t)(now_drift_hi * elapsed / 1000000);
+
+    return *latest - *earliest <= now_max_width * 1000000;
+}
+
+int vak_now_bounds(vak_time_t *earliest, vak_time_t *latest)
+{
+    overlap_value_t lo, hi;
+
+    if (vak_now_extrapolate(earliest, latest))
+        return 1;
+
+    /* vak_main anchors the new result for us */
+    if (vak_main(&lo, &hi) <= 0)
+        return 0;
+
+    return vak_now_extrapolate(earliest, latest);
+}
+
 int vak_main(overlap_value_t *plo, overlap_value_t *phi)
 {
     struct vak_server const **servers = NULL;
     struct vak_udp *udp = NULL;
     struct vak_impl *impl = NULL;
+    struct vak_cache *cache = NULL;
     int r = -1;
 
     if (vak_seed_random() < 0) {
@@ -33,20 +101,47 @@ int vak_main(overlap_value_t *plo, overlap_value_t *phi)
     }
 
     impl = vak_impl_new(servers, 10, udp);
-    if (!udp) {
+    if (!impl) {
         fprintf(stderr, "vak_impl_new failed\n");
         goto out;
     }
 
+    /* Let the platform drop datagrams from unexpected sources */
+    vak_impl_set_connected(impl, 1);
+
+#ifdef VAK_CACHE_FILE
+    /* Start with what we learned about the servers last time.  Run
+     * without the cache if it can not be opened. */
+    cache = vak_cache_open(VAK_CACHE_FILE);
+    if (cache)
+        vak_impl_set_cache(impl, cache);
+#endif
+
     while (1) {
         r = vak_impl_process(impl, plo, phi);
         if (r)
             break;
+
+        /* Sleep until a response arrives or the query times out */
+        if (vak_udp_wait(udp, vak_impl_timeout(impl)) < 0) {
+            fprintf(stderr, "vak_udp_wait failed\n");
+            r = -1;
+            break;
+        }
+    }
+
+    if (r > 0) {
+        struct vak_clock_sample clock;
+
+        vak_get_clock_sample(&clock);
+        vak_now_set(&clock, *plo, *phi);
     }
 
 out:
     if (impl)
         vak_impl_del(impl);
+    if (cache)
+        vak_cache_close(cache);
     if (udp)
         vak_udp_del(udp);
     if (servers)
@@ -2,6 +2,11 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "tweetnacl.h"
 
 int vak_seed_random(void)
 {
@@ -12,3 +17,123 @@ int vak_seed_random(void)
     srandom(seed);
     return 0;
 }
+
+/* Size of the key used by the nonce generator */
+#define VAK_RNG_KEY_SIZE crypto_stream_salsa20_KEYBYTES
+
+/* Number of random bytes generated each time the pool is refilled */
+#define VAK_RNG_POOL_SIZE 1024
+
+/* Mix in fresh entropy from the system after this many refills */
+#define VAK_RNG_RESEED_REFILLS 64
+
+/* State for the nonce generator.
+ *
+ * This is a "fast key erasure" generator as described by D. J.
+ * Bernstein.  Each refill runs the salsa20 stream cipher with the
+ * current key to produce a new key followed by a pool of random
+ * bytes.  The old key is overwritten immediately and bytes are wiped
+ * from the pool as soon as they have been handed out, so a later
+ * compromise of the state does not reveal nonces that have already
+ * been used.
+ */
+static struct {
+    uint8_t key[VAK_RNG_KEY_SIZE];
+    uint8_t pool[VAK_RNG_POOL_SIZE];
+    unsigned avail;
+    unsigned refills;
+    int seeded;
+} vak_rng;
+
+static pthread_once_t vak_rng_once = PTHREAD_ONCE_INIT;
+
+/* The ESP32 examples build this file too.  ESP-IDF has pthread_once
+ * but not pthread_atfork, and there is no fork on the ESP32 anyway. */
+#ifndef ESP_PLATFORM
+/* A child process must not hand out the same nonces as its parent,
+ * forget everything and start over with fresh entropy. */
+static void vak_rng_atfork_child(void)
+{
+    memset(&vak_rng, 0, sizeof(vak_rng));
+}
+#endif
+
+static void vak_rng_init(void)
+{
+#ifndef ESP_PLATFORM
+    pthread_atfork(NULL, NULL, vak_rng_atfork_child);
+#endif
+}
+
+static int vak_rng_reseed(void)
+{
+    uint8_t buf[VAK_RNG_KEY_SIZE * 2];
+    uint8_t hash[crypto_hash_BYTES];
+
+    /* Hash the old key with fresh entropy from the system to make
+     * the new key. */
+    memcpy(buf, vak_rng.key, VAK_RNG_KEY_SIZE);
+    if (getentropy(buf + VAK_RNG_KEY_SIZE, VAK_RNG_KEY_SIZE) < 0)
+        return -1;
+
+    crypto_hash(hash, buf, sizeof(buf));
+    memcpy(vak_rng.key, hash, VAK_RNG_KEY_SIZE);
+
+    memset(buf, 0, sizeof(buf));
+    memset(hash, 0, sizeof(hash));
+
+    vak_rng.refills = 0;
+    vak_rng.seeded = 1;
+
+    return 0;
+}
+
+static int vak_rng_refill(void)
+{
+    static const uint8_t zero_nonce[crypto_stream_salsa20_NONCEBYTES];
+    uint8_t buf[VAK_RNG_KEY_SIZE + VAK_RNG_POOL_SIZE];
+
+    if (!vak_rng.seeded || vak_rng.refills >= VAK_RNG_RESEED_REFILLS) {
+        if (vak_rng_reseed() < 0)
+            return -1;
+    }
+
+    /* Every key is only used once, so a fixed nonce is fine. */
+    crypto_stream_salsa20(buf, sizeof(buf), zero_nonce, vak_rng.key);
+
+    memcpy(vak_rng.key, buf, VAK_RNG_KEY_SIZE);
+    memcpy(vak_rng.pool, buf + VAK_RNG_KEY_SIZE, VAK_RNG_POOL_SIZE);
+    memset(buf, 0, sizeof(buf));
+
+    vak_rng.avail = VAK_RNG_POOL_SIZE;
+    vak_rng.refills++;
+
+    return 0;
+}
+
+int vak_get_nonce(void *nonce, unsigned size)
+{
+    uint8_t *ptr = nonce;
+
+    pthread_once(&vak_rng_once, vak_rng_init);
+
+    while (size) {
+        unsigned n;
+
+        if (!vak_rng.avail) {
+            if (vak_rng_refill() < 0)
+                return -1;
+        }
+
+        /* Hand out bytes from the end of the pool and wipe them */
+        n = size < vak_rng.avail ? size : vak_rng.avail;
+        vak_rng.avail -= n;
+        memcpy(ptr, vak_rng.pool + vak_rng.avail, n);
+        memset(vak_rng.pool + vak_rng.avail, 0, n);
+
+        ptr += n;
+        size -= n;
+    }
+
+    return 0;
+}
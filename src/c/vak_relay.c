@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "vak.h"
+#include "tweetnacl.h"
+
+/* A request is the magic and the nonce, padded with zeroes to the
+ * size of a reply so that the relay can not be used to amplify
+ * traffic.  A reply is the magic, the nonce, the midpoint and radius
+ * and a signature over all of that with a context string in front. */
+#define VAK_RELAY_REQUEST_MAGIC "VAKQ"
+#define VAK_RELAY_REPLY_MAGIC "VAKR"
+#define VAK_RELAY_MAGIC_SIZE 4
+
+#define VAK_RELAY_NONCE_OFFSET VAK_RELAY_MAGIC_SIZE
+#define VAK_RELAY_MIDP_OFFSET (VAK_RELAY_NONCE_OFFSET + VAK_RELAY_NONCE_SIZE)
+#define VAK_RELAY_RADI_OFFSET (VAK_RELAY_MIDP_OFFSET + 8)
+#define VAK_RELAY_SIGNED_SIZE (VAK_RELAY_RADI_OFFSET + 4)
+#define VAK_RELAY_SIG_OFFSET VAK_RELAY_SIGNED_SIZE
+#define VAK_RELAY_SIG_SIZE 64
+
+#if VAK_RELAY_SIG_OFFSET + VAK_RELAY_SIG_SIZE > VAK_RELAY_PACKET_SIZE
+#error "VAK_RELAY_PACKET_SIZE is too small"
+#endif
+
+/* Signatures by the relay key can not be mistaken for anything else */
+static const uint8_t VAK_RELAY_CONTEXT[] = "vak relay reply";
+#define VAK_RELAY_CONTEXT_SIZE sizeof(VAK_RELAY_CONTEXT)
+
+/* Numbers are little endian like in roughtime */
+static void vak_relay_put(uint8_t *p, uint64_t v, unsigned size)
+{
+    unsigned i;
+
+    for (i = 0; i < size; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t vak_relay_get(const uint8_t *p, unsigned size)
+{
+    uint64_t v = 0;
+    unsigned i;
+
+    for (i = 0; i < size; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+void vak_relay_keypair(uint8_t *public_key, uint8_t *secret_key, const uint8_t *seed)
+{
+    crypto_sign_seed_keypair(public_key, secret_key, seed);
+}
+
+int vak_relay_make_request(uint8_t *buffer, const uint8_t *nonce)
+{
+    memset(buffer, 0, VAK_RELAY_PACKET_SIZE);
+    memcpy(buffer, VAK_RELAY_REQUEST_MAGIC, VAK_RELAY_MAGIC_SIZE);
+    memcpy(buffer + VAK_RELAY_NONCE_OFFSET, nonce, VAK_RELAY_NONCE_SIZE);
+
+    return VAK_RELAY_PACKET_SIZE;
+}
+
+int vak_relay_make_reply(uint8_t *buffer, const uint8_t *request, unsigned request_len,
+                         vak_time_t midp, uint32_t radi, const uint8_t *secret_key)
+{
+    uint8_t m[VAK_RELAY_CONTEXT_SIZE + VAK_RELAY_SIGNED_SIZE];
+    uint8_t sm[VAK_RELAY_SIG_SIZE + sizeof(m)];
+    unsigned long long smlen;
+
+    /* Short requests would make the relay an amplifier */
+    if (request_len < VAK_RELAY_PACKET_SIZE ||
+        memcmp(request, VAK_RELAY_REQUEST_MAGIC, VAK_RELAY_MAGIC_SIZE))
+        return -1;
+
+    memset(buffer, 0, VAK_RELAY_PACKET_SIZE);
+    memcpy(buffer, VAK_RELAY_REPLY_MAGIC, VAK_RELAY_MAGIC_SIZE);
+    memcpy(buffer + VAK_RELAY_NONCE_OFFSET, request + VAK_RELAY_NONCE_OFFSET, VAK_RELAY_NONCE_SIZE);
+    vak_relay_put(buffer + VAK_RELAY_MIDP_OFFSET, midp, 8);
+    vak_relay_put(buffer + VAK_RELAY_RADI_OFFSET, radi, 4);
+
+    /* crypto_sign puts the signature in front of the message */
+    memcpy(m, VAK_RELAY_CONTEXT, VAK_RELAY_CONTEXT_SIZE);
+    memcpy(m + VAK_RELAY_CONTEXT_SIZE, buffer, VAK_RELAY_SIGNED_SIZE);
+    crypto_sign(sm, &smlen, m, sizeof(m), secret_key);
+    memcpy(buffer + VAK_RELAY_SIG_OFFSET, sm, VAK_RELAY_SIG_SIZE);
+
+    return VAK_RELAY_PACKET_SIZE;
+}
+
+int vak_relay_parse_reply(const uint8_t *reply, unsigned reply_len,
+                          const uint8_t *nonce, const uint8_t *public_key,
+                          vak_time_t send_time, vak_time_t recv_time,
+                          overlap_value_t *plo, overlap_value_t *phi)
+{
+    uint8_t sm[VAK_RELAY_SIG_SIZE + VAK_RELAY_CONTEXT_SIZE + VAK_RELAY_SIGNED_SIZE];
+    uint8_t m[sizeof(sm)];
+    unsigned long long mlen;
+    vak_time_t midp;
+    uint32_t radi;
+    double adjustment, uncertainty;
+
+    /* Check the cheap things before the signature */
+    if (reply_len != VAK_RELAY_PACKET_SIZE ||
+        memcmp(reply, VAK_RELAY_REPLY_MAGIC, VAK_RELAY_MAGIC_SIZE) ||
+        memcmp(reply + VAK_RELAY_NONCE_OFFSET, nonce, VAK_RELAY_NONCE_SIZE))
+        return 0;
+
+    memcpy(sm, reply + VAK_RELAY_SIG_OFFSET, VAK_RELAY_SIG_SIZE);
+    memcpy(sm + VAK_RELAY_SIG_SIZE, VAK_RELAY_CONTEXT, VAK_RELAY_CONTEXT_SIZE);
+    memcpy(sm + VAK_RELAY_SIG_SIZE + VAK_RELAY_CONTEXT_SIZE, reply, VAK_RELAY_SIGNED_SIZE);
+    if (crypto_sign_open(m, &mlen, sm, sizeof(sm), public_key) != 0)
+        return 0;
+
+    midp = (vak_time_t)vak_relay_get(reply + VAK_RELAY_MIDP_OFFSET, 8);
+    radi = (uint32_t)vak_relay_get(reply + VAK_RELAY_RADI_OFFSET, 4);
+
+    /* The same translation as for a roughtime response */
+    adjustment = ((double)midp - (double)(send_time + recv_time) / 2) / 1000000;
+    uncertainty = (double)radi / 1000000 + (double)(recv_time - send_time) / 2000000;
+
+    *plo = adjustment - uncertainty;
+    *phi = adjustment + uncertainty;
+
+    return 1;
+}
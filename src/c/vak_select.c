@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vak.h"
+
+/* Values assumed for servers we have not heard from yet.  They are
+ * chosen so that a server with unknown behaviour is tried before a
+ * server that is known to be slow or imprecise, but after servers
+ * that are known to be good. */
+static const double PRIOR_RTT_USECS = 200000;
+static const double PRIOR_RADI_USECS = 500000;
+
+/* Each cost is multiplied by a random factor between 1 and 1 +
+ * COST_JITTER, so that the choice is not completely predictable and
+ * all good servers get used over time */
+static const double COST_JITTER = 0.5;
+
+/* Extra factor for servers that can not meet the wanted uncertainty
+ * on their own.  They are not excluded since the overlap of several
+ * responses can be narrower than each of them. */
+static const double WIDE_PENALTY = 4.0;
+
+/* Expected cost of querying a server.  The cost is the width of the
+ * adjustment range the server would give us, divided by the
+ * probability that it answers at all. */
+static double vak_select_cost(const struct vak_server_stats *stats, double max_uncertainty)
+{
+    double rtt = stats->srtt ? (double)stats->srtt : PRIOR_RTT_USECS;
+    double radi = stats->radi ? (double)stats->radi : PRIOR_RADI_USECS;
+    double width = 2 * radi + rtt;
+    double p;
+
+    /* Laplace's rule of succession, a server without history is
+     * assumed to answer half of the time */
+    p = (double)(stats->queries - stats->failures + 1) / (stats->queries + 2);
+
+    if (width > max_uncertainty * 1000000)
+        width *= WIDE_PENALTY;
+
+    return width / p * (1 + COST_JITTER * random() / RAND_MAX);
+}
+
+/* Check if a server has the same operator as a server that has
+ * already been used.  The public key identifies the operator, the
+ * same servers can be listed several times with different addresses
+ * or ports. */
+static int vak_select_seen(struct vak_server const *const *servers, const uint8_t *used,
+                           unsigned count, unsigned i)
+{
+    unsigned j;
+
+    for (j = 0; j < count; j++) {
+        if (used[j] && !memcmp(servers[j]->public_key, servers[i]->public_key,
+                               sizeof(servers[i]->public_key)))
+            return 1;
+    }
+
+    return 0;
+}
+
+int vak_select_server(struct vak_server const *const *servers,
+                      const struct vak_server_stats *const *stats,
+                      const uint8_t *used, unsigned count,
+                      double max_uncertainty)
+{
+    int best = -1;
+    int best_seen = 0;
+    double best_cost = 0;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        double cost;
+        int seen;
+
+        if (used[i])
+            continue;
+
+        /* Prefer servers from operators we have not asked yet, a
+         * single operator should not be able to make up a quorum */
+        seen = vak_select_seen(servers, used, count, i);
+        cost = vak_select_cost(stats[i], max_uncertainty);
+
+        if (best < 0 || seen < best_seen || (seen == best_seen && cost < best_cost)) {
+            best = i;
+            best_seen = seen;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
@@ -0,0 +1,150 @@
+#ifndef VAK_SHM_H
+#define VAK_SHM_H
+
+/* Reader for the trusted time page published by vakd.
+ *
+ * This file does not depend on anything else in vak, copy it into a
+ * program to read the time without linking with vak.  Reading the
+ * time only reads the page and the monotonic clock, which is done in
+ * user space on Linux, so it does not make any system calls and does
+ * not wait for the writer. */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Where vakd publishes the page by default */
+#define VAK_SHM_PATH "/dev/shm/vakd"
+
+/** Magic number and version at the start of the page, "VAKS" */
+#define VAK_SHM_MAGIC 0x534b4156
+#define VAK_SHM_VERSION 1
+
+/** How many times vak_shm_bounds tries to read the page while it is
+ * being written before it gives up */
+#define VAK_SHM_MAX_TRIES 1000
+
+/** The trusted time page.
+ *
+ * The writer makes seq odd while it changes the page and even when
+ * it is done, a reader retries until it has read all fields with the
+ * same even seq.  All fields are 64 bits so that they can be read
+ * atomically one by one.  The offsets are the real time minus the
+ * raw monotonic clock, which nobody adjusts, so the page stays valid
+ * when the wall clock is stepped or slewed.
+ */
+struct vak_shm_page {
+    uint32_t magic;
+    uint32_t version;
+
+    /** Sequence number, odd while the page is being written */
+    uint64_t seq;
+
+    /** Raw monotonic time in microseconds when the offsets were
+     * valid, 0 if there has not been a verified sync yet */
+    int64_t anchor;
+
+    /** Lowest and highest possible offset in microseconds */
+    int64_t offset_lo;
+    int64_t offset_hi;
+
+    /** Range of frequency errors of the monotonic clock in parts per
+     * billion, how much the offsets may change per second */
+    int64_t drift_lo;
+    int64_t drift_hi;
+
+    /** Number of verified syncs published */
+    uint64_t syncs;
+};
+
+/** Map the page read only.
+ *
+ * \param path the file the page is in, usually VAK_SHM_PATH
+ * \returns a pointer to the page or NULL on an error
+ */
+static inline const struct vak_shm_page *vak_shm_map(const char *path)
+{
+    void *p;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    p = mmap(NULL, sizeof(struct vak_shm_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return p == MAP_FAILED ? NULL : (const struct vak_shm_page *)p;
+}
+
+/** Unmap the page */
+static inline void vak_shm_unmap(const struct vak_shm_page *page)
+{
+    munmap((void *)page, sizeof(*page));
+}
+
+/** Get the current time with its bounds.
+ *
+ * \param page the page from vak_shm_map
+ * \param earliest the earliest the time can be, in microseconds
+ * since the epoch, is written here
+ * \param latest the latest the time can be is written here
+ * \returns 1 on success, 0 if there is no verified time yet or if
+ * the page was being written all the VAK_SHM_MAX_TRIES times it was
+ * read
+ */
+static inline int vak_shm_bounds(const struct vak_shm_page *page,
+                                 int64_t *earliest, int64_t *latest)
+{
+    int64_t anchor, offset_lo, offset_hi, drift_lo, drift_hi, now, elapsed;
+    uint64_t seq;
+    unsigned tries = 0;
+    struct timespec ts;
+
+    if (page->magic != VAK_SHM_MAGIC || page->version != VAK_SHM_VERSION)
+        return 0;
+
+    do {
+        /* Don't wait forever for a writer which died while writing */
+        if (tries++ == VAK_SHM_MAX_TRIES)
+            return 0;
+
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        anchor = __atomic_load_n(&page->anchor, __ATOMIC_RELAXED);
+        offset_lo = __atomic_load_n(&page->offset_lo, __ATOMIC_RELAXED);
+        offset_hi = __atomic_load_n(&page->offset_hi, __ATOMIC_RELAXED);
+        drift_lo = __atomic_load_n(&page->drift_lo, __ATOMIC_RELAXED);
+        drift_hi = __atomic_load_n(&page->drift_hi, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+
+    if (!anchor)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    elapsed = now - anchor;
+
+    /* parts per billion times microseconds, in microseconds */
+    *earliest = now + offset_lo + drift_lo * elapsed / 1000000000;
+    *latest = now + offset_hi + drift_hi * elapsed / 1000000000;
+
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VAK_SHM_H */
@@ -0,0 +1,109 @@
+#include "vak.h"
+#include "vak_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct vak_shm {
+    struct vak_shm_page *page;
+};
+
+struct vak_shm *vak_shm_create(const char *path)
+{
+    struct vak_shm *shm;
+    struct stat st;
+    int fd;
+
+    shm = malloc(sizeof(*shm));
+    if (!shm)
+        return NULL;
+
+    /* Keep an existing file so that readers which have already
+     * mapped it see the new time */
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+        free(shm);
+        return NULL;
+    }
+
+    /* /dev/shm can be written by anyone.  Never truncate a file
+     * someone else has made, or has a link to, and never publish the
+     * time in a page someone else could have open for writing. */
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "fstat %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        free(shm);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_nlink != 1 ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "%s is not a regular file owned by us and only writable by us\n", path);
+        close(fd);
+        free(shm);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*shm->page)) < 0) {
+        fprintf(stderr, "ftruncate %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        free(shm);
+        return NULL;
+    }
+
+    shm->page = mmap(NULL, sizeof(*shm->page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->page == MAP_FAILED) {
+        fprintf(stderr, "mmap %s failed: %s\n", path, strerror(errno));
+        free(shm);
+        return NULL;
+    }
+
+    /* Times from an earlier run can not be trusted any more, the
+     * process may have been stopped because something was wrong */
+    vak_shm_publish(shm, NULL, 0, 0, 0, 0);
+    shm->page->version = VAK_SHM_VERSION;
+    shm->page->magic = VAK_SHM_MAGIC;
+
+    return shm;
+}
+
+void vak_shm_close(struct vak_shm *shm)
+{
+    munmap(shm->page, sizeof(*shm->page));
+    free(shm);
+}
+
+void vak_shm_publish(struct vak_shm *shm, const struct vak_clock_sample *clock,
+                     overlap_value_t lo, overlap_value_t hi,
+                     double drift_lo, double drift_hi)
+{
+    struct vak_shm_page *page = shm->page;
+    vak_time_t offset = clock ? clock->realtime - clock->monotonic : 0;
+
+    uint64_t seq;
+
+    /* The seqlock write side, readers retry while seq is odd or if it
+     * has changed while they were reading.  A writer which died while
+     * writing left seq odd, make it odd again and not even. */
+    seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED) & ~(uint64_t)1;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&page->anchor, clock ? clock->monotonic : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->offset_lo, offset + (int64_t)(lo * 1000000), __ATOMIC_RELAXED);
+    __atomic_store_n(&page->offset_hi, offset + (int64_t)(hi * 1000000), __ATOMIC_RELAXED);
+    __atomic_store_n(&page->drift_lo, (int64_t)(drift_lo * 1000), __ATOMIC_RELAXED);
+    __atomic_store_n(&page->drift_hi, (int64_t)(drift_hi * 1000), __ATOMIC_RELAXED);
+    if (clock)
+        __atomic_store_n(&page->syncs, page->syncs + 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
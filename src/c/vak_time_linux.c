@@ -2,6 +2,19 @@
 
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
+
+/* The raw monotonic clock is not even slewed by NTP, fall back to
+ * the normal monotonic clock on platforms which do not have it */
+#ifdef CLOCK_MONOTONIC_RAW
+#define VAK_CLOCK_MONOTONIC CLOCK_MONOTONIC_RAW
+#else
+#define VAK_CLOCK_MONOTONIC CLOCK_MONOTONIC
+#endif
+
+/* Number of times to try to read both clocks without being
+ * interrupted in between */
+#define VAK_CLOCK_SAMPLE_TRIES 3
 
 /** Get the wall time.
  *
@@ -21,6 +34,44 @@ vak_time_t vak_get_time(void)
     return t;
 }
 
+static vak_time_t vak_timespec_to_usecs(const struct timespec *ts)
+{
+    return (vak_time_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+vak_time_t vak_get_monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(VAK_CLOCK_MONOTONIC, &ts);
+    return vak_timespec_to_usecs(&ts);
+}
+
+void vak_get_clock_sample(struct vak_clock_sample *sample)
+{
+    struct timespec before, real, after;
+    vak_time_t best = VAK_TIME_MAX;
+    unsigned i;
+
+    /* Read the wall time between two readings of the monotonic time
+     * and keep the try where they were closest together, if the
+     * process was preempted in the middle the sample is off */
+    for (i = 0; i < VAK_CLOCK_SAMPLE_TRIES; i++) {
+        vak_time_t b, a;
+
+        clock_gettime(VAK_CLOCK_MONOTONIC, &before);
+        clock_gettime(CLOCK_REALTIME, &real);
+        clock_gettime(VAK_CLOCK_MONOTONIC, &after);
+
+        b = vak_timespec_to_usecs(&before);
+        a = vak_timespec_to_usecs(&after);
+        if (a - b < best) {
+            best = a - b;
+            sample->realtime = vak_timespec_to_usecs(&real);
+            sample->monotonic = b + (a - b) / 2;
+        }
+    }
+}
+
 int vak_adjust_time(vak_time_t adj)
 {
     vak_time_t t64;
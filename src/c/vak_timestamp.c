@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vak.h"
+#include "vrt.h"
+
+#include "overlap_algo.h"
+
+/* A receipt is the magic, the position of the hash in the tree, the
+ * depth of the tree, the number of responses, the path from the hash
+ * to the root and then for each response the public key and variant
+ * of the server, the length and the response as it was received.
+ * Numbers are little endian like in roughtime. */
+#define VAK_RECEIPT_MAGIC "VAKT"
+#define VAK_RECEIPT_MAGIC_SIZE 4
+#define VAK_RECEIPT_HEADER_SIZE (VAK_RECEIPT_MAGIC_SIZE + 3 * 4)
+#define VAK_RECEIPT_RESPONSE_HEADER_SIZE (32 + 2 * 4)
+
+static void vak_receipt_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t vak_receipt_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Build a receipt for each hash from the responses to the root */
+static int vak_timestamp_receipts(struct vak_impl *impl, const struct vak_tree *tree,
+                                  uint8_t **receipts, unsigned *receipt_lens,
+                                  unsigned count)
+{
+    const struct vak_server *server;
+    const void *buffer;
+    unsigned depth = vak_tree_depth(tree);
+    unsigned nr_responses, responses_len = 0;
+    unsigned length, i, j;
+    uint8_t *p;
+
+    for (nr_responses = 0; vak_impl_get_response(impl, nr_responses, &server, &buffer, &length); nr_responses++)
+        responses_len += VAK_RECEIPT_RESPONSE_HEADER_SIZE + length;
+
+    memset(receipts, 0, count * sizeof(*receipts));
+
+    for (i = 0; i < count; i++) {
+        receipt_lens[i] = VAK_RECEIPT_HEADER_SIZE + depth * VAK_TREE_NODE_SIZE + responses_len;
+        receipts[i] = p = malloc(receipt_lens[i]);
+        if (!p) {
+            fprintf(stderr, "malloc receipt failed\n");
+            vak_timestamp_free(receipts, count);
+            return -1;
+        }
+
+        memcpy(p, VAK_RECEIPT_MAGIC, VAK_RECEIPT_MAGIC_SIZE);
+        vak_receipt_put32(p + VAK_RECEIPT_MAGIC_SIZE, i);
+        vak_receipt_put32(p + VAK_RECEIPT_MAGIC_SIZE + 4, depth);
+        vak_receipt_put32(p + VAK_RECEIPT_MAGIC_SIZE + 8, nr_responses);
+        p += VAK_RECEIPT_HEADER_SIZE;
+
+        vak_tree_path(tree, i, p);
+        p += depth * VAK_TREE_NODE_SIZE;
+
+        for (j = 0; vak_impl_get_response(impl, j, &server, &buffer, &length); j++) {
+            memcpy(p, server->public_key, 32);
+            vak_receipt_put32(p + 32, server->variant);
+            vak_receipt_put32(p + 36, length);
+            memcpy(p + VAK_RECEIPT_RESPONSE_HEADER_SIZE, buffer, length);
+            p += VAK_RECEIPT_RESPONSE_HEADER_SIZE + length;
+        }
+    }
+
+    return nr_responses;
+}
+
+int vak_timestamp(const uint8_t *hashes, unsigned count,
+                  uint8_t **receipts, unsigned *receipt_lens)
+{
+    struct vak_server const **servers = NULL;
+    struct vak_udp *udp = NULL;
+    struct vak_impl *impl = NULL;
+    struct vak_cache *cache = NULL;
+    struct vak_tree *tree = NULL;
+    overlap_value_t lo, hi;
+    int r = -1;
+
+    /* Everything is stamped with a single sync to the root */
+    tree = vak_tree_new(hashes, count);
+    if (!tree) {
+        fprintf(stderr, "vak_tree_new failed\n");
+        goto out;
+    }
+
+    if (vak_seed_random() < 0) {
+        fprintf(stderr, "vak_seed_random failed: %s\n", strerror(errno));
+        goto out;
+    }
+
+    servers = vak_get_randomized_servers();
+    if (!servers) {
+        fprintf(stderr, "vak_get_randomized_servers failed\n");
+        goto out;
+    }
+
+    udp = vak_udp_new();
+    if (!udp) {
+        fprintf(stderr, "vak_udp_new failed\n");
+        goto out;
+    }
+
+    impl = vak_impl_new(servers, 10, udp);
+    if (!impl) {
+        fprintf(stderr, "vak_impl_new failed\n");
+        goto out;
+    }
+
+    vak_impl_set_connected(impl, 1);
+    vak_impl_set_nonce(impl, vak_tree_root(tree));
+
+#ifdef VAK_CACHE_FILE
+    cache = vak_cache_open(VAK_CACHE_FILE);
+    if (cache)
+        vak_impl_set_cache(impl, cache);
+#endif
+
+    while (1) {
+        r = vak_impl_process(impl, &lo, &hi);
+        if (r)
+            break;
+
+        if (vak_udp_wait(udp, vak_impl_timeout(impl)) < 0) {
+            fprintf(stderr, "vak_udp_wait failed\n");
+            r = -1;
+            break;
+        }
+    }
+
+    if (r > 0)
+        r = vak_timestamp_receipts(impl, tree, receipts, receipt_lens, count);
+
+out:
+    if (impl)
+        vak_impl_del(impl);
+    if (cache)
+        vak_cache_close(cache);
+    if (udp)
+        vak_udp_del(udp);
+    if (servers)
+        vak_servers_del(servers);
+    vak_tree_del(tree);
+
+    return r;
+}
+
+void vak_timestamp_free(uint8_t **receipts, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        free(receipts[i]);
+        receipts[i] = NULL;
+    }
+}
+
+/* Check if a response from a server with the same public key has
+ * already been counted.  The same servers can be listed several
+ * times with different addresses, and a receipt could hold the same
+ * response many times, but each operator only gets one vote. */
+static int vak_receipt_seen(struct vak_server const **servers, const uint8_t *used,
+                            const uint8_t *public_key)
+{
+    unsigned j;
+
+    for (j = 0; servers[j]; j++) {
+        if (used[j] && !memcmp(servers[j]->public_key, public_key,
+                               sizeof(servers[j]->public_key)))
+            return 1;
+    }
+
+    return 0;
+}
+
+int vak_receipt_verify(const uint8_t *receipt, unsigned receipt_len,
+                       const uint8_t *hash, struct vak_server const **servers,
+                       vak_time_t *earliest, vak_time_t *latest)
+{
+    uint32_t response[VRT_QUERY_PACKET_LEN / 4];
+    uint8_t root[VAK_TREE_NODE_SIZE];
+    struct overlap_algo *algo;
+    uint8_t *used;
+    const uint8_t *p, *end = receipt + receipt_len;
+    unsigned index, depth, nr_responses, nr_servers, i, j;
+    overlap_value_t lo, hi;
+    int nr_overlaps = 0;
+
+    if (receipt_len < VAK_RECEIPT_HEADER_SIZE ||
+        memcmp(receipt, VAK_RECEIPT_MAGIC, VAK_RECEIPT_MAGIC_SIZE))
+        return 0;
+
+    index = vak_receipt_get32(receipt + VAK_RECEIPT_MAGIC_SIZE);
+    depth = vak_receipt_get32(receipt + VAK_RECEIPT_MAGIC_SIZE + 4);
+    nr_responses = vak_receipt_get32(receipt + VAK_RECEIPT_MAGIC_SIZE + 8);
+    p = receipt + VAK_RECEIPT_HEADER_SIZE;
+
+    if (depth >= 32 || index >= (1u << depth) ||
+        (unsigned)(end - p) < depth * VAK_TREE_NODE_SIZE)
+        return 0;
+
+    /* All servers signed the root that the hash hashes up to */
+    vak_tree_hash_path(root, hash, index, p, depth);
+    p += depth * VAK_TREE_NODE_SIZE;
+
+    for (nr_servers = 0; servers[nr_servers]; nr_servers++)
+        ;
+    used = calloc(nr_servers + 1, 1);
+    if (!used) {
+        fprintf(stderr, "calloc used failed\n");
+        return 0;
+    }
+
+    algo = overlap_new();
+    if (!algo) {
+        fprintf(stderr, "overlap_new failed\n");
+        free(used);
+        return 0;
+    }
+
+    for (i = 0; i < nr_responses; i++) {
+        const struct vak_server *server = NULL;
+        unsigned variant, length;
+        uint64_t midp;
+        uint32_t radi;
+
+        if (end - p < VAK_RECEIPT_RESPONSE_HEADER_SIZE)
+            break;
+
+        variant = vak_receipt_get32(p + 32);
+        length = vak_receipt_get32(p + 36);
+        if ((unsigned)(end - p) - VAK_RECEIPT_RESPONSE_HEADER_SIZE < length)
+            break;
+
+        /* Only count servers the caller trusts */
+        for (j = 0; servers[j]; j++) {
+            if (servers[j]->variant == variant &&
+                !memcmp(servers[j]->public_key, p, 32)) {
+                server = servers[j];
+                break;
+            }
+        }
+
+        if (server && length <= sizeof(response) &&
+            !vak_receipt_seen(servers, used, server->public_key)) {
+            memcpy(response, p + VAK_RECEIPT_RESPONSE_HEADER_SIZE, length);
+            if (vrt_parse_response(root, sizeof(root), response, length,
+                                   server->public_key, &midp, &radi,
+                                   variant) == VRT_SUCCESS) {
+                if (!overlap_add(algo, (double)midp - radi, (double)midp + radi))
+                    break;
+                used[j] = 1;
+            }
+        }
+
+        p += VAK_RECEIPT_RESPONSE_HEADER_SIZE + length;
+    }
+
+    /* The time most of the servers agree on */
+    if (i == nr_responses)
+        nr_overlaps = overlap_find(algo, &lo, &hi);
+    if (nr_overlaps > 0) {
+        *earliest = (vak_time_t)lo;
+        *latest = (vak_time_t)hi;
+    }
+
+    overlap_del(algo);
+    free(used);
+
+    return nr_overlaps;
+}
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vak.h"
+#include "vrt.h"
+#include "tweetnacl.h"
+
+/* Nodes are full SHA-512 hashes so that the root can be used as the
+ * nonce for all protocol variants, the later ones only use the first
+ * 32 bytes of it */
+#if VAK_TREE_NODE_SIZE != VRT_NONCE_SIZE
+#error "VAK_TREE_NODE_SIZE must be the same as VRT_NONCE_SIZE"
+#endif
+
+/* All levels of the tree, the leaves first and the root last.  The
+ * leaves are padded to a power of two with copies of the last one. */
+struct vak_tree {
+    unsigned count;
+    unsigned depth;
+    uint8_t *nodes;
+};
+
+/* The same domain separation as the tree in a roughtime response */
+static void vak_tree_hash_leaf(uint8_t *out, const uint8_t *leaf)
+{
+    uint8_t msg[1 + VAK_TREE_LEAF_SIZE];
+
+    msg[0] = VRT_DOMAIN_LABEL_LEAF;
+    memcpy(msg + 1, leaf, VAK_TREE_LEAF_SIZE);
+    crypto_hash(out, msg, sizeof(msg));
+}
+
+static void vak_tree_hash_node(uint8_t *out, const uint8_t *left, const uint8_t *right)
+{
+    uint8_t msg[1 + 2 * VAK_TREE_NODE_SIZE];
+
+    msg[0] = VRT_DOMAIN_LABEL_NODE;
+    memcpy(msg + 1, left, VAK_TREE_NODE_SIZE);
+    memcpy(msg + 1 + VAK_TREE_NODE_SIZE, right, VAK_TREE_NODE_SIZE);
+    crypto_hash(out, msg, sizeof(msg));
+}
+
+/* Offset of the first node of a level */
+static size_t vak_tree_level(const struct vak_tree *tree, unsigned d)
+{
+    size_t width = (size_t)1 << tree->depth;
+    size_t offset = 0;
+
+    for (; d; d--, width /= 2)
+        offset += width;
+
+    return offset * VAK_TREE_NODE_SIZE;
+}
+
+struct vak_tree *vak_tree_new(const uint8_t *leaves, unsigned count)
+{
+    struct vak_tree *tree;
+    uint8_t *level, *next;
+    size_t width, i;
+    unsigned d;
+
+    if (!count)
+        return NULL;
+
+    tree = malloc(sizeof(*tree));
+    if (!tree)
+        return NULL;
+
+    tree->count = count;
+    for (tree->depth = 0; ((size_t)1 << tree->depth) < count; tree->depth++)
+        ;
+
+    /* A full tree has twice as many nodes as leaves, minus one */
+    width = (size_t)1 << tree->depth;
+    tree->nodes = malloc((2 * width - 1) * VAK_TREE_NODE_SIZE);
+    if (!tree->nodes) {
+        free(tree);
+        return NULL;
+    }
+
+    level = tree->nodes;
+    for (i = 0; i < width; i++)
+        vak_tree_hash_leaf(level + i * VAK_TREE_NODE_SIZE,
+                           leaves + (i < count ? i : count - 1) * VAK_TREE_LEAF_SIZE);
+
+    for (d = 0; d < tree->depth; d++) {
+        next = level + width * VAK_TREE_NODE_SIZE;
+        width /= 2;
+        for (i = 0; i < width; i++)
+            vak_tree_hash_node(next + i * VAK_TREE_NODE_SIZE,
+                               level + 2 * i * VAK_TREE_NODE_SIZE,
+                               level + (2 * i + 1) * VAK_TREE_NODE_SIZE);
+        level = next;
+    }
+
+    return tree;
+}
+
+void vak_tree_del(struct vak_tree *tree)
+{
+    if (!tree)
+        return;
+
+    free(tree->nodes);
+    free(tree);
+}
+
+const uint8_t *vak_tree_root(const struct vak_tree *tree)
+{
+    return tree->nodes + vak_tree_level(tree, tree->depth);
+}
+
+unsigned vak_tree_depth(const struct vak_tree *tree)
+{
+    return tree->depth;
+}
+
+void vak_tree_path(const struct vak_tree *tree, unsigned index, uint8_t *path)
+{
+    unsigned d;
+
+    /* The sibling of the node above the leaf on each level */
+    for (d = 0; d < tree->depth; d++)
+        memcpy(path + d * VAK_TREE_NODE_SIZE,
+               tree->nodes + vak_tree_level(tree, d) + (size_t)((index >> d) ^ 1) * VAK_TREE_NODE_SIZE,
+               VAK_TREE_NODE_SIZE);
+}
+
+void vak_tree_hash_path(uint8_t *root, const uint8_t *leaf, unsigned index,
+                        const uint8_t *path, unsigned depth)
+{
+    unsigned d;
+
+    vak_tree_hash_leaf(root, leaf);
+
+    for (d = 0; d < depth; d++) {
+        const uint8_t *sibling = path + d * VAK_TREE_NODE_SIZE;
+
+        if ((index >> d) & 1)
+            vak_tree_hash_node(root, sibling, root);
+        else
+            vak_tree_hash_node(root, root, sibling);
+    }
+}
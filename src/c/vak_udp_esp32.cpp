@@ -2,10 +2,15 @@
 
 #include <stdlib.h>
 
+#include <WiFi.h>
 #include <WiFiUdp.h>
 
 struct vak_udp {
     WiFiUDP *udp;
+
+    /* Length of a packet which has been parsed by vak_udp_wait but
+     * not read yet */
+    int pending;
 };
 
 struct vak_udp *vak_udp_new(void)
@@ -39,11 +44,132 @@ int vak_udp_send(struct vak_udp *udp, const char *host, unsigned port, const voi
     return 0;
 }
 
+int vak_udp_resolve(const char *host, unsigned port, struct vak_addr *addr)
+{
+    IPAddress ip;
+
+    if (!WiFi.hostByName(host, ip))
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->family = 4;
+    addr->port = port;
+    addr->addr[0] = ip[0];
+    addr->addr[1] = ip[1];
+    addr->addr[2] = ip[2];
+    addr->addr[3] = ip[3];
+
+    return 0;
+}
+
+int vak_udp_resolve_many(const char *const *hosts, const unsigned *ports,
+                         struct vak_addr *addrs, unsigned count)
+{
+    unsigned i, resolved = 0;
+
+    /* There is no asynchronous lookup, do them one at a time.  Only
+     * IPv4 is supported so the other entries are left unused. */
+    memset(addrs, 0, count * VAK_MAX_ADDRS * sizeof(*addrs));
+    for (i = 0; i < count; i++) {
+        if (vak_udp_resolve(hosts[i], ports[i], &addrs[i * VAK_MAX_ADDRS]) == 0)
+            resolved++;
+    }
+
+    return resolved;
+}
+
+int vak_udp_send_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    unsigned i;
+
+    /* WiFiUDP can only send one packet at a time */
+    for (i = 0; i < count; i++) {
+        IPAddress ip(msgs[i].addr.addr[0], msgs[i].addr.addr[1],
+                     msgs[i].addr.addr[2], msgs[i].addr.addr[3]);
+
+        msgs[i].id = i;
+        msgs[i].time = vak_get_time();
+        udp->udp->beginPacket(ip, msgs[i].addr.port);
+        udp->udp->write((const uint8_t *)msgs[i].buffer, msgs[i].length);
+        udp->udp->endPacket();
+    }
+
+    return count;
+}
+
+int vak_udp_open_channel(struct vak_udp *udp, const struct vak_addr *addr)
+{
+    /* Not supported, everything goes through the shared socket */
+    return -1;
+}
+
+void vak_udp_close_channel(struct vak_udp *udp, int channel)
+{
+}
+
+int vak_udp_watch_fd(struct vak_udp *udp, int fd)
+{
+    /* There are no file descriptors to wait for with WiFiUDP */
+    return -1;
+}
+
+int vak_udp_tx_time(struct vak_udp *udp, unsigned id, vak_time_t *time)
+{
+    /* Not supported, the time from vak_udp_send_batch is all we have */
+    return 0;
+}
+
+int vak_udp_recv_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        int n = vak_udp_recv(udp, msgs[i].buffer, msgs[i].size);
+        if (n <= 0)
+            break;
+
+        IPAddress ip = udp->udp->remoteIP();
+
+        memset(&msgs[i].addr, 0, sizeof(msgs[i].addr));
+        msgs[i].addr.family = 4;
+        msgs[i].addr.port = udp->udp->remotePort();
+        msgs[i].addr.addr[0] = ip[0];
+        msgs[i].addr.addr[1] = ip[1];
+        msgs[i].addr.addr[2] = ip[2];
+        msgs[i].addr.addr[3] = ip[3];
+        msgs[i].length = n;
+        msgs[i].time = vak_get_time();
+        msgs[i].channel = 0;
+    }
+
+    return i;
+}
+
 int vak_udp_recv(struct vak_udp *udp, void *buffer, unsigned length)
 {
-    int r = udp->udp->parsePacket();
+    int r = udp->pending;
+    udp->pending = 0;
+    if (!r)
+        r = udp->udp->parsePacket();
     if (!r)
         return 0;
 
     return udp->udp->read((uint8_t *)buffer, length);
 }
+
+int vak_udp_wait(struct vak_udp *udp, vak_time_t timeout)
+{
+    vak_time_t start = vak_get_monotonic();
+
+    /* There is no way to sleep on a WiFiUDP socket, poll it */
+    while (!udp->pending) {
+        udp->pending = udp->udp->parsePacket();
+        if (udp->pending)
+            break;
+        if (vak_get_monotonic() - start >= timeout)
+            return 0;
+        delay(1);
+    }
+
+    return 1;
+}
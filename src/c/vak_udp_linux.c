@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "vak.h"
 
 #include <stdio.h>
@@ -9,109 +11,762 @@
 #include <netdb.h>
 
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+
+/* Maximum number of datagrams passed to the kernel in one system call */
+#define VAK_UDP_BATCH_MAX 16
+
+/* Number of transmit timestamps to remember */
+#define VAK_UDP_TX_TIMES 32
+
+/* Size of the buffer for ancillary data */
+#define VAK_UDP_CONTROL_SIZE 256
+
+/* Socket 0 is the shared unconnected socket, the others are used for
+ * channels */
+#define VAK_UDP_SOCKETS (1 + VAK_MAX_CHANNELS)
+
+/* epoll data for the timer and for file descriptors added with
+ * vak_udp_watch_fd, sockets use their index */
+#define VAK_UDP_TIMER VAK_UDP_SOCKETS
+#define VAK_UDP_WATCHED (VAK_UDP_SOCKETS + 1)
+
+/* The ids handed out by vak_udp_send_batch are the index of the
+ * socket in the top bits and the kernel's id in the low bits */
+#define VAK_UDP_ID_SHIFT 24
+#define VAK_UDP_ID_MASK ((1u << VAK_UDP_ID_SHIFT) - 1)
+
+struct vak_udp_socket {
+    int fd;
+
+    /* 1 if the socket is used by a channel */
+    int open;
+
+    /* The kernel numbers every datagram sent on the socket, this is
+     * the id the next datagram will get. */
+    unsigned tx_next_id;
+};
 
 struct vak_udp {
-    int sockfd;
+    /* Sockets, -1 for channels that have not been created yet.
+     * Sockets of closed channels are kept for reuse. */
+    struct vak_udp_socket socks[VAK_UDP_SOCKETS];
+
+    /* AF_INET6 for dual stack sockets which can send to both IPv4
+     * and IPv6 addresses, AF_INET if the host has no IPv6 support */
+    int family;
+
+    /* epoll instance watching the sockets and timerfd */
+    int epollfd;
+
+    /* Timer used to wake up epoll at a deadline with a better
+     * resolution than the milliseconds epoll_wait supports */
+    int timerfd;
+
+    /* Transmit timestamps read from the error queues */
+    struct {
+        unsigned id;
+        vak_time_t time;
+    } tx_times[VAK_UDP_TX_TIMES];
+    unsigned tx_times_head;
 };
 
+static int vak_udp_epoll_ctl(struct vak_udp *udp, int op, int fd, uint32_t events, uint32_t data)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = data;
+
+    return epoll_ctl(udp->epollfd, op, fd, &ev);
+}
+
+/* Create a socket of the family used by udp */
+static int vak_udp_socket(struct vak_udp *udp)
+{
+    int fd = socket(udp->family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (udp->family == AF_INET6) {
+        int off = 0;
+
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+            fprintf(stderr, "IPV6_V6ONLY failed: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    /* Ask the kernel to timestamp received datagrams and to report
+     * when datagrams actually left on the error queue.  If this is
+     * not supported, the time is read in user space instead. */
+    {
+        int on = 1;
+        int flags = (SOF_TIMESTAMPING_TX_SOFTWARE |
+                     SOF_TIMESTAMPING_SOFTWARE |
+                     SOF_TIMESTAMPING_OPT_ID |
+                     SOF_TIMESTAMPING_OPT_TSONLY);
+
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+            fprintf(stderr, "SO_TIMESTAMPNS failed: %s\n", strerror(errno));
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+            fprintf(stderr, "SO_TIMESTAMPING failed: %s\n", strerror(errno));
+    }
+
+    return fd;
+}
+
 struct vak_udp *vak_udp_new(void)
 {
+    unsigned i;
+
     struct vak_udp *udp = malloc(sizeof(*udp));
     if (!udp)
         return NULL;
 
     memset(udp, 0, sizeof(*udp));
+    for (i = 0; i < VAK_UDP_SOCKETS; i++)
+        udp->socks[i].fd = -1;
+    udp->epollfd = -1;
+    udp->timerfd = -1;
 
-    /* Create an UDP socket */
-    udp->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp->sockfd < 0) {
+    /* Create a dual stack UDP socket, IPv4 addresses are sent as
+     * IPv4 mapped IPv6 addresses.  Fall back to a plain IPv4 socket
+     * if IPv6 is not available. */
+    udp->family = AF_INET6;
+    udp->socks[0].fd = vak_udp_socket(udp);
+    if (udp->socks[0].fd < 0) {
+        udp->family = AF_INET;
+        udp->socks[0].fd = vak_udp_socket(udp);
+    }
+    if (udp->socks[0].fd < 0) {
         fprintf(stderr, "socket failed: %s\n", strerror(errno));
         vak_udp_del(udp);
         return NULL;
     }
 
+    udp->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (udp->timerfd < 0) {
+        fprintf(stderr, "timerfd_create failed: %s\n", strerror(errno));
+        vak_udp_del(udp);
+        return NULL;
+    }
+
+    udp->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (udp->epollfd < 0) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        vak_udp_del(udp);
+        return NULL;
+    }
+
+    if (vak_udp_epoll_ctl(udp, EPOLL_CTL_ADD, udp->socks[0].fd, EPOLLIN, 0) < 0 ||
+        vak_udp_epoll_ctl(udp, EPOLL_CTL_ADD, udp->timerfd, EPOLLIN, VAK_UDP_TIMER) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        vak_udp_del(udp);
+        return NULL;
+    }
+
     return udp;
 }
 
 void vak_udp_del(struct vak_udp *udp)
 {
-    if (udp->sockfd != -1)
-        close(udp->sockfd);
+    unsigned i;
+
+    if (udp->epollfd != -1)
+        close(udp->epollfd);
+    if (udp->timerfd != -1)
+        close(udp->timerfd);
+    for (i = 0; i < VAK_UDP_SOCKETS; i++) {
+        if (udp->socks[i].fd != -1)
+            close(udp->socks[i].fd);
+    }
     free(udp);
 }
 
+/* Prefix of an IPv4 mapped IPv6 address, ::ffff:0:0/96 */
+static const uint8_t vak_udp_v4mapped[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+static socklen_t vak_udp_to_sockaddr(struct vak_udp *udp, struct sockaddr_storage *ss,
+                                     const struct vak_addr *addr)
+{
+    memset(ss, 0, sizeof(*ss));
+
+    if (addr->family == 6 || udp->family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(addr->port);
+        if (addr->family == 6) {
+            memcpy(&sin6->sin6_addr, addr->addr, sizeof(sin6->sin6_addr));
+        } else {
+            memcpy(&sin6->sin6_addr, vak_udp_v4mapped, sizeof(vak_udp_v4mapped));
+            memcpy((uint8_t *)&sin6->sin6_addr + sizeof(vak_udp_v4mapped), addr->addr, 4);
+        }
+        return sizeof(*sin6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(addr->port);
+        memcpy(&sin->sin_addr, addr->addr, sizeof(sin->sin_addr));
+        return sizeof(*sin);
+    }
+}
+
+static void vak_udp_from_sockaddr(struct vak_addr *addr, const struct sockaddr_storage *ss)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+        const uint8_t *a = (const uint8_t *)&sin6->sin6_addr;
+        addr->port = ntohs(sin6->sin6_port);
+        if (!memcmp(a, vak_udp_v4mapped, sizeof(vak_udp_v4mapped))) {
+            /* Replies from IPv4 servers on a dual stack socket */
+            addr->family = 4;
+            memcpy(addr->addr, a + sizeof(vak_udp_v4mapped), 4);
+        } else {
+            addr->family = 6;
+            memcpy(addr->addr, a, sizeof(sin6->sin6_addr));
+        }
+    } else if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+        addr->family = 4;
+        addr->port = ntohs(sin->sin_port);
+        memcpy(addr->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+    }
+}
+
+static vak_time_t vak_udp_timespec_to_time(const struct timespec *ts)
+{
+    return (vak_time_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* Look for a kernel timestamp in the ancillary data of a message */
+static int vak_udp_get_timestamp(struct msghdr *hdr, vak_time_t *time)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *time = vak_udp_timespec_to_time(&ts);
+            return 1;
+        }
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            *time = vak_udp_timespec_to_time(&tss.ts[0]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Read transmit timestamps from the error queue of a socket */
+static void vak_udp_read_errqueue(struct vak_udp *udp, unsigned index)
+{
+    while (1) {
+        char control[VAK_UDP_CONTROL_SIZE];
+        struct msghdr hdr;
+        struct cmsghdr *cmsg;
+        vak_time_t time;
+        int have_id = 0;
+        unsigned id = 0;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        if (recvmsg(udp->socks[index].fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "recvmsg MSG_ERRQUEUE failed: %s\n", strerror(errno));
+            return;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    id = (index << VAK_UDP_ID_SHIFT) | (err.ee_data & VAK_UDP_ID_MASK);
+                    have_id = 1;
+                }
+            }
+        }
+
+        if (have_id && vak_udp_get_timestamp(&hdr, &time)) {
+            unsigned i = udp->tx_times_head++ % VAK_UDP_TX_TIMES;
+            udp->tx_times[i].id = id;
+            udp->tx_times[i].time = time;
+        }
+    }
+}
+
+int vak_udp_tx_time(struct vak_udp *udp, unsigned id, vak_time_t *time)
+{
+    unsigned i;
+
+    if ((id >> VAK_UDP_ID_SHIFT) >= VAK_UDP_SOCKETS ||
+        udp->socks[id >> VAK_UDP_ID_SHIFT].fd == -1)
+        return 0;
+
+    vak_udp_read_errqueue(udp, id >> VAK_UDP_ID_SHIFT);
+
+    for (i = 0; i < VAK_UDP_TX_TIMES; i++) {
+        if (udp->tx_times[i].time && udp->tx_times[i].id == id) {
+            *time = udp->tx_times[i].time;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Pick at most one address of each family from a getaddrinfo
+ * result, keeping the order getaddrinfo sorted them in */
+static unsigned vak_udp_from_addrinfo(struct vak_addr *addrs, unsigned max,
+                                      const struct addrinfo *res, unsigned port)
+{
+    unsigned i, n = 0;
+
+    for (; res && n < max; res = res->ai_next) {
+        struct vak_addr addr;
+
+        if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+            continue;
+
+        vak_udp_from_sockaddr(&addr, (const struct sockaddr_storage *)res->ai_addr);
+        addr.port = port;
+
+        for (i = 0; i < n; i++) {
+            if (addrs[i].family == addr.family)
+                break;
+        }
+        if (i == n)
+            addrs[n++] = addr;
+    }
+
+    return n;
+}
+
+int vak_udp_resolve(const char *host, unsigned port, struct vak_addr *addr)
+{
+    struct vak_addr a[VAK_MAX_ADDRS];
+
+    if (vak_udp_resolve_many(&host, &port, a, 1) != 1)
+        return -1;
+
+    /* The preferred address */
+    *addr = a[0];
+    return 0;
+}
+
+int vak_udp_resolve_many(const char *const *hosts, const unsigned *ports,
+                         struct vak_addr *addrs, unsigned count)
+{
+    struct gaicb *gaicbs;
+    struct gaicb **list;
+    struct addrinfo hints;
+    unsigned i, resolved = 0;
+
+    gaicbs = calloc(count, sizeof(*gaicbs));
+    list = calloc(count, sizeof(*list));
+    if (!gaicbs || !list) {
+        free(gaicbs);
+        free(list);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    /* Start all lookups at the same time and wait for all of them to
+     * finish, so that the total time is that of the slowest lookup
+     * instead of the sum of all. */
+    for (i = 0; i < count; i++) {
+        gaicbs[i].ar_name = hosts[i];
+        gaicbs[i].ar_request = &hints;
+        list[i] = &gaicbs[i];
+    }
+
+    /* Failures are reported for each request below */
+    getaddrinfo_a(GAI_WAIT, list, count, NULL);
+
+    for (i = 0; i < count; i++) {
+        int r = gai_error(&gaicbs[i]);
+
+        memset(&addrs[i * VAK_MAX_ADDRS], 0, VAK_MAX_ADDRS * sizeof(*addrs));
+
+        if (r) {
+            fprintf(stderr, "getaddrinfo %s failed: %s\n", hosts[i], gai_strerror(r));
+            continue;
+        }
+
+        if (vak_udp_from_addrinfo(&addrs[i * VAK_MAX_ADDRS], VAK_MAX_ADDRS,
+                                  gaicbs[i].ar_result, ports[i]))
+            resolved++;
+
+        freeaddrinfo(gaicbs[i].ar_result);
+    }
+
+    free(gaicbs);
+    free(list);
+
+    return resolved;
+}
+
 int vak_udp_send(struct vak_udp *udp, const char *host, unsigned port, const void *buffer, unsigned length)
 {
-    struct hostent *he;
-    struct sockaddr_in addr;
-    int n;
+    struct vak_udp_msg msg;
 
-    /* Look up the host name or process the IPv4 address and fill in
-     * the addr structure. */
-    he = gethostbyname(host);
-    if (!he) {
-        fprintf(stderr, "gethostbyname failed: %s\n", strerror(errno));
+    if (vak_udp_resolve(host, port, &msg.addr) < 0)
         return -1;
+
+    msg.buffer = (void *)buffer;
+    msg.length = length;
+    msg.channel = 0;
+
+    if (vak_udp_send_batch(udp, &msg, 1) != 1)
+        return -1;
+
+    return 0;
+}
+
+int vak_udp_open_channel(struct vak_udp *udp, const struct vak_addr *addr)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    char buf[1];
+    unsigned c;
+
+    /* Prefer reusing a socket from a closed channel */
+    for (c = 1; c < VAK_UDP_SOCKETS; c++) {
+        if (!udp->socks[c].open && udp->socks[c].fd != -1)
+            break;
     }
+    if (c == VAK_UDP_SOCKETS) {
+        for (c = 1; c < VAK_UDP_SOCKETS; c++) {
+            if (udp->socks[c].fd == -1)
+                break;
+        }
+        if (c == VAK_UDP_SOCKETS)
+            return -1;
 
-    // TODO support IPv6
+        udp->socks[c].fd = vak_udp_socket(udp);
+        if (udp->socks[c].fd < 0) {
+            fprintf(stderr, "socket failed: %s\n", strerror(errno));
+            return -1;
+        }
+        udp->socks[c].tx_next_id = 0;
 
-    memset(&addr, 0, sizeof(addr));
-    memcpy(&addr.sin_addr.s_addr, he->h_addr_list[0], sizeof(struct in_addr));
+        if (vak_udp_epoll_ctl(udp, EPOLL_CTL_ADD, udp->socks[c].fd, 0, c) < 0) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+            close(udp->socks[c].fd);
+            udp->socks[c].fd = -1;
+            return -1;
+        }
+    }
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    /* The kernel drops datagrams from any other address than the one
+     * the socket is connected to */
+    sslen = vak_udp_to_sockaddr(udp, &ss, addr);
+    if (connect(udp->socks[c].fd, (struct sockaddr *)&ss, sslen) < 0) {
+        fprintf(stderr, "connect failed: %s\n", strerror(errno));
+        return -1;
+    }
 
-    /* Send the request */
-    n = sendto(udp->sockfd, buffer, length, 0,
-               (const struct sockaddr *)&addr, sizeof(addr));
-    if (n != length) {
-        fprintf(stderr, "sendto failed: %s\n", strerror(errno));
+    /* Throw away anything that arrived while the socket was used by
+     * an earlier channel */
+    while (recv(udp->socks[c].fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+        ;
+
+    if (vak_udp_epoll_ctl(udp, EPOLL_CTL_MOD, udp->socks[c].fd, EPOLLIN, c) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
         return -1;
     }
 
-    return 0;
+    udp->socks[c].open = 1;
+
+    return c;
+}
+
+void vak_udp_close_channel(struct vak_udp *udp, int channel)
+{
+    if (channel <= 0 || channel >= VAK_UDP_SOCKETS || !udp->socks[channel].open)
+        return;
+
+    /* Keep the socket for the next channel but stop waking up for
+     * datagrams that arrive until then.  Transmit timestamps are
+     * still reported as errors. */
+    udp->socks[channel].open = 0;
+    vak_udp_epoll_ctl(udp, EPOLL_CTL_MOD, udp->socks[channel].fd, 0, channel);
+}
+
+/* Send datagrams which all go out on the same socket */
+static int vak_udp_send_socket(struct vak_udp *udp, unsigned index,
+                               struct vak_udp_msg *msgs, unsigned count)
+{
+    struct vak_udp_socket *sock = &udp->socks[index];
+    struct mmsghdr hdrs[VAK_UDP_BATCH_MAX];
+    struct iovec iovs[VAK_UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[VAK_UDP_BATCH_MAX];
+    unsigned sent = 0;
+    vak_time_t now;
+
+    while (sent < count) {
+        unsigned i, n = count - sent;
+        int r;
+
+        if (n > VAK_UDP_BATCH_MAX)
+            n = VAK_UDP_BATCH_MAX;
+
+        memset(hdrs, 0, n * sizeof(hdrs[0]));
+        for (i = 0; i < n; i++) {
+            struct vak_udp_msg *msg = &msgs[sent + i];
+
+            iovs[i].iov_base = msg->buffer;
+            iovs[i].iov_len = msg->length;
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+
+            /* Connected sockets already know where to send */
+            if (!index) {
+                hdrs[i].msg_hdr.msg_name = &addrs[i];
+                hdrs[i].msg_hdr.msg_namelen = vak_udp_to_sockaddr(udp, &addrs[i], &msg->addr);
+            }
+        }
+
+        /* Send the requests */
+        now = vak_get_time();
+        r = sendmmsg(sock->fd, hdrs, n, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "sendmmsg failed: %s\n", strerror(errno));
+            return sent ? (int)sent : -1;
+        }
+
+        /* The time read before the call is used unless the kernel
+         * reports a transmit timestamp later. */
+        for (i = 0; i < (unsigned)r; i++) {
+            msgs[sent + i].id = (index << VAK_UDP_ID_SHIFT) | (sock->tx_next_id++ & VAK_UDP_ID_MASK);
+            msgs[sent + i].time = now;
+        }
+
+        sent += r;
+        if ((unsigned)r < n)
+            break;
+    }
+
+    return sent;
+}
+
+int vak_udp_send_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    unsigned sent = 0;
+
+    /* Send runs of datagrams for the same channel together */
+    while (sent < count) {
+        unsigned channel = msgs[sent].channel;
+        unsigned n;
+        int r;
+
+        if (channel >= VAK_UDP_SOCKETS || (channel && !udp->socks[channel].open)) {
+            fprintf(stderr, "send on bad channel %u\n", channel);
+            break;
+        }
+
+        for (n = 1; sent + n < count && msgs[sent + n].channel == channel; n++)
+            ;
+
+        r = vak_udp_send_socket(udp, channel, msgs + sent, n);
+        if (r > 0)
+            sent += r;
+        if (r < 0 || (unsigned)r < n)
+            break;
+    }
+
+    return sent ? (int)sent : (count ? -1 : 0);
 }
 
 int vak_udp_recv(struct vak_udp *udp, void *buffer, unsigned length)
 {
-    fd_set readfds;
-    struct timeval tv;
+    struct vak_udp_msg msg;
     int n;
-    struct sockaddr_in addr;
-    socklen_t addrsize = sizeof(addr);
 
-    FD_ZERO(&readfds);
-    FD_SET(udp->sockfd, &readfds);
+    msg.buffer = buffer;
+    msg.size = length;
 
-    /* Use a tenth of the query timeout for the select call. */
-    tv.tv_sec = 0;
-    tv.tv_usec = 100000;        /* 0.1s */
+    n = vak_udp_recv_batch(udp, &msg, 1);
+    if (n <= 0)
+        return n;
 
-    n = select(udp->sockfd + 1, &readfds, NULL, NULL, &tv);
-    if (n == -1) {
-        if (errno == EINTR)
-            return 0;
-        fprintf(stderr, "select failed: %s\n", strerror(errno));
-        return -1;
-    }
+    return msg.length;
+}
 
-    if (!FD_ISSET(udp->sockfd, &readfds))
-        return 0;
+/* Receive datagrams from one socket */
+static int vak_udp_recv_socket(struct vak_udp *udp, unsigned index,
+                               struct vak_udp_msg *msgs, unsigned count)
+{
+    struct mmsghdr hdrs[VAK_UDP_BATCH_MAX];
+    struct iovec iovs[VAK_UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[VAK_UDP_BATCH_MAX];
+    char controls[VAK_UDP_BATCH_MAX][VAK_UDP_CONTROL_SIZE];
+    vak_time_t now;
+    unsigned i;
+    int n;
+
+    if (count > VAK_UDP_BATCH_MAX)
+        count = VAK_UDP_BATCH_MAX;
+
+    memset(hdrs, 0, count * sizeof(hdrs[0]));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = msgs[i].buffer;
+        iovs[i].iov_len = msgs[i].size;
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        hdrs[i].msg_hdr.msg_control = controls[i];
+        hdrs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
 
-    n = recvfrom(udp->sockfd, buffer, length,
-                 MSG_DONTWAIT /* flags */,
-                 (struct sockaddr *)&addr, &addrsize);
+    n = recvmmsg(udp->socks[index].fd, hdrs, count, MSG_DONTWAIT, NULL);
     if (n < 0) {
-        if (errno == EAGAIN)
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
             return 0;
-        fprintf(stderr, "recv failed: %s\n", strerror(errno));
+        /* Connected sockets report ICMP errors from the peer */
+        if (index && (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH))
+            return 0;
+        fprintf(stderr, "recvmmsg failed: %s\n", strerror(errno));
         return -1;
     }
 
+    now = vak_get_time();
+
+    for (i = 0; i < (unsigned)n; i++) {
+        msgs[i].length = hdrs[i].msg_len;
+        msgs[i].channel = index;
+        vak_udp_from_sockaddr(&msgs[i].addr, &addrs[i]);
+
+        /* Prefer the time the kernel received the datagram, it is not
+         * delayed by scheduling or by waiting for the wakeup. */
+        if (!vak_udp_get_timestamp(&hdrs[i].msg_hdr, &msgs[i].time))
+            msgs[i].time = now;
+    }
+
     return n;
 }
 
+int vak_udp_recv_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    unsigned i, received = 0;
+
+    for (i = 0; i < VAK_UDP_SOCKETS && received < count; i++) {
+        int n;
+
+        if (i && !udp->socks[i].open)
+            continue;
+
+        n = vak_udp_recv_socket(udp, i, msgs + received, count - received);
+        if (n < 0)
+            return received ? (int)received : -1;
+        received += n;
+    }
+
+    return received;
+}
+
+int vak_udp_watch_fd(struct vak_udp *udp, int fd)
+{
+    if (vak_udp_epoll_ctl(udp, EPOLL_CTL_ADD, fd, EPOLLIN, VAK_UDP_WATCHED) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int vak_udp_wait(struct vak_udp *udp, vak_time_t timeout)
+{
+    struct itimerspec its;
+    struct epoll_event events[VAK_UDP_SOCKETS + 1];
+    uint64_t expirations;
+    int readable = 0;
+    int expired = 0;
+    int i, n;
+
+    if (timeout <= 0)
+        return 0;
+
+    /* Arm the timer with the full resolution of the timeout */
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = timeout / 1000000;
+    its.it_value.tv_nsec = (timeout % 1000000) * 1000;
+    if (timerfd_settime(udp->timerfd, 0, &its, NULL) < 0) {
+        fprintf(stderr, "timerfd_settime failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    while (!readable && !expired) {
+        n = epoll_wait(udp->epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                break;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            unsigned index = events[i].data.u32;
+
+            if (index == VAK_UDP_TIMER) {
+                expired = 1;
+            } else if (index == VAK_UDP_WATCHED) {
+                readable = 1;
+            } else if (index < VAK_UDP_SOCKETS) {
+                /* Transmit timestamps on the error queue will keep
+                 * waking up epoll until they have been read */
+                if (events[i].events & EPOLLERR) {
+                    int err;
+                    socklen_t errlen = sizeof(err);
+
+                    vak_udp_read_errqueue(udp, index);
+
+                    /* ICMP errors on a connected socket are not on
+                     * the error queue, reading them clears them */
+                    getsockopt(udp->socks[index].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                }
+                if (events[i].events & EPOLLIN)
+                    readable = 1;
+            }
+        }
+    }
+
+    /* Disarm the timer and drain any expiration so that it does not
+     * wake up the next wait. */
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(udp->timerfd, 0, &its, NULL);
+    if (read(udp->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "read timerfd failed: %s\n", strerror(errno));
+
+    return readable;
+}
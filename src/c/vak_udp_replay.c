@@ -0,0 +1,657 @@
+/* Record and replay backend for Linux.
+ *
+ * Link this instead of vak_udp_linux.c, vak_time_linux.c and
+ * vak_random_linux.c.  Without any of the environment variables below
+ * it behaves exactly like them.
+ *
+ * With VAK_RECORD=file everything that comes from outside the program
+ * is written to the file: the times read from the clocks, the seed
+ * and the nonces, the addresses that were looked up and every
+ * datagram that was sent or received, with the return values.
+ *
+ * With VAK_REPLAY=file nothing is sent, the clock is never set, and
+ * each call gets what the same call got when the file was recorded,
+ * so the program makes the same decisions and verifies the same
+ * responses with the same nonces.  vak_udp_wait returns at once, the
+ * time jumps to the next recorded reading, so a replay only takes as
+ * long as the computation.  A replay has to run the same program
+ * with the same servers and cache as the recording.  If it asks for
+ * something else, or for more than was recorded, an error is printed
+ * and all later calls fail. */
+
+/* The real functions keep their code but get other names, so that
+ * the functions below can take their names and call them */
+#define vak_udp_new vak_real_udp_new
+#define vak_udp_del vak_real_udp_del
+#define vak_udp_send vak_real_udp_send
+#define vak_udp_resolve vak_real_udp_resolve
+#define vak_udp_resolve_many vak_real_udp_resolve_many
+#define vak_udp_open_channel vak_real_udp_open_channel
+#define vak_udp_close_channel vak_real_udp_close_channel
+#define vak_udp_send_batch vak_real_udp_send_batch
+#define vak_udp_recv_batch vak_real_udp_recv_batch
+#define vak_udp_recv vak_real_udp_recv
+#define vak_udp_wait vak_real_udp_wait
+#define vak_udp_watch_fd vak_real_udp_watch_fd
+#define vak_udp_tx_time vak_real_udp_tx_time
+#define vak_get_time vak_real_get_time
+#define vak_get_monotonic vak_real_get_monotonic
+#define vak_get_clock_sample vak_real_get_clock_sample
+#define vak_adjust_time vak_real_adjust_time
+#define vak_seed_random vak_real_seed_random
+#define vak_get_nonce vak_real_get_nonce
+
+#include "vak_udp_linux.c"
+#include "vak_time_linux.c"
+#include "vak_random_linux.c"
+
+#undef vak_udp_new
+#undef vak_udp_del
+#undef vak_udp_send
+#undef vak_udp_resolve
+#undef vak_udp_resolve_many
+#undef vak_udp_open_channel
+#undef vak_udp_close_channel
+#undef vak_udp_send_batch
+#undef vak_udp_recv_batch
+#undef vak_udp_recv
+#undef vak_udp_wait
+#undef vak_udp_watch_fd
+#undef vak_udp_tx_time
+#undef vak_get_time
+#undef vak_get_monotonic
+#undef vak_get_clock_sample
+#undef vak_adjust_time
+#undef vak_seed_random
+#undef vak_get_nonce
+
+/* Magic number and version at the start of a recording, "VAKP" */
+#define VAK_REPLAY_MAGIC 0x504b4156
+#define VAK_REPLAY_VERSION 1
+
+enum {
+    VAK_REPLAY_OFF,
+    VAK_REPLAY_RECORD,
+    VAK_REPLAY_PLAY,
+};
+
+/* The types of events, one for each call */
+enum {
+    VAK_REPLAY_TIME,
+    VAK_REPLAY_MONOTONIC,
+    VAK_REPLAY_CLOCK_SAMPLE,
+    VAK_REPLAY_ADJUST_TIME,
+    VAK_REPLAY_SEED,
+    VAK_REPLAY_NONCE,
+    VAK_REPLAY_RESOLVE,
+    VAK_REPLAY_RESOLVE_MANY,
+    VAK_REPLAY_OPEN_CHANNEL,
+    VAK_REPLAY_SEND,
+    VAK_REPLAY_SEND_BATCH,
+    VAK_REPLAY_RECV,
+    VAK_REPLAY_RECV_BATCH,
+    VAK_REPLAY_WAIT,
+    VAK_REPLAY_WATCH_FD,
+    VAK_REPLAY_TX_TIME,
+};
+
+static const char *const vak_replay_names[] = {
+    "vak_get_time",
+    "vak_get_monotonic",
+    "vak_get_clock_sample",
+    "vak_adjust_time",
+    "vak_seed_random",
+    "vak_get_nonce",
+    "vak_udp_resolve",
+    "vak_udp_resolve_many",
+    "vak_udp_open_channel",
+    "vak_udp_send",
+    "vak_udp_send_batch",
+    "vak_udp_recv",
+    "vak_udp_recv_batch",
+    "vak_udp_wait",
+    "vak_udp_watch_fd",
+    "vak_udp_tx_time",
+};
+
+/* A recording is the header followed by events, each is this
+ * followed by length bytes of data, in the byte order of the host */
+struct vak_replay_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct vak_replay_event {
+    uint32_t type;
+    uint32_t length;
+
+    /* The return value or the time */
+    int64_t value;
+};
+
+/* A datagram in the data of a send or receive, followed by the
+ * datagram itself */
+struct vak_replay_msg {
+    struct vak_addr addr;
+    int64_t time;
+    uint32_t id;
+    uint32_t channel;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+static struct {
+    int mode;
+    FILE *f;
+
+    /* Set when a replay has gone wrong, all later calls fail */
+    int failed;
+
+    /* Data of the last event read */
+    uint8_t *data;
+    unsigned size;
+
+    /* The last times handed out, the clocks stop here if a replay
+     * fails */
+    vak_time_t time;
+    vak_time_t monotonic;
+} vak_replay;
+
+static void vak_replay_init(void)
+{
+    struct vak_replay_header header;
+    static int done;
+    const char *path;
+
+    if (done)
+        return;
+    done = 1;
+
+    if ((path = getenv("VAK_REPLAY")) != NULL) {
+        /* Never fall back to the network, a replay which can not be
+         * started fails */
+        vak_replay.mode = VAK_REPLAY_PLAY;
+        vak_replay.f = fopen(path, "rb");
+        if (!vak_replay.f) {
+            fprintf(stderr, "replay %s failed: %s\n", path, strerror(errno));
+            vak_replay.failed = 1;
+        } else if (fread(&header, sizeof(header), 1, vak_replay.f) != 1 ||
+                   header.magic != VAK_REPLAY_MAGIC ||
+                   header.version != VAK_REPLAY_VERSION) {
+            fprintf(stderr, "%s is not a version %u recording\n", path, VAK_REPLAY_VERSION);
+            vak_replay.failed = 1;
+        }
+    } else if ((path = getenv("VAK_RECORD")) != NULL) {
+        vak_replay.f = fopen(path, "wb");
+        if (!vak_replay.f) {
+            fprintf(stderr, "record %s failed: %s\n", path, strerror(errno));
+            return;
+        }
+
+        header.magic = VAK_REPLAY_MAGIC;
+        header.version = VAK_REPLAY_VERSION;
+        fwrite(&header, sizeof(header), 1, vak_replay.f);
+        vak_replay.mode = VAK_REPLAY_RECORD;
+    }
+}
+
+static int vak_replay_playing(void)
+{
+    vak_replay_init();
+
+    return vak_replay.mode == VAK_REPLAY_PLAY;
+}
+
+/* Write an event with data in one or two parts */
+static void vak_replay_record(unsigned type, int64_t value,
+                              const void *data, unsigned length,
+                              const void *data2, unsigned length2)
+{
+    struct vak_replay_event event;
+
+    if (vak_replay.mode != VAK_REPLAY_RECORD)
+        return;
+
+    event.type = type;
+    event.length = length + length2;
+    event.value = value;
+
+    if (fwrite(&event, sizeof(event), 1, vak_replay.f) != 1 ||
+        (length && fwrite(data, length, 1, vak_replay.f) != 1) ||
+        (length2 && fwrite(data2, length2, 1, vak_replay.f) != 1)) {
+        fprintf(stderr, "write recording failed: %s\n", strerror(errno));
+        vak_replay.mode = VAK_REPLAY_OFF;
+    }
+}
+
+static void vak_replay_fail(const char *fmt, const char *name)
+{
+    if (!vak_replay.failed)
+        fprintf(stderr, fmt, name);
+    vak_replay.failed = 1;
+}
+
+/* Read the next event, which must be for the call that is being
+ * replayed.  Returns the data, or NULL if the replay has failed */
+static const uint8_t *vak_replay_next(unsigned type, int64_t *value, unsigned *length)
+{
+    struct vak_replay_event event;
+
+    if (vak_replay.failed)
+        return NULL;
+
+    if (fread(&event, sizeof(event), 1, vak_replay.f) != 1) {
+        vak_replay_fail("replay ended at %s\n", vak_replay_names[type]);
+        return NULL;
+    }
+
+    if (event.type != type) {
+        vak_replay_fail("replay diverged at %s\n", vak_replay_names[type]);
+        return NULL;
+    }
+
+    /* Events without data get a pointer too */
+    if (event.length > vak_replay.size || !vak_replay.data) {
+        uint8_t *p = realloc(vak_replay.data, event.length ? event.length : 1);
+        if (!p) {
+            vak_replay_fail("malloc replay data failed at %s\n", vak_replay_names[type]);
+            return NULL;
+        }
+        vak_replay.data = p;
+        vak_replay.size = event.length;
+    }
+
+    if (event.length && fread(vak_replay.data, event.length, 1, vak_replay.f) != 1) {
+        vak_replay_fail("replay ended at %s\n", vak_replay_names[type]);
+        return NULL;
+    }
+
+    *value = event.value;
+    if (length)
+        *length = event.length;
+
+    return vak_replay.data;
+}
+
+/* Replay a call which only returns a value */
+static int64_t vak_replay_value(unsigned type, int64_t error)
+{
+    int64_t value;
+
+    return vak_replay_next(type, &value, NULL) ? value : error;
+}
+
+vak_time_t vak_get_time(void)
+{
+    vak_time_t t;
+
+    if (vak_replay_playing())
+        return vak_replay.time = vak_replay_value(VAK_REPLAY_TIME, vak_replay.time);
+
+    t = vak_real_get_time();
+    vak_replay_record(VAK_REPLAY_TIME, t, NULL, 0, NULL, 0);
+
+    return t;
+}
+
+vak_time_t vak_get_monotonic(void)
+{
+    vak_time_t t;
+
+    if (vak_replay_playing())
+        return vak_replay.monotonic = vak_replay_value(VAK_REPLAY_MONOTONIC, vak_replay.monotonic);
+
+    t = vak_real_get_monotonic();
+    vak_replay_record(VAK_REPLAY_MONOTONIC, t, NULL, 0, NULL, 0);
+
+    return t;
+}
+
+void vak_get_clock_sample(struct vak_clock_sample *sample)
+{
+    const uint8_t *data;
+    unsigned length;
+    int64_t value;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_CLOCK_SAMPLE, &value, &length);
+        if (data && length == sizeof(*sample)) {
+            memcpy(sample, data, sizeof(*sample));
+            vak_replay.time = sample->realtime;
+            vak_replay.monotonic = sample->monotonic;
+        } else {
+            sample->realtime = vak_replay.time;
+            sample->monotonic = vak_replay.monotonic;
+        }
+        return;
+    }
+
+    vak_real_get_clock_sample(sample);
+    vak_replay_record(VAK_REPLAY_CLOCK_SAMPLE, 0, sample, sizeof(*sample), NULL, 0);
+}
+
+int vak_adjust_time(vak_time_t adj)
+{
+    int r;
+
+    /* Only pretend, replays run on machines with their own time */
+    if (vak_replay_playing())
+        return vak_replay_value(VAK_REPLAY_ADJUST_TIME, -1);
+
+    r = vak_real_adjust_time(adj);
+    vak_replay_record(VAK_REPLAY_ADJUST_TIME, r, NULL, 0, NULL, 0);
+
+    return r;
+}
+
+int vak_seed_random(void)
+{
+    unsigned seed;
+    int64_t value;
+
+    if (vak_replay_playing()) {
+        value = vak_replay_value(VAK_REPLAY_SEED, -1);
+        if (value < 0)
+            return -1;
+        srandom(value);
+        return 0;
+    }
+
+    if (vak_replay.mode != VAK_REPLAY_RECORD)
+        return vak_real_seed_random();
+
+    /* The same as vak_real_seed_random but the seed is kept */
+    if (getentropy(&seed, sizeof(seed)) < 0)
+        return -1;
+    srandom(seed);
+    vak_replay_record(VAK_REPLAY_SEED, seed, NULL, 0, NULL, 0);
+
+    return 0;
+}
+
+int vak_get_nonce(void *nonce, unsigned size)
+{
+    const uint8_t *data;
+    unsigned length;
+    int64_t value;
+    int r;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_NONCE, &value, &length);
+        if (!data)
+            return -1;
+        if (value == 0 && length != size) {
+            vak_replay_fail("replay diverged at %s\n", vak_replay_names[VAK_REPLAY_NONCE]);
+            return -1;
+        }
+        memcpy(nonce, data, length);
+        return value;
+    }
+
+    r = vak_real_get_nonce(nonce, size);
+    vak_replay_record(VAK_REPLAY_NONCE, r, nonce, r == 0 ? size : 0, NULL, 0);
+
+    return r;
+}
+
+struct vak_udp *vak_udp_new(void)
+{
+    /* The sockets are created in a replay too but never used */
+    vak_replay_init();
+
+    return vak_real_udp_new();
+}
+
+void vak_udp_del(struct vak_udp *udp)
+{
+    vak_real_udp_del(udp);
+}
+
+int vak_udp_resolve(const char *host, unsigned port, struct vak_addr *addr)
+{
+    const uint8_t *data;
+    unsigned length;
+    int64_t value;
+    int r;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_RESOLVE, &value, &length);
+        if (!data)
+            return -1;
+        memcpy(addr, data, length < sizeof(*addr) ? length : sizeof(*addr));
+        return value;
+    }
+
+    r = vak_real_udp_resolve(host, port, addr);
+    vak_replay_record(VAK_REPLAY_RESOLVE, r, addr, r == 0 ? sizeof(*addr) : 0, NULL, 0);
+
+    return r;
+}
+
+int vak_udp_resolve_many(const char *const *hosts, const unsigned *ports,
+                         struct vak_addr *addrs, unsigned count)
+{
+    unsigned size = count * VAK_MAX_ADDRS * sizeof(*addrs);
+    const uint8_t *data;
+    unsigned length;
+    int64_t value;
+    int r;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_RESOLVE_MANY, &value, &length);
+        if (!data)
+            return -1;
+        if (length != size) {
+            vak_replay_fail("replay diverged at %s\n", vak_replay_names[VAK_REPLAY_RESOLVE_MANY]);
+            return -1;
+        }
+        memcpy(addrs, data, size);
+        return value;
+    }
+
+    r = vak_real_udp_resolve_many(hosts, ports, addrs, count);
+    vak_replay_record(VAK_REPLAY_RESOLVE_MANY, r, addrs, size, NULL, 0);
+
+    return r;
+}
+
+int vak_udp_open_channel(struct vak_udp *udp, const struct vak_addr *addr)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_value(VAK_REPLAY_OPEN_CHANNEL, -1);
+
+    r = vak_real_udp_open_channel(udp, addr);
+    vak_replay_record(VAK_REPLAY_OPEN_CHANNEL, r, NULL, 0, NULL, 0);
+
+    return r;
+}
+
+void vak_udp_close_channel(struct vak_udp *udp, int channel)
+{
+    if (!vak_replay_playing())
+        vak_real_udp_close_channel(udp, channel);
+}
+
+int vak_udp_send(struct vak_udp *udp, const char *host, unsigned port, const void *buffer, unsigned length)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_value(VAK_REPLAY_SEND, -1);
+
+    r = vak_real_udp_send(udp, host, port, buffer, length);
+    vak_replay_record(VAK_REPLAY_SEND, r, buffer, length, NULL, 0);
+
+    return r;
+}
+
+/* The datagrams in the data of a send or receive event */
+static void vak_replay_record_msgs(unsigned type, int r,
+                                   const struct vak_udp_msg *msgs)
+{
+    struct vak_replay_msg rmsg;
+    unsigned i;
+
+    if (vak_replay.mode != VAK_REPLAY_RECORD)
+        return;
+
+    vak_replay_record(type, r, NULL, 0, NULL, 0);
+
+    for (i = 0; r > 0 && i < (unsigned)r; i++) {
+        memset(&rmsg, 0, sizeof(rmsg));
+        rmsg.addr = msgs[i].addr;
+        rmsg.time = msgs[i].time;
+        rmsg.id = msgs[i].id;
+        rmsg.channel = msgs[i].channel;
+        rmsg.length = msgs[i].length;
+
+        /* Each datagram is an event of its own so that they do not
+         * have to be put together in a buffer first */
+        vak_replay_record(type, i, &rmsg, sizeof(rmsg), msgs[i].buffer, msgs[i].length);
+    }
+}
+
+/* Read the datagrams of a send or receive, if check is set they must
+ * be the ones in msgs, otherwise they are copied to msgs */
+static int vak_replay_msgs(unsigned type, struct vak_udp_msg *msgs,
+                           unsigned count, int check)
+{
+    const struct vak_replay_msg *rmsg;
+    const uint8_t *data;
+    unsigned length, i;
+    int64_t value, r;
+
+    if (!vak_replay_next(type, &r, NULL))
+        return -1;
+
+    for (i = 0; r > 0 && i < (unsigned)r; i++) {
+        data = vak_replay_next(type, &value, &length);
+        if (!data)
+            return -1;
+
+        rmsg = (const struct vak_replay_msg *)data;
+        if (i >= count || length < sizeof(*rmsg) || length - sizeof(*rmsg) != rmsg->length ||
+            (check && (msgs[i].length != rmsg->length ||
+                       memcmp(msgs[i].buffer, rmsg + 1, rmsg->length))) ||
+            (!check && msgs[i].size < rmsg->length)) {
+            vak_replay_fail("replay diverged at %s\n", vak_replay_names[type]);
+            return -1;
+        }
+
+        if (!check) {
+            msgs[i].addr = rmsg->addr;
+            msgs[i].channel = rmsg->channel;
+            msgs[i].length = rmsg->length;
+            memcpy(msgs[i].buffer, rmsg + 1, rmsg->length);
+        }
+        msgs[i].time = rmsg->time;
+        msgs[i].id = rmsg->id;
+    }
+
+    return r;
+}
+
+int vak_udp_send_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_msgs(VAK_REPLAY_SEND_BATCH, msgs, count, 1);
+
+    r = vak_real_udp_send_batch(udp, msgs, count);
+    vak_replay_record_msgs(VAK_REPLAY_SEND_BATCH, r, msgs);
+
+    return r;
+}
+
+int vak_udp_recv_batch(struct vak_udp *udp, struct vak_udp_msg *msgs, unsigned count)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_msgs(VAK_REPLAY_RECV_BATCH, msgs, count, 0);
+
+    r = vak_real_udp_recv_batch(udp, msgs, count);
+    vak_replay_record_msgs(VAK_REPLAY_RECV_BATCH, r, msgs);
+
+    return r;
+}
+
+int vak_udp_recv(struct vak_udp *udp, void *buffer, unsigned length)
+{
+    const uint8_t *data;
+    unsigned len;
+    int64_t value;
+    int r;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_RECV, &value, &len);
+        if (!data)
+            return -1;
+        if (len > length) {
+            vak_replay_fail("replay diverged at %s\n", vak_replay_names[VAK_REPLAY_RECV]);
+            return -1;
+        }
+        memcpy(buffer, data, len);
+        return value;
+    }
+
+    r = vak_real_udp_recv(udp, buffer, length);
+    vak_replay_record(VAK_REPLAY_RECV, r, buffer, r > 0 ? r : 0, NULL, 0);
+
+    return r;
+}
+
+int vak_udp_watch_fd(struct vak_udp *udp, int fd)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_value(VAK_REPLAY_WATCH_FD, -1);
+
+    r = vak_real_udp_watch_fd(udp, fd);
+    vak_replay_record(VAK_REPLAY_WATCH_FD, r, NULL, 0, NULL, 0);
+
+    return r;
+}
+
+int vak_udp_wait(struct vak_udp *udp, vak_time_t timeout)
+{
+    int r;
+
+    if (vak_replay_playing())
+        return vak_replay_value(VAK_REPLAY_WAIT, -1);
+
+    /* Everything up to now is in the file if the program is killed
+     * while it waits */
+    if (vak_replay.mode == VAK_REPLAY_RECORD)
+        fflush(vak_replay.f);
+
+    r = vak_real_udp_wait(udp, timeout);
+    vak_replay_record(VAK_REPLAY_WAIT, r, NULL, 0, NULL, 0);
+
+    return r;
+}
+
+int vak_udp_tx_time(struct vak_udp *udp, unsigned id, vak_time_t *time)
+{
+    const uint8_t *data;
+    unsigned length;
+    int64_t value;
+    int r;
+
+    if (vak_replay_playing()) {
+        data = vak_replay_next(VAK_REPLAY_TX_TIME, &value, &length);
+        if (!data || !value || length != sizeof(*time))
+            return 0;
+        memcpy(time, data, sizeof(*time));
+        return value;
+    }
+
+    r = vak_real_udp_tx_time(udp, id, time);
+    vak_replay_record(VAK_REPLAY_TX_TIME, r, time, r ? sizeof(*time) : 0, NULL, 0);
+
+    return r;
+}
@@ -72,9 +72,11 @@ static void vrt_query_init(struct vrt_builder *builder, uint8_t *buffer,
     builder->offset = 0;
 }
 
-static void vrt_query_add_tag(struct vrt_builder *builder, uint32_t tag,
-                              const void *data, unsigned size)
+static uint8_t *vrt_query_reserve_tag(struct vrt_builder *builder, uint32_t tag,
+                                      unsigned size)
 {
+    uint8_t *ptr;
+
     assert(builder->current_tag <= builder->num_tags);
     assert((size & 3) == 0);
     assert(builder->data_ptr + size <= builder->buffer + builder->max_size);
@@ -88,10 +90,21 @@ static void vrt_query_add_tag(struct vrt_builder *builder, uint32_t tag,
 
     vrt_put_uint32(&builder->tag_ptr[builder->current_tag], tag);
 
-    memcpy(builder->data_ptr + builder->offset, data, size);
+    ptr = builder->data_ptr + builder->offset;
 
     builder->current_tag++;
     builder->offset += size;
+
+    return ptr;
+}
+
+static void vrt_query_add_tag(struct vrt_builder *builder, uint32_t tag,
+                              const void *data, unsigned size)
+{
+    uint8_t *ptr = vrt_query_reserve_tag(builder, tag, size);
+
+    if (size)
+        memcpy(ptr, data, size);
 }
 
 static void vrt_query_finish(struct vrt_builder *builder)
@@ -102,9 +115,9 @@ static void vrt_query_finish(struct vrt_builder *builder)
 }
 
 
-int vrt_make_query(uint8_t *buffer, unsigned buffer_size,
-                   uint8_t *nonce, unsigned nonce_len,
-                   unsigned variant)
+int vrt_make_query_template(uint8_t *buffer, unsigned buffer_size,
+                            unsigned variant,
+                            unsigned *nonce_offset, unsigned *nonce_len)
 {
     struct vrt_builder builder;
 
@@ -117,18 +130,16 @@ int vrt_make_query(uint8_t *buffer, unsigned buffer_size,
         builder.max_size = VRT_QUERY_PACKET_LEN;
         vrt_query_init(&builder, buffer, 3, variant);
         vrt_query_add_tag(&builder, VRT_TAG_VER, &ver, sizeof(ver));
-        if (nonce_len < 32)
-            return -1;
-        vrt_query_add_tag(&builder, VRT_TAG_NONC, nonce, 32);
+        *nonce_len = 32;
+        *nonce_offset = vrt_query_reserve_tag(&builder, VRT_TAG_NONC, 32) - buffer;
         vrt_query_add_tag(&builder, VRT_TAG_PAD, NULL, 0);
     } else {
         if (buffer_size < VRT_QUERY_LEN)
             return -1;
         builder.max_size = VRT_QUERY_LEN;
         vrt_query_init(&builder, buffer, 2, variant);
-        if (nonce_len < 64)
-            return -1;
-        vrt_query_add_tag(&builder, VRT_TAG_NONC, nonce, 64);
+        *nonce_len = 64;
+        *nonce_offset = vrt_query_reserve_tag(&builder, VRT_TAG_NONC, 64) - buffer;
         vrt_query_add_tag(&builder, VRT_TAG_PAD, NULL, 0);
     }
     vrt_query_finish(&builder);
@@ -136,6 +147,26 @@ int vrt_make_query(uint8_t *buffer, unsigned buffer_size,
     return builder.max_size;
 }
 
+int vrt_make_query(uint8_t *buffer, unsigned buffer_size,
+                   uint8_t *nonce, unsigned nonce_len,
+                   unsigned variant)
+{
+    unsigned nonce_offset, wanted_len;
+    int length;
+
+    length = vrt_make_query_template(buffer, buffer_size, variant,
+                                     &nonce_offset, &wanted_len);
+    if (length < 0)
+        return -1;
+
+    if (nonce_len < wanted_len)
+        return -1;
+
+    memcpy(buffer + nonce_offset, nonce, wanted_len);
+
+    return length;
+}
+
 #define CHECK(x)                                                        \
     do {                                                                \
         int ret;                                                        \
@@ -403,11 +434,110 @@ static vrt_ret_t vrt_verify_bounds(vrt_blob_t *srep, vrt_blob_t *dele,
     return VRT_ERROR_BOUNDS;
 }
 
+/* Strip the ROUGHTIM packet header used by variant 5 or later */
+static vrt_ret_t vrt_unwrap_packet(uint32_t **reply, uint32_t *reply_len,
+                                   unsigned variant, int verbose) {
+    if (variant >= 5) {
+        if (*reply_len < 12) {
+            if (verbose)
+                fprintf(stderr, "too short reply\n");
+            return VRT_ERROR_WRONG_SIZE;
+        }
+        if (memcmp("ROUGHTIM", *reply, 8)) {
+            if (verbose)
+                fprintf(stderr, "bad ROUGHTIM magic\n");
+            return VRT_ERROR_MALFORMED;
+        }
+        if (*reply_len - 12 < *(*reply+2)) {
+            if (verbose)
+                fprintf(stderr, "bad length, expected %u, got %u\n",
+                        *reply_len - 12,
+                        (int)*(*reply+2));
+            return VRT_ERROR_MALFORMED;
+        }
+        *reply += 3;
+        *reply_len -= 12;
+    }
+
+    return VRT_SUCCESS;
+}
+
+vrt_ret_t vrt_precheck_response(uint8_t *nonce_sent, uint32_t nonce_len,
+                                uint32_t *reply, uint32_t reply_len,
+                                unsigned variant) {
+    vrt_blob_t parent;
+    vrt_blob_t nonc = {0};
+    vrt_blob_t srep = {0};
+    vrt_blob_t indx = {0};
+    vrt_blob_t path = {0};
+    const uint32_t used_len = variant >= 5 ? VRT_NODESIZE_ALTERNATE : VRT_NONCE_SIZE;
+    vrt_ret_t ret;
+
+    /* This is meant to throw away junk quickly, so don't use CHECK
+     * which logs every failure */
+    if (nonce_len < VRT_NONCE_SIZE)
+        return VRT_ERROR_WRONG_SIZE;
+    if ((ret = vrt_unwrap_packet(&reply, &reply_len, variant, 0)) != VRT_SUCCESS)
+        return ret;
+    if ((ret = vrt_blob_init(&parent, reply, reply_len)) != VRT_SUCCESS)
+        return ret;
+
+    /* Later drafts echo the nonce, which is the cheapest check */
+    if (vrt_get_tag(&nonc, &parent, VRT_TAG_NONC) == VRT_SUCCESS) {
+        if (nonc.size != used_len)
+            return VRT_ERROR_WRONG_SIZE;
+        return memcmp(nonc.data, nonce_sent, used_len) == 0 ? VRT_SUCCESS
+            : VRT_ERROR_TREE;
+    }
+
+    /* Otherwise the nonce has to be hashed up to the Merkle root */
+    if ((ret = vrt_get_tag(&srep, &parent, VRT_TAG_SREP)) != VRT_SUCCESS ||
+        (ret = vrt_get_tag(&indx, &parent, VRT_TAG_INDX)) != VRT_SUCCESS ||
+        (ret = vrt_get_tag(&path, &parent, VRT_TAG_PATH)) != VRT_SUCCESS)
+        return ret;
+
+    return vrt_verify_nonce(&srep, &indx, &path, nonce_sent, variant);
+}
+
+vrt_ret_t vrt_verify_cert_cache(const uint8_t *cert_cache, const uint8_t *pk,
+                                unsigned variant) {
+    uint32_t sig[CERT_SIG_SIZE / 4];
+    uint32_t dele[CERT_DELE_SIZE / 4];
+    vrt_blob_t cert_sig = { sig, sizeof(sig) };
+    vrt_blob_t cert_dele = { dele, sizeof(dele) };
+
+    memcpy(sig, cert_cache, CERT_SIG_SIZE);
+    memcpy(dele, cert_cache + CERT_SIG_SIZE, CERT_DELE_SIZE);
+
+    return vrt_verify_dele(&cert_sig, &cert_dele, pk, variant);
+}
+
+/* Check if a delegation is the same as one that has already been
+ * verified */
+static int vrt_cert_cached(const uint8_t *cert_cache,
+                           vrt_blob_t *cert_sig, vrt_blob_t *cert_dele) {
+    return (cert_cache &&
+            cert_sig->size == CERT_SIG_SIZE &&
+            cert_dele->size == CERT_DELE_SIZE &&
+            !memcmp(cert_cache, cert_sig->data, CERT_SIG_SIZE) &&
+            !memcmp(cert_cache + CERT_SIG_SIZE, cert_dele->data, CERT_DELE_SIZE));
+}
+
 vrt_ret_t vrt_parse_response(uint8_t *nonce_sent, uint32_t nonce_len,
                              uint32_t *reply, uint32_t reply_len,
                              const uint8_t *pk,
                              uint64_t *out_midpoint, uint32_t *out_radii,
                              unsigned variant) {
+    return vrt_parse_response_cached(nonce_sent, nonce_len, reply, reply_len,
+                                     pk, out_midpoint, out_radii, variant,
+                                     NULL);
+}
+
+vrt_ret_t vrt_parse_response_cached(uint8_t *nonce_sent, uint32_t nonce_len,
+                                    uint32_t *reply, uint32_t reply_len,
+                                    const uint8_t *pk,
+                                    uint64_t *out_midpoint, uint32_t *out_radii,
+                                    unsigned variant, uint8_t *cert_cache) {
     vrt_blob_t parent;
     vrt_blob_t cert = {0};
     vrt_blob_t cert_sig = {0};
@@ -418,24 +548,7 @@ vrt_ret_t vrt_parse_response(uint8_t *nonce_sent, uint32_t nonce_len,
     vrt_blob_t indx = {0};
     vrt_blob_t path = {0};
 
-    if (variant >= 5) {
-        if (reply_len < 12) {
-            fprintf(stderr, "too short reply\n");
-            return VRT_ERROR_WRONG_SIZE;
-        }
-        if (memcmp("ROUGHTIM", reply, 8)) {
-            fprintf(stderr, "bad ROUGHTIM magic\n");
-            return VRT_ERROR_MALFORMED;
-        }
-        if (reply_len - 12 < *(reply+2)) {
-            fprintf(stderr, "bad length, expected %u, got %u\n",
-                    reply_len - 12,
-                    (int)*(uint32_t *)(reply+8));
-            return VRT_ERROR_MALFORMED;
-        }
-        reply += 3;
-        reply_len -= 12;
-    }
+    CHECK(vrt_unwrap_packet(&reply, &reply_len, variant, 1));
 
     CHECK_TRUE(nonce_len >= VRT_NONCE_SIZE, VRT_ERROR_WRONG_SIZE);
     CHECK(vrt_blob_init(&parent, reply, reply_len));
@@ -450,11 +563,19 @@ vrt_ret_t vrt_parse_response(uint8_t *nonce_sent, uint32_t nonce_len,
 
     CHECK_TRUE(pubk.size == 32, VRT_ERROR_MALFORMED);
 
-    /* TODO verify that nonce in response matches nonce_sent before
-     * trying to hash and check signature */
-
-    CHECK(vrt_verify_dele(&cert_sig, &cert_dele, pk, variant));
+    /* Check that the response is for our nonce before doing any of
+     * the expensive signature checks */
     CHECK(vrt_verify_nonce(&srep, &indx, &path, nonce_sent, variant));
+    /* The delegation changes rarely, don't verify the signature of
+     * one we have already verified again.  The bounds of the
+     * delegation are still checked below. */
+    if (!vrt_cert_cached(cert_cache, &cert_sig, &cert_dele)) {
+        CHECK(vrt_verify_dele(&cert_sig, &cert_dele, pk, variant));
+        if (cert_cache) {
+            memcpy(cert_cache, cert_sig.data, CERT_SIG_SIZE);
+            memcpy(cert_cache + CERT_SIG_SIZE, cert_dele.data, CERT_DELE_SIZE);
+        }
+    }
     CHECK(vrt_verify_bounds(&srep, &cert_dele, out_midpoint, out_radii));
     CHECK(vrt_verify_pubk(&sig, &srep, pubk.data, variant));
 
@@ -84,6 +84,9 @@ static const char CONTEXT_RESP[] = "RoughTime v1 response signature\x00";
 #define VRT_DOMAIN_LABEL_LEAF (0x00)
 #define VRT_DOMAIN_LABEL_NODE (0x01)
 
+/* Size of a verified delegation for vrt_parse_response_cached */
+#define VRT_CERT_CACHE_SIZE (CERT_SIG_SIZE + CERT_DELE_SIZE)
+
 #define VRT_QUERY_LEN 1024
 #define VRT_QUERY_PACKET_LEN (12+VRT_QUERY_LEN)
 
@@ -114,6 +117,47 @@ int vrt_make_query(uint8_t *buffer, unsigned buffer_size,
                    uint8_t *nonce, unsigned nonce_len,
                    unsigned variant);
 
+/** Make a roughtime query template
+ *
+ * \param buffer pointer to a buffer where the template will be written
+ * \param buffer_size size of the buffer
+ * \param variant protocol variant (i.e. the roughtime draft number)
+ * \param nonce_offset pointer to where the offset of the nonce in the query should be written
+ * \param nonce_len pointer to where the number of nonce bytes used by the variant should be written
+ * \returns the length of the query or -1 on failure
+ *
+ * Everything in a query except for the nonce is the same for all
+ * queries of a protocol variant.  This function builds a query with
+ * an all-zero nonce once, after which a new query only needs the
+ * nonce to be copied to buffer + *nonce_offset.  See vrt_make_query
+ * for the size requirements of the buffer.
+ *
+ * All variants 5 or later produce identical templates.
+ */
+int vrt_make_query_template(uint8_t *buffer, unsigned buffer_size,
+                            unsigned variant,
+                            unsigned *nonce_offset, unsigned *nonce_len);
+
+/** Quickly check if a response could be for a query
+ *
+ * \param nonce_sent pointer to the nonce transmitted in the query
+ * \param nonce_len length of the nonce sent, see vrt_parse_response
+ * \param reply pointer to buffer with response
+ * \param reply_len length of response
+ * \param variant protocol variant (i.e. the roughtime draft number)
+ * \returns VRT_SUCCESS if the response is for the nonce
+ *
+ * Only the framing and the nonce are checked, not any signatures, so
+ * this is a lot cheaper than vrt_parse_response and can be used to
+ * throw away stray or spoofed packets.  If the response echoes the
+ * nonce in a NONC tag it is compared directly, otherwise it is
+ * hashed up to the Merkle tree root.  A response which passes must
+ * still be verified with vrt_parse_response.
+ */
+vrt_ret_t vrt_precheck_response(uint8_t *nonce_sent, uint32_t nonce_len,
+                                uint32_t *reply, uint32_t reply_len,
+                                unsigned variant);
+
 /** Parse a roughtime query response
  *
  * \param nonce_sent pointer to the nonce transmitted in the query
@@ -129,6 +173,42 @@ vrt_ret_t vrt_parse_response(uint8_t *nonce_sent, uint32_t nonce_len,
                              uint32_t *reply, uint32_t reply_len, const uint8_t *pk,
                              uint64_t *out_midpoint, uint32_t *out_radii, unsigned variant);
 
+/** Parse a roughtime query response, remembering the delegation
+ *
+ * \param cert_cache pointer to VRT_CERT_CACHE_SIZE bytes holding the
+ * signature and delegation from the last verified response from the
+ * same server, all zeroes if there is none, or NULL
+ *
+ * The other parameters are the same as for vrt_parse_response.
+ *
+ * A server uses the same delegation for many responses.  If the
+ * delegation in the response is identical to the one in cert_cache,
+ * its signature is not verified again, which saves one of the two
+ * signature checks.  When a new delegation has been verified it is
+ * written to cert_cache.  The cache must only be used for one server
+ * public key and protocol variant.
+ */
+vrt_ret_t vrt_parse_response_cached(uint8_t *nonce_sent, uint32_t nonce_len,
+                                    uint32_t *reply, uint32_t reply_len, const uint8_t *pk,
+                                    uint64_t *out_midpoint, uint32_t *out_radii, unsigned variant,
+                                    uint8_t *cert_cache);
+
+/** Check that a saved delegation is signed by a server
+ *
+ * \param cert_cache pointer to VRT_CERT_CACHE_SIZE bytes written by
+ * vrt_parse_response_cached
+ * \param pk public key for the server, must be 32 bytes long
+ * \param variant protocol variant (i.e. the roughtime draft number)
+ * \returns VRT_SUCCESS if the signature is good
+ *
+ * A cert_cache which has been stored outside of the process, such as
+ * in a file, must be checked with this before it is used again.
+ * Otherwise anyone who can change the stored copy can make
+ * vrt_parse_response_cached accept responses signed with any key.
+ */
+vrt_ret_t vrt_verify_cert_cache(const uint8_t *cert_cache, const uint8_t *pk,
+                                unsigned variant);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,187 @@
+"""Build roughtime responses for the tests of the C code.
+
+This is a small server side implementation of the protocol which
+only uses pycryptodome, so that the C code is not only tested against
+itself.  Keys are made from fixed seeds to make the tests repeatable.
+
+"""
+
+import struct
+
+from Crypto.Hash import SHA512
+from Crypto.PublicKey import ECC
+from Crypto.Signature import eddsa
+
+CONTEXT_CERT = b'RoughTime v1 delegation signature\0'
+OLD_CONTEXT_CERT = b'RoughTime v1 delegation signature--\0'
+CONTEXT_RESP = b'RoughTime v1 response signature\0'
+
+# The C declarations of vrt.h, without the macros and static data
+# which cffi can not handle
+CDEF = '''
+typedef enum {
+  VRT_SUCCESS = 0,
+  VRT_ERROR_TAG_NOT_FOUND,
+  VRT_ERROR_MALFORMED,
+  VRT_ERROR_WRONG_SIZE,
+  VRT_ERROR_NULL_ARGUMENT,
+  VRT_ERROR_TREE,
+  VRT_ERROR_BOUNDS,
+  VRT_ERROR_PUBK,
+  VRT_ERROR_DELE,
+} vrt_ret_t;
+
+vrt_ret_t vrt_precheck_response(uint8_t *nonce_sent, uint32_t nonce_len,
+                                uint32_t *reply, uint32_t reply_len,
+                                unsigned variant);
+vrt_ret_t vrt_parse_response(uint8_t *nonce_sent, uint32_t nonce_len,
+                             uint32_t *reply, uint32_t reply_len, const uint8_t *pk,
+                             uint64_t *out_midpoint, uint32_t *out_radii, unsigned variant);
+vrt_ret_t vrt_parse_response_cached(uint8_t *nonce_sent, uint32_t nonce_len,
+                                    uint32_t *reply, uint32_t reply_len, const uint8_t *pk,
+                                    uint64_t *out_midpoint, uint32_t *out_radii, unsigned variant,
+                                    uint8_t *cert_cache);
+vrt_ret_t vrt_verify_cert_cache(const uint8_t *cert_cache, const uint8_t *pk,
+                                unsigned variant);
+'''
+
+def tag(name):
+    return struct.unpack('<I', name)[0]
+
+def message(tags):
+    """Encode a dict from tag names to values as a roughtime message"""
+    items = sorted(tags.items(), key = lambda item: tag(item[0]))
+    offsets = []
+    data = b''
+    for name, value in items:
+        assert len(value) % 4 == 0
+        offsets.append(len(data))
+        data += value
+    return (struct.pack('<I', len(items)) +
+            b''.join(struct.pack('<I', offset) for offset in offsets[1:]) +
+            b''.join(name for name, value in items) +
+            data)
+
+def packet(msg, variant):
+    """Add the ROUGHTIM header used by variant 5 and later"""
+    if variant >= 5:
+        return b'ROUGHTIM' + struct.pack('<I', len(msg)) + msg
+    return msg
+
+def nodesize(variant):
+    return 32 if variant >= 5 else 64
+
+def hash(data, variant):
+    if variant >= 7:
+        h = SHA512.new(data, truncate = '256').digest()
+    else:
+        h = SHA512.new(data).digest()
+    return h[:nodesize(variant)]
+
+def leaf(nonce, variant):
+    return hash(b'\0' + nonce[:nodesize(variant)], variant)
+
+def node(left, right, variant):
+    return hash(b'\1' + left + right, variant)
+
+def merkle(nonces, variant):
+    """Build a Merkle tree over the nonces
+
+    Returns the root and a list with the path for each nonce.  The
+    tree is padded with zero nodes up to a power of two leaves.
+
+    """
+
+    level = [ leaf(nonce, variant) for nonce in nonces ]
+    paths = [ b'' for nonce in nonces ]
+    index = list(range(len(nonces)))
+    while len(level) > 1:
+        if len(level) % 2:
+            level.append(bytes(nodesize(variant)))
+        for i in range(len(nonces)):
+            paths[i] += level[index[i] ^ 1]
+            index[i] //= 2
+        level = [ node(level[k], level[k + 1], variant)
+                  for k in range(0, len(level), 2) ]
+    return level[0], paths
+
+def vak_tree(leaves):
+    """Build a tree like vak_tree_new over 32 byte leaves
+
+    The nodes are 64 byte SHA-512 hashes and the leaves are padded
+    with copies of the last one.  Returns the root and a list with
+    the path for each leaf.
+
+    """
+
+    depth = 0
+    while (1 << depth) < len(leaves):
+        depth += 1
+    level = [ SHA512.new(b'\0' + leaves[min(i, len(leaves) - 1)]).digest()
+              for i in range(1 << depth) ]
+    paths = [ b'' for leaf in leaves ]
+    for d in range(depth):
+        for i in range(len(leaves)):
+            paths[i] += level[(i >> d) ^ 1]
+        level = [ SHA512.new(b'\1' + level[k] + level[k + 1]).digest()
+                  for k in range(0, len(level), 2) ]
+    return level[0], paths
+
+def mjd(usec):
+    """Encode microseconds since the epoch as used by variant 5 and later"""
+    day, usec = divmod(usec, 86400000000)
+    return ((day + 40587) << 40) | usec
+
+class Server(object):
+    """A server with a long term key and a delegated key"""
+
+    def __init__(self, seed, variant = 7, mint = 0, maxt = 2**52):
+        self.variant = variant
+        self.root_key = ECC.construct(curve = 'Ed25519', seed = bytes([seed]) * 32)
+        self.dele_key = ECC.construct(curve = 'Ed25519', seed = bytes([seed ^ 0xff]) * 32)
+        self.public_key = self.root_key.public_key().export_key(format = 'raw')
+
+        if variant >= 5:
+            mint, maxt = mjd(mint), mjd(maxt)
+        dele = message({
+            b'PUBK': self.dele_key.public_key().export_key(format = 'raw'),
+            b'MINT': struct.pack('<Q', mint),
+            b'MAXT': struct.pack('<Q', maxt),
+        })
+        context = CONTEXT_CERT if variant >= 7 else OLD_CONTEXT_CERT
+        self.cert = message({
+            b'SIG\0': eddsa.new(self.root_key, 'rfc8032').sign(context + dele),
+            b'DELE': dele,
+        })
+
+    def respond(self, nonces, midp, radi = 100000, nonc = False):
+        """Make one response for each nonce, all signed together
+
+        With nonc the nonce is echoed in a NONC tag as in later
+        drafts.
+
+        """
+
+        if self.variant >= 5:
+            midp = mjd(midp)
+        root, paths = merkle(nonces, self.variant)
+        srep = message({
+            b'RADI': struct.pack('<I', radi),
+            b'MIDP': struct.pack('<Q', midp),
+            b'ROOT': root,
+        })
+        sig = eddsa.new(self.dele_key, 'rfc8032').sign(CONTEXT_RESP + srep)
+
+        responses = []
+        for i in range(len(nonces)):
+            tags = {
+                b'SIG\0': sig,
+                b'PATH': paths[i],
+                b'SREP': srep,
+                b'CERT': self.cert,
+                b'INDX': struct.pack('<I', i),
+            }
+            if nonc:
+                tags[b'NONC'] = nonces[i][:nodesize(self.variant)]
+            responses.append(packet(message(tags), self.variant))
+        return responses